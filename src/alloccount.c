@@ -0,0 +1,41 @@
+/*
+ * alloccount.c
+ *
+ * Counts the calls to malloc(), calloc() and realloc() in a program linked
+ * with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc.  Only the calls made
+ * by the objects in the link are counted, not those inside the C library.
+ *
+ * The benchmark reads the count directly.  The filter built with it as
+ * rtcmfilter-counted writes the total to stderr at exit if the environment
+ * variable RTCM_COUNT_ALLOCATIONS is set.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void * __real_malloc(size_t size);
+extern void * __real_calloc(size_t count, size_t size);
+extern void * __real_realloc(void * pointer, size_t size);
+
+unsigned long allocationsSoFar = 0;
+
+void * __wrap_malloc(size_t size) {
+	__atomic_fetch_add(&allocationsSoFar, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t count, size_t size) {
+	__atomic_fetch_add(&allocationsSoFar, 1, __ATOMIC_RELAXED);
+	return __real_calloc(count, size);
+}
+
+void * __wrap_realloc(void * pointer, size_t size) {
+	__atomic_fetch_add(&allocationsSoFar, 1, __ATOMIC_RELAXED);
+	return __real_realloc(pointer, size);
+}
+
+static void __attribute__((destructor)) reportAllocations() {
+	if (getenv("RTCM_COUNT_ALLOCATIONS") != NULL) {
+		fprintf(stderr, "allocations: %lu\n", allocationsSoFar);
+	}
+}
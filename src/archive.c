@@ -0,0 +1,488 @@
+/*
+ * archive.c
+ *
+ * A seekable, block-compressed archive of the RTCM messages that the filter
+ * passes.
+ *
+ * A raw RTCM3 log compressed with gzip can only be read from the start.  The
+ * archive instead stores the messages in blocks that are compressed
+ * independently of each other, so any block can be decompressed on its own.
+ * Blocks are closed at an epoch boundary (after the last observation message
+ * of an epoch, MSM or legacy) once they have reached the configured size, so
+ * a block never holds part of an epoch.  Every block gets an entry in an index
+ * file alongside the archive giving its position and the range of epochs that
+ * it covers.  A time-range query reads the index and decompresses only the
+ * blocks that overlap the range.
+ *
+ * Station messages and ephemerides don't carry an epoch.  They belong with the
+ * observations around them, so a block that starts with them covers the epoch
+ * before it as well, and a block that holds nothing else (at the start of the
+ * stream, or when a block fills up between epochs) covers the epoch before it
+ * and the one after it.  The index entry of such a block is written with the
+ * epoch before it and patched when the next epoch arrives.
+ *
+ * RTCM messages are short and a small block compresses badly on its own, so
+ * every block is compressed against a preset dictionary of RTCM3 traffic.  The
+ * dictionary is either supplied in a file (see "rtcmarchive dictionary") or
+ * taken from the first block of the stream.  It's stored in the archive
+ * header so that the archive is self-contained.
+ *
+ * The archive file is:
+ *
+ *     "RTCMARC1", 4-byte dictionary length, dictionary, block, block ...
+ *
+ * and each block is a raw deflate stream.  The index file has the same name
+ * as the archive plus ".idx" and contains a fixed-length big-endian record
+ * per block - see ArchiveIndexEntry.  Epochs are GPS time in milliseconds.
+ *
+ * The compression is done with zlib.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// rtklib.h declares its own uncompress(), which clashes with zlib's.
+#define uncompress zlib_uncompress
+#include <zlib.h>
+#undef uncompress
+
+#include "rtcmfilter.h"
+
+#define ARCHIVE_MAGIC "RTCMARC1"
+#define LENGTH_OF_ARCHIVE_MAGIC 8
+#define LENGTH_OF_INDEX_ENTRY 40
+#define MAX_DICTIONARY_LENGTH (32 * 1024)
+
+// A block that never sees an epoch boundary is closed anyway at this multiple
+// of the configured block size.
+#define BLOCK_SIZE_LIMIT_FACTOR 4
+
+static int archiving = FALSE;
+static int archiveFile = -1;
+static int indexFile = -1;
+static size_t blockSize = DEFAULT_ARCHIVE_BLOCK_SIZE;
+static off_t archiveOffset = 0;
+
+// The block being built.
+static unsigned char * block = NULL;
+static size_t blockLength = 0;
+static size_t blockCapacity = 0;
+static unsigned int messagesInBlock = 0;
+static int64_t firstEpochInBlock = 0;
+static int64_t lastEpochInBlock = 0;
+static gtime_t epochReference = {0, 0.0};
+static int64_t lastEpochSeen = 0;
+
+// The index entries of the blocks since the last epoch, which hold no epoch
+// of their own.  They follow each other in the index.
+static off_t indexOffset = 0;
+static off_t undatedOffset = 0;
+static unsigned int undatedBlocks = 0;
+static int64_t undatedFirstEpoch = 0;
+
+static unsigned char dictionary[MAX_DICTIONARY_LENGTH];
+static size_t dictionaryLength = 0;
+static int headerWritten = FALSE;
+
+// Statistics.
+static unsigned long int archiveBlocksSoFar = 0;
+static unsigned long long archiveBytesInSoFar = 0;
+static unsigned long long archiveBytesOutSoFar = 0;
+static double archiveCompressionSeconds = 0.0;
+
+static void putUint32(unsigned char * p, uint32_t value) {
+	p[0] = (value >> 24) & 0xff;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+}
+
+static uint32_t getUint32(const unsigned char * p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void putUint64(unsigned char * p, uint64_t value) {
+	putUint32(p, (uint32_t) (value >> 32));
+	putUint32(p + 4, (uint32_t) value);
+}
+
+static uint64_t getUint64(const unsigned char * p) {
+	return ((uint64_t) getUint32(p) << 32) | getUint32(p + 4);
+}
+
+// writeAll writes the whole of a buffer, retrying after short writes.
+static int writeAll(int fd, const unsigned char * data, size_t length) {
+	while (length > 0) {
+		ssize_t n = write(fd, data, length);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return FALSE;
+		}
+		data += n;
+		length -= n;
+	}
+	return TRUE;
+}
+
+static int readAll(int fd, unsigned char * data, size_t length) {
+	while (length > 0) {
+		ssize_t n = read(fd, data, length);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			return FALSE;
+		}
+		data += n;
+		length -= n;
+	}
+	return TRUE;
+}
+
+static double secondsSince(struct timespec * start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// getEpochMilliseconds converts an RTKLIB time to milliseconds.
+int64_t getEpochMilliseconds(gtime_t time) {
+	return (int64_t) time.time * 1000 + (int64_t) floor(time.sec * 1000.0 + 0.5);
+}
+
+static void writeHeader() {
+	unsigned char header[LENGTH_OF_ARCHIVE_MAGIC + 4];
+	memcpy(header, ARCHIVE_MAGIC, LENGTH_OF_ARCHIVE_MAGIC);
+	putUint32(header + LENGTH_OF_ARCHIVE_MAGIC, dictionaryLength);
+	if (!writeAll(archiveFile, header, sizeof(header))
+			|| !writeAll(archiveFile, dictionary, dictionaryLength)) {
+		perror("WARNING: writing archive header");
+	}
+	archiveOffset = sizeof(header) + dictionaryLength;
+	headerWritten = TRUE;
+}
+
+// compressBlock compresses the data as a raw deflate stream using the preset
+// dictionary and returns the compressed length, or 0 on failure.
+static size_t compressBlock(const unsigned char * data, size_t length,
+		unsigned char * output, size_t outputLength) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return 0;
+	}
+	if (dictionaryLength > 0) {
+		deflateSetDictionary(&stream, dictionary, dictionaryLength);
+	}
+	stream.next_in = (unsigned char *) data;
+	stream.avail_in = length;
+	stream.next_out = output;
+	stream.avail_out = outputLength;
+	int status = deflate(&stream, Z_FINISH);
+	size_t compressedLength = stream.total_out;
+	deflateEnd(&stream);
+	return status == Z_STREAM_END ? compressedLength : 0;
+}
+
+// flushBlock compresses the current block, appends it to the archive and adds
+// an entry to the index.
+static void flushBlock() {
+	if (blockLength == 0) {
+		return;
+	}
+
+	if (!headerWritten) {
+		// With no dictionary file, the dictionary is the tail of the first block.
+		if (dictionaryLength == 0) {
+			dictionaryLength = blockLength < MAX_DICTIONARY_LENGTH ? blockLength : MAX_DICTIONARY_LENGTH;
+			memcpy(dictionary, block + blockLength - dictionaryLength, dictionaryLength);
+		}
+		writeHeader();
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size_t outputLength = deflateBound(NULL, blockLength) + 64;
+	unsigned char * output = malloc(outputLength);
+	size_t compressedLength = compressBlock(block, blockLength, output, outputLength);
+	archiveCompressionSeconds += secondsSince(&start);
+
+	if (compressedLength == 0) {
+		fprintf(stderr, "WARNING: archive block compression failed - %ld bytes lost\n", blockLength);
+	} else if (!writeAll(archiveFile, output, compressedLength)) {
+		perror("WARNING: writing archive block");
+	} else {
+		int undated = lastEpochInBlock == 0;
+		if (undated) {
+			lastEpochInBlock = firstEpochInBlock;
+		}
+		unsigned char entry[LENGTH_OF_INDEX_ENTRY];
+		putUint64(entry, archiveOffset);
+		putUint32(entry + 8, compressedLength);
+		putUint32(entry + 12, blockLength);
+		putUint32(entry + 16, messagesInBlock);
+		putUint32(entry + 20, 0);
+		putUint64(entry + 24, firstEpochInBlock);
+		putUint64(entry + 32, lastEpochInBlock);
+		if (!writeAll(indexFile, entry, sizeof(entry))) {
+			perror("WARNING: writing archive index");
+		} else if (undated) {
+			if (undatedBlocks == 0) {
+				undatedOffset = indexOffset;
+				undatedFirstEpoch = firstEpochInBlock;
+			}
+			undatedBlocks++;
+		}
+		indexOffset += sizeof(entry);
+		archiveOffset += compressedLength;
+		archiveBlocksSoFar++;
+		archiveBytesInSoFar += blockLength;
+		archiveBytesOutSoFar += compressedLength;
+	}
+	free(output);
+
+	blockLength = 0;
+	messagesInBlock = 0;
+	firstEpochInBlock = 0;
+	lastEpochInBlock = 0;
+}
+
+// dateBlocks patches the index entries of the blocks since the last epoch to
+// end at the given epoch, and to start at it if there was no epoch before.
+static void dateBlocks(int64_t epoch) {
+	unsigned char epochs[16];
+	putUint64(epochs, undatedFirstEpoch != 0 ? undatedFirstEpoch : epoch);
+	putUint64(epochs + 8, epoch);
+	for (unsigned int i = 0; i < undatedBlocks; i++) {
+		if (pwrite(indexFile, epochs, sizeof(epochs), undatedOffset + i * LENGTH_OF_INDEX_ENTRY + 24)
+				!= sizeof(epochs)) {
+			perror("WARNING: writing archive index");
+		}
+	}
+	undatedBlocks = 0;
+}
+
+// openArchive starts writing an archive to the given file.  If the dictionary
+// file is not NULL, it supplies the preset compression dictionary.  Returns
+// TRUE on success.
+int openArchive(const char * path, const char * dictionaryPath, size_t size) {
+
+	if (size > 0) {
+		blockSize = size;
+	}
+
+	if (dictionaryPath != NULL) {
+		FILE * fh = fopen(dictionaryPath, "r");
+		if (fh == NULL) {
+			fprintf(stderr, "ERROR: can't read archive dictionary <%s>\n", dictionaryPath);
+			return FALSE;
+		}
+		dictionaryLength = fread(dictionary, 1, sizeof(dictionary), fh);
+		fclose(fh);
+	}
+
+	archiveFile = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (archiveFile < 0) {
+		perror("ERROR: opening archive file");
+		return FALSE;
+	}
+
+	char indexPath[strlen(path) + 5];
+	sprintf(indexPath, "%s.idx", path);
+	indexFile = open(indexPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (indexFile < 0) {
+		perror("ERROR: opening archive index file");
+		close(archiveFile);
+		archiveFile = -1;
+		return FALSE;
+	}
+
+	blockCapacity = blockSize * BLOCK_SIZE_LIMIT_FACTOR + MAX_RTCM_MESSAGE_LENGTH;
+	block = malloc(blockCapacity);
+	archiving = TRUE;
+	return TRUE;
+}
+
+// archiveMessage adds an RTCM message to the archive.  The message metadata
+// supplies the epoch.
+void archiveMessage(const unsigned char * message, size_t length, const MessageMetadata * metadata) {
+	if (!archiving) {
+		return;
+	}
+
+	if (blockLength + length > blockCapacity) {
+		flushBlock();
+	}
+
+	memcpy(block + blockLength, message, length);
+	blockLength += length;
+	messagesInBlock++;
+
+	if (!metadata->hasEpoch) {
+		if (firstEpochInBlock == 0) {
+			firstEpochInBlock = lastEpochSeen;
+		}
+		return;
+	}
+
+	// The message only gives the time of week.  The week comes from the
+	// previous epoch, or at the start from the system clock.
+	if (epochReference.time == 0) {
+		epochReference = utc2gpst(timeget());
+	}
+	epochReference = getMessageTime(metadata, epochReference);
+	int64_t epoch = getEpochMilliseconds(epochReference);
+	if (firstEpochInBlock == 0 || epoch < firstEpochInBlock) {
+		firstEpochInBlock = epoch;
+	}
+	if (epoch > lastEpochInBlock) {
+		lastEpochInBlock = epoch;
+	}
+	lastEpochSeen = epoch;
+	if (undatedBlocks > 0) {
+		dateBlocks(epoch);
+	}
+
+	// The sync bit is clear on the last observation message of an epoch.
+	// Only close the block at that point, so that an epoch is never split.
+	if ((!metadata->sync && blockLength >= blockSize)
+			|| blockLength >= blockSize * BLOCK_SIZE_LIMIT_FACTOR) {
+		flushBlock();
+	}
+}
+
+// closeArchive writes any partial block and closes the archive.
+void closeArchive() {
+	if (!archiving) {
+		return;
+	}
+	flushBlock();
+	close(archiveFile);
+	close(indexFile);
+	free(block);
+	block = NULL;
+	archiving = FALSE;
+}
+
+void displayArchiveTotals() {
+	if (archiveBlocksSoFar == 0) {
+		return;
+	}
+	double ratio = (double) archiveBytesInSoFar / archiveBytesOutSoFar;
+	double throughput = archiveCompressionSeconds > 0.0
+			? archiveBytesInSoFar / archiveCompressionSeconds / 1e6 : 0.0;
+	fprintf(stderr, "archive: %ld blocks, %lld bytes in, %lld bytes out, ratio %.2f, compression %.1f MB/s\n",
+			archiveBlocksSoFar, archiveBytesInSoFar, archiveBytesOutSoFar, ratio, throughput);
+}
+
+// openArchiveReader opens an archive and its index for reading.  Returns
+// TRUE on success.
+int openArchiveReader(const char * path, ArchiveReader * reader) {
+	unsigned char header[LENGTH_OF_ARCHIVE_MAGIC + 4];
+
+	memset(reader, 0, sizeof(ArchiveReader));
+	reader->file = open(path, O_RDONLY);
+	if (reader->file < 0) {
+		perror("ERROR: opening archive file");
+		return FALSE;
+	}
+	if (!readAll(reader->file, header, sizeof(header))
+			|| memcmp(header, ARCHIVE_MAGIC, LENGTH_OF_ARCHIVE_MAGIC) != 0) {
+		fprintf(stderr, "ERROR: %s is not an RTCM archive\n", path);
+		close(reader->file);
+		return FALSE;
+	}
+	reader->dictionaryLength = getUint32(header + LENGTH_OF_ARCHIVE_MAGIC);
+	if (reader->dictionaryLength > MAX_DICTIONARY_LENGTH) {
+		fprintf(stderr, "ERROR: archive dictionary too long - %ld\n", reader->dictionaryLength);
+		close(reader->file);
+		return FALSE;
+	}
+	reader->dictionary = malloc(reader->dictionaryLength + 1);
+	if (!readAll(reader->file, reader->dictionary, reader->dictionaryLength)) {
+		fprintf(stderr, "ERROR: archive header is truncated\n");
+		close(reader->file);
+		return FALSE;
+	}
+
+	char indexPath[strlen(path) + 5];
+	sprintf(indexPath, "%s.idx", path);
+	FILE * fh = fopen(indexPath, "r");
+	if (fh == NULL) {
+		fprintf(stderr, "ERROR: can't read archive index <%s>\n", indexPath);
+		close(reader->file);
+		return FALSE;
+	}
+	unsigned char entry[LENGTH_OF_INDEX_ENTRY];
+	size_t capacity = 0;
+	while (fread(entry, 1, sizeof(entry), fh) == sizeof(entry)) {
+		if (reader->blocks == capacity) {
+			capacity = capacity == 0 ? 64 : capacity * 2;
+			reader->index = realloc(reader->index, capacity * sizeof(ArchiveIndexEntry));
+		}
+		ArchiveIndexEntry * e = reader->index + reader->blocks++;
+		e->offset = getUint64(entry);
+		e->compressedLength = getUint32(entry + 8);
+		e->rawLength = getUint32(entry + 12);
+		e->messages = getUint32(entry + 16);
+		e->firstEpoch = (int64_t) getUint64(entry + 24);
+		e->lastEpoch = (int64_t) getUint64(entry + 32);
+	}
+	fclose(fh);
+	return TRUE;
+}
+
+void closeArchiveReader(ArchiveReader * reader) {
+	close(reader->file);
+	free(reader->dictionary);
+	free(reader->index);
+	memset(reader, 0, sizeof(ArchiveReader));
+}
+
+// readArchiveBlock decompresses one block of the archive into a malloc'ed
+// buffer of entry->rawLength bytes.  Returns NULL on failure.
+unsigned char * readArchiveBlock(ArchiveReader * reader, const ArchiveIndexEntry * entry) {
+	unsigned char * compressed = malloc(entry->compressedLength);
+	unsigned char * raw = malloc(entry->rawLength);
+
+	if (lseek(reader->file, entry->offset, SEEK_SET) < 0
+			|| !readAll(reader->file, compressed, entry->compressedLength)) {
+		fprintf(stderr, "ERROR: can't read archive block at offset %lld\n", (long long) entry->offset);
+		free(compressed);
+		free(raw);
+		return NULL;
+	}
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	int status = inflateInit2(&stream, -15);
+	if (status == Z_OK && reader->dictionaryLength > 0) {
+		status = inflateSetDictionary(&stream, reader->dictionary, reader->dictionaryLength);
+	}
+	if (status == Z_OK) {
+		stream.next_in = compressed;
+		stream.avail_in = entry->compressedLength;
+		stream.next_out = raw;
+		stream.avail_out = entry->rawLength;
+		status = inflate(&stream, Z_FINISH);
+	}
+	inflateEnd(&stream);
+	free(compressed);
+
+	if (status != Z_STREAM_END || stream.total_out != entry->rawLength) {
+		fprintf(stderr, "ERROR: archive block at offset %lld is corrupt\n", (long long) entry->offset);
+		free(raw);
+		return NULL;
+	}
+	return raw;
+}
@@ -0,0 +1,190 @@
+/*
+ * decimate.c
+ *
+ * Reduces the rate at which messages of each type are sent.
+ *
+ * A receiver may produce observations at 5Hz for local use when the caster
+ * only needs 1Hz.  Each message type can be given an output interval in
+ * milliseconds and messages that arrive sooner are dropped.  The timing uses
+ * the GNSS epoch in the message header (see getMessageMetadata()) rather than
+ * the time of arrival, so the result is the same whatever the delays in the
+ * input.
+ *
+ * The observation messages of an epoch must be dropped or kept together, or
+ * the rover would get a mixed epoch with some constellations missing.  All of
+ * the observation types with the same interval share a schedule.  Time is
+ * divided into slots of the interval, aligned to the start of the GPS day,
+ * and the first epoch seen in each slot is kept.  Every observation message
+ * for that epoch is kept, whatever its constellation, and the other epochs in
+ * the slot are dropped.  Observation types given different intervals are on
+ * different schedules, so an epoch may lose the message that ends it.  Then
+ * the filter sends an empty message in its place (see endEpoch() in
+ * messagehandler.c), so the rover still sees the end of the epoch.
+ *
+ * Messages without an epoch - station information such as 1005, 1033 and
+ * 1230, and the ephemerides - are throttled on their own schedule, one per
+ * type.  A message is kept if the interval has passed since the last one of
+ * that type was sent.  The time is taken from the latest observation epoch,
+ * so these messages are passed until observations are seen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtcmfilter.h"
+
+#define NUMBER_OF_TYPES 4096
+#define MAX_SCHEDULES 16
+#define MILLISECONDS_PER_DAY 86400000
+
+typedef struct epochSchedule {
+	long interval;				// Milliseconds.
+	int started;
+	uint32_t slot;				// The slot of the last epoch kept.
+	uint32_t keptEpoch;			// The last epoch kept.
+} EpochSchedule;
+
+static int decimating = FALSE;
+
+// For each type, the interval and, for observations, the schedule.
+static long intervalOfType[NUMBER_OF_TYPES];
+static unsigned char scheduleOfType[NUMBER_OF_TYPES];
+static EpochSchedule schedules[MAX_SCHEDULES];
+static int numberOfSchedules = 0;
+
+// For the types without an epoch, when the last one was sent.
+static int sentOfType[NUMBER_OF_TYPES];
+static uint32_t lastSentOfType[NUMBER_OF_TYPES];
+
+// The latest observation epoch seen, milliseconds into the GPS day.
+static int epochSeen = FALSE;
+static uint32_t latestEpoch = 0;
+
+static unsigned long int decimatedByType[NUMBER_OF_TYPES];
+static unsigned long int decimatedSoFar = 0;
+
+static int getSchedule(long interval) {
+	for (int s = 0; s < numberOfSchedules; s++) {
+		if (schedules[s].interval == interval) {
+			return s;
+		}
+	}
+	if (numberOfSchedules == MAX_SCHEDULES) {
+		return -1;
+	}
+	schedules[numberOfSchedules].interval = interval;
+	schedules[numberOfSchedules].started = FALSE;
+	return numberOfSchedules++;
+}
+
+// addDecimation sets the output interval for a list of message types.  The
+// argument is "<list>=<milliseconds>" where the list is as for the type filter,
+// for example "msm=1000" or "1005,1033,1230=10000".  Returns FALSE if the
+// argument is not valid.
+int addDecimation(const char * argument) {
+	const char * equals = strrchr(argument, '=');
+	if (equals == NULL) {
+		fprintf(stderr, "ERROR: decimation <%s> should be <types>=<milliseconds>\n", argument);
+		return FALSE;
+	}
+
+	char * end;
+	long interval = strtol(equals + 1, &end, 10);
+	if (end == equals + 1 || *end != '\0' || interval <= 0 || interval >= MILLISECONDS_PER_DAY) {
+		fprintf(stderr, "ERROR: can't convert <%s> to a decimation interval\n", equals + 1);
+		return FALSE;
+	}
+
+	char list[equals - argument + 1];
+	memcpy(list, argument, equals - argument);
+	list[equals - argument] = '\0';
+	uint64_t types[NUMBER_OF_TYPES / 64] = {0};
+	if (!parseMessageTypes(list, types)) {
+		return FALSE;
+	}
+
+	int schedule = getSchedule(interval);
+	if (schedule < 0) {
+		fprintf(stderr, "ERROR: too many different decimation intervals\n");
+		return FALSE;
+	}
+
+	for (unsigned int type = 0; type < NUMBER_OF_TYPES; type++) {
+		if (types[type / 64] & ((uint64_t) 1 << (type % 64))) {
+			intervalOfType[type] = interval;
+			scheduleOfType[type] = schedule;
+		}
+	}
+	decimating = TRUE;
+	return TRUE;
+}
+
+// keepEpoch decides whether the observations of an epoch are kept.
+static int keepEpoch(EpochSchedule * schedule, uint32_t epoch) {
+	uint32_t slot = epoch / schedule->interval;
+	if (!schedule->started || slot != schedule->slot) {
+		// The first epoch in a new slot.
+		schedule->started = TRUE;
+		schedule->slot = slot;
+		schedule->keptEpoch = epoch;
+		return TRUE;
+	}
+	return epoch == schedule->keptEpoch;
+}
+
+// decimationAllows returns true if the message should be sent.  If not, it's
+// counted as dropped.
+int decimationAllows(const MessageMetadata * metadata) {
+	if (!decimating) {
+		return TRUE;
+	}
+
+	unsigned int type = metadata->type % NUMBER_OF_TYPES;
+	int keep = TRUE;
+
+	if (metadata->hasEpoch) {
+		// Compare epochs within the day, because some GLONASS messages
+		// don't give the day.
+		uint32_t epoch = metadata->epoch % MILLISECONDS_PER_DAY;
+		epochSeen = TRUE;
+		latestEpoch = epoch;
+		if (intervalOfType[type] > 0) {
+			keep = keepEpoch(&schedules[scheduleOfType[type]], epoch);
+		}
+	} else if (intervalOfType[type] > 0 && epochSeen) {
+		uint32_t elapsed = (latestEpoch + MILLISECONDS_PER_DAY - lastSentOfType[type]) % MILLISECONDS_PER_DAY;
+		if (sentOfType[type] && elapsed < intervalOfType[type]) {
+			keep = FALSE;
+		} else {
+			sentOfType[type] = TRUE;
+			lastSentOfType[type] = latestEpoch;
+		}
+	}
+
+	if (!keep) {
+		decimatedByType[type]++;
+		decimatedSoFar++;
+	}
+	return keep;
+}
+
+void resetDecimationTotals() {
+	memset(decimatedByType, 0, sizeof(decimatedByType));
+	decimatedSoFar = 0;
+}
+
+void displayDecimationTotals() {
+	if (decimatedSoFar == 0) {
+		return;
+	}
+	fprintf(stderr, "decimation: %ld dropped", decimatedSoFar);
+	const char * separator = ": ";
+	for (int type = 0; type < NUMBER_OF_TYPES; type++) {
+		if (decimatedByType[type] > 0) {
+			fprintf(stderr, "%s%ld %d", separator, decimatedByType[type], type);
+			separator = ", ";
+		}
+	}
+	fprintf(stderr, ".\n");
+}
@@ -0,0 +1,285 @@
+/*
+ * decodecache.c
+ *
+ * A cache of the results of decoding station messages and ephemerides.
+ *
+ * Every message is checked by running it through the RTKLIB decoder, which
+ * checks the CRC and then decodes the whole message.  Receivers send the
+ * station messages (1005-1008, 1033, 1230) and the ephemerides (1019, 1020,
+ * 1042, 1044, 1045, 1046) over and over with the same content, so most of that
+ * decoding just produces the same result again.
+ *
+ * The cache holds the last few of these frames and the results of decoding
+ * them, keyed by the type, the CRC-24Q carried in the frame and the length.
+ * When a frame arrives that is byte for byte the same as a cached one, it has
+ * already passed the CRC check, so the check and the decoding are skipped and
+ * the decoded station information (sta_t) or ephemeris (eph_t or geph_t) is
+ * put back into the rtcm_t, just as the decoder would have done.  The cache is
+ * small and the least recently used entry is replaced on a miss.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rtcmfilter.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+
+#define DECODE_CACHE_SIZE 64
+
+typedef struct cachedDecode {
+	int used;
+	unsigned long lastUsed;
+	unsigned int type;
+	uint32_t crc;
+	size_t length;
+	int status;					// The value returned by the decoder.
+	int stationID;
+	int sat;					// The satellite of an ephemeris.
+	sta_t sta;
+	eph_t eph;
+	geph_t geph;
+	unsigned char frame[MAX_RTCM_MESSAGE_LENGTH];
+} CachedDecode;
+
+static int caching = FALSE;
+static CachedDecode cache[DECODE_CACHE_SIZE];
+static unsigned long useCounter = 0;
+
+// Statistics.
+static unsigned long int decodeCacheHitsSoFar = 0;
+static unsigned long int decodeCacheMissesSoFar = 0;
+static unsigned long int decodeCacheUncacheableSoFar = 0;
+
+void setDecodeCaching() {
+	caching = TRUE;
+}
+
+static int isCacheable(unsigned int type) {
+	switch (type) {
+	case 1005: case 1006: case 1007: case 1008: case 1033: case 1230:
+	case 1019: case 1020: case 1042: case 1044: case 1045: case 1046:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+// The RTKLIB satellite number of an ephemeris, or 0.  The decoder only sets
+// rtcm->ephsat when the ephemeris is new, so it's taken from the frame.
+static int ephemerisSatellite(const unsigned char * frame, size_t length) {
+	MessageMetadata metadata;
+	if (!getMessageMetadata(frame, length, &metadata) || metadata.satellite == 0) {
+		return 0;
+	}
+	return satno(metadata.system, metadata.satellite);
+}
+
+// remember saves the result of decoding the frame in the rtcm_t.
+static void remember(CachedDecode * entry, const rtcm_t * rtcm, unsigned int type, uint32_t crc,
+		size_t length, int status) {
+	entry->used = TRUE;
+	entry->lastUsed = ++useCounter;
+	entry->type = type;
+	entry->crc = crc;
+	entry->length = length;
+	entry->status = status;
+	entry->stationID = getbitu(rtcm->buff, 36, 12);
+	entry->sat = ephemerisSatellite(rtcm->buff, length);
+	entry->sta = rtcm->sta;
+	if (type == 1020) {
+		int prn;
+		if (entry->sat > 0 && satsys(entry->sat, &prn) == SYS_GLO) {
+			entry->geph = rtcm->nav.geph[prn - 1];
+		}
+	} else if (entry->sat > 0) {
+		entry->eph = rtcm->nav.eph[entry->sat - 1];
+	}
+	memcpy(entry->frame, rtcm->buff, length);
+}
+
+// restoreEphemeris puts a cached ephemeris back, returning what the decoder
+// would - 0 if the ephemeris held is the same issue, otherwise 2.
+static int restoreEphemeris(const CachedDecode * entry, rtcm_t * rtcm) {
+	if (entry->type == 1020) {
+		int prn;
+		satsys(entry->sat, &prn);
+		geph_t * geph = rtcm->nav.geph + prn - 1;
+		if (fabs(timediff(entry->geph.toe, geph->toe)) < 1.0 && entry->geph.svh == geph->svh) {
+			return 0;
+		}
+		*geph = entry->geph;
+	} else {
+		eph_t * eph = rtcm->nav.eph + entry->sat - 1;
+		int same = entry->eph.iode == eph->iode;
+		if (entry->type == 1044) {
+			same = same && entry->eph.iodc == eph->iodc;
+		} else if (entry->type == 1042) {
+			same = same && entry->eph.iodc == eph->iodc && timediff(entry->eph.toe, eph->toe) == 0.0;
+		}
+		if (same) {
+			return 0;
+		}
+		*eph = entry->eph;
+		eph->ttr = rtcm->time;
+	}
+	rtcm->ephsat = entry->sat;
+	return 2;
+}
+
+// testStationID checks the station ID of a station message against the
+// -STA= option and the station seen so far, and records it, as the
+// decoder's test_staid() does.  Returns FALSE if the decoder would reject the
+// message.
+static int testStationID(rtcm_t * rtcm, int stationID) {
+	const char * option = strstr(rtcm->opt, "-STA=");
+	int wanted;
+	if (option != NULL && sscanf(option, "-STA=%d", &wanted) == 1 && stationID != wanted) {
+		return FALSE;
+	}
+	if (rtcm->staid == 0 || rtcm->obsflag) {
+		rtcm->staid = stationID;
+	} else if (stationID != rtcm->staid) {
+		rtcm->staid = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// restore puts the cached result back into the rtcm_t and returns the status
+// that the decoder returned.
+static int restore(const CachedDecode * entry, rtcm_t * rtcm) {
+	rtcm->outtype = entry->type;
+	int status = entry->status;
+
+	switch (entry->type) {
+	case 1005: case 1006: case 1007: case 1008: case 1033:
+		// The decoder checks the station ID of each station message.
+		if (!testStationID(rtcm, entry->stationID)) {
+			return -1;
+		}
+		break;
+	default:
+		break;
+	}
+
+	switch (entry->type) {
+	case 1005: case 1006:
+		rtcm->sta.deltype = entry->sta.deltype;
+		memcpy(rtcm->sta.pos, entry->sta.pos, sizeof(rtcm->sta.pos));
+		memcpy(rtcm->sta.del, entry->sta.del, sizeof(rtcm->sta.del));
+		rtcm->sta.hgt = entry->sta.hgt;
+		rtcm->sta.itrf = entry->sta.itrf;
+		break;
+	case 1007: case 1008:
+		strcpy(rtcm->sta.antdes, entry->sta.antdes);
+		strcpy(rtcm->sta.antsno, entry->sta.antsno);
+		rtcm->sta.antsetup = entry->sta.antsetup;
+		break;
+	case 1033:
+		strcpy(rtcm->sta.antdes, entry->sta.antdes);
+		strcpy(rtcm->sta.antsno, entry->sta.antsno);
+		strcpy(rtcm->sta.rectype, entry->sta.rectype);
+		strcpy(rtcm->sta.recver, entry->sta.recver);
+		strcpy(rtcm->sta.recsno, entry->sta.recsno);
+		rtcm->sta.antsetup = entry->sta.antsetup;
+		break;
+	default:
+		if (entry->sat > 0) {
+			status = restoreEphemeris(entry, rtcm);
+		}
+		break;
+	}
+
+	if (status >= 0) {
+		unsigned int type = entry->type - 1000;
+		if (1 <= type && type <= 299) rtcm->nmsg3[type]++; else rtcm->nmsg3[0]++;
+	}
+	return status;
+}
+
+// checkAndDecode checks the CRC of the frame and decodes it, as
+// input_rtcm3() does when it has a complete frame, but with the two stages
+// accounted separately.
+static int checkAndDecode(rtcm_t * rtcm, unsigned int type) {
+	size_t length = rtcm->len + LENGTH_OF_CRC;
+	rtcm->nbyte = 0;
+	ENTER_STAGE(STAGE_CRC);
+	if (stageCosting) {
+		countStage(STAGE_CRC, 1, length);
+	}
+	if (rtk_crc24q(rtcm->buff, rtcm->len) != getbitu(rtcm->buff, rtcm->len * 8, 24)) {
+		return -2;
+	}
+	if (stageCosting) {
+		enterDecodeStage(type, length);
+	}
+	return decode_rtcm3(rtcm);
+}
+
+// decodeRtcmFrame checks and decodes the complete RTCM3 frame in rtcm->buff,
+// whose length is in rtcm->nbyte, and returns the status that input_rtcm3()
+// would.
+// Station messages and ephemerides that have been decoded before are taken
+// from the cache if caching is turned on.
+int decodeRtcmFrame(rtcm_t * rtcm) {
+	unsigned int type = getbitu(rtcm->buff, 24, 12);
+	size_t length = rtcm->nbyte;
+	size_t lengthWithoutCrc = getbitu(rtcm->buff, 14, 10) + LENGTH_OF_HEADER;
+	rtcm->len = lengthWithoutCrc;
+	if (!caching || !isCacheable(type)) {
+		if (caching) {
+			decodeCacheUncacheableSoFar++;
+		}
+		return checkAndDecode(rtcm, type);
+	}
+
+	if (lengthWithoutCrc + LENGTH_OF_CRC != length) {
+		return checkAndDecode(rtcm, type);
+	}
+	uint32_t crc = getbitu(rtcm->buff, lengthWithoutCrc * 8, 24);
+
+	CachedDecode * victim = cache;
+	for (int e = 0; e < DECODE_CACHE_SIZE; e++) {
+		CachedDecode * entry = cache + e;
+		if (entry->used && entry->type == type && entry->crc == crc && entry->length == length
+				&& memcmp(entry->frame, rtcm->buff, length) == 0) {
+			decodeCacheHitsSoFar++;
+			entry->lastUsed = ++useCounter;
+			rtcm->nbyte = 0;
+			if (stageCosting) {
+				enterDecodeStage(type, length);
+			}
+			return restore(entry, rtcm);
+		}
+		if (!entry->used || (victim->used && entry->lastUsed < victim->lastUsed)) {
+			victim = entry;
+		}
+	}
+
+	decodeCacheMissesSoFar++;
+	int status = checkAndDecode(rtcm, type);
+	if (status >= 0) {
+		remember(victim, rtcm, type, crc, length, status);
+	}
+	return status;
+}
+
+void resetDecodeCacheTotals() {
+	decodeCacheHitsSoFar = 0;
+	decodeCacheMissesSoFar = 0;
+	decodeCacheUncacheableSoFar = 0;
+}
+
+void displayDecodeCacheTotals() {
+	if (!caching) {
+		return;
+	}
+	unsigned long int lookups = decodeCacheHitsSoFar + decodeCacheMissesSoFar;
+	fprintf(stderr, "decode cache: %ld hits, %ld misses (%.1f%% hit rate), %ld messages not cacheable\n",
+			decodeCacheHitsSoFar, decodeCacheMissesSoFar,
+			lookups > 0 ? 100.0 * decodeCacheHitsSoFar / lookups : 0.0,
+			decodeCacheUncacheableSoFar);
+}
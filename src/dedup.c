@@ -0,0 +1,194 @@
+/*
+ * dedup.c
+ *
+ * Suppresses repeats of ephemerides and station messages.
+ *
+ * Receivers send the ephemerides (1019, 1020, 1042, 1044, 1045, 1046) and the
+ * station messages (1005-1008, 1033, 1230) over and over, although their
+ * content only changes every hour or two, if at all.  On a metered link that's
+ * a large share of the bytes that aren't observations.  With deduplication
+ * turned on, a message is only passed if its content has changed or the
+ * refresh interval has passed since it was last sent, so that a rover that
+ * connects late still gets everything within the interval.
+ *
+ * An ephemeris is identified by its type, its satellite and its issue of data
+ * (see getMessageMetadata()).  A new issue of data for the satellite replaces
+ * the old one.  Other messages are identified by their type and a hash of
+ * their content, so a change of content looks like a new message.
+ *
+ * The refresh timing uses the monotonic clock rather than the GNSS epoch, as
+ * the messages may arrive before there are any observations.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtcmfilter.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+
+#define NUMBER_OF_EPHEMERIS_TYPES 7
+#define MAX_SATELLITE_NUMBER 256
+#define MAX_STATION_MESSAGES 64
+
+typedef struct sentEphemeris {
+	int sent;
+	unsigned int iode;
+	struct timespec when;
+} SentEphemeris;
+
+typedef struct sentMessage {
+	unsigned int type;
+	uint64_t hash;
+	struct timespec when;
+} SentMessage;
+
+static int deduplicating = FALSE;
+static double refreshSeconds = 0.0;
+
+static const unsigned int ephemerisTypes[NUMBER_OF_EPHEMERIS_TYPES] = {
+	1019, 1020, 1042, 63, 1044, 1045, 1046
+};
+static SentEphemeris sentEphemerides[NUMBER_OF_EPHEMERIS_TYPES][MAX_SATELLITE_NUMBER];
+static SentMessage sentMessages[MAX_STATION_MESSAGES];
+static int numberOfSentMessages = 0;
+
+// Statistics.
+static unsigned long int dedupPassedSoFar = 0;
+static unsigned long int dedupSuppressedSoFar = 0;
+static unsigned long long dedupBytesPassedSoFar = 0;
+static unsigned long long dedupBytesSuppressedSoFar = 0;
+static unsigned long long otherBytesSoFar = 0;
+
+static double secondsSince(const struct timespec * start, const struct timespec * now) {
+	return (now->tv_sec - start->tv_sec) + (now->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// hashMessage returns the 64-bit FNV-1a hash of the body of a message.
+static uint64_t hashMessage(const unsigned char * message, size_t length) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = LENGTH_OF_HEADER; i < length - LENGTH_OF_CRC; i++) {
+		hash ^= message[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int getEphemerisType(unsigned int type) {
+	for (int t = 0; t < NUMBER_OF_EPHEMERIS_TYPES; t++) {
+		if (ephemerisTypes[t] == type) {
+			return t;
+		}
+	}
+	return -1;
+}
+
+static int isStationMessage(unsigned int type) {
+	switch (type) {
+	case 1005: case 1006: case 1007: case 1008: case 1033: case 1230:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+// setDeduplication suppresses repeated ephemerides and station messages,
+// sending them again after the refresh interval in seconds.  Returns FALSE if
+// the interval is not valid.
+int setDeduplication(double seconds) {
+	if (seconds <= 0.0) {
+		return FALSE;
+	}
+	refreshSeconds = seconds;
+	deduplicating = TRUE;
+	return TRUE;
+}
+
+// checkEphemeris decides whether an ephemeris should be sent.
+static int checkEphemeris(int ephemerisType, const MessageMetadata * metadata, const struct timespec * now) {
+	SentEphemeris * sent = &sentEphemerides[ephemerisType][metadata->satellite % MAX_SATELLITE_NUMBER];
+	if (sent->sent && sent->iode == metadata->iode && secondsSince(&sent->when, now) < refreshSeconds) {
+		return FALSE;
+	}
+	sent->sent = TRUE;
+	sent->iode = metadata->iode;
+	sent->when = *now;
+	return TRUE;
+}
+
+// checkContent decides whether a message should be sent, by the hash of its
+// content.
+static int checkContent(const unsigned char * message, size_t length, unsigned int type,
+		const struct timespec * now) {
+	uint64_t hash = hashMessage(message, length);
+	int oldest = 0;
+	for (int m = 0; m < numberOfSentMessages; m++) {
+		SentMessage * sent = sentMessages + m;
+		if (sent->type == type && sent->hash == hash) {
+			if (secondsSince(&sent->when, now) < refreshSeconds) {
+				return FALSE;
+			}
+			sent->when = *now;
+			return TRUE;
+		}
+		if (secondsSince(&sentMessages[oldest].when, &sent->when) < 0.0) {
+			oldest = m;
+		}
+	}
+
+	// New content.  Replace the message sent longest ago if the table is full.
+	int m = numberOfSentMessages < MAX_STATION_MESSAGES ? numberOfSentMessages++ : oldest;
+	sentMessages[m].type = type;
+	sentMessages[m].hash = hash;
+	sentMessages[m].when = *now;
+	return TRUE;
+}
+
+// deduplicationAllows returns true if the message should be sent.  If not,
+// it's counted as suppressed.
+int deduplicationAllows(const unsigned char * message, size_t length, const MessageMetadata * metadata) {
+	if (!deduplicating || metadata->hasEpoch || isMsmMessage(metadata->type)) {
+		return TRUE;
+	}
+	otherBytesSoFar += length;
+
+	int ephemerisType = getEphemerisType(metadata->type);
+	if (!isStationMessage(metadata->type) && ephemerisType < 0) {
+		return TRUE;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int send = ephemerisType >= 0 && metadata->satellite > 0
+			? checkEphemeris(ephemerisType, metadata, &now)
+			: checkContent(message, length, metadata->type, &now);
+
+	if (send) {
+		dedupPassedSoFar++;
+		dedupBytesPassedSoFar += length;
+	} else {
+		dedupSuppressedSoFar++;
+		dedupBytesSuppressedSoFar += length;
+	}
+	return send;
+}
+
+void resetDeduplicationTotals() {
+	dedupPassedSoFar = 0;
+	dedupSuppressedSoFar = 0;
+	dedupBytesPassedSoFar = 0;
+	dedupBytesSuppressedSoFar = 0;
+	otherBytesSoFar = 0;
+}
+
+void displayDeduplicationTotals() {
+	if (!deduplicating) {
+		return;
+	}
+	fprintf(stderr, "deduplication: refresh %.0f s, %ld passed (%lld bytes), %ld suppressed (%lld bytes, %.0f%% of non-observation bytes)\n",
+			refreshSeconds, dedupPassedSoFar, dedupBytesPassedSoFar,
+			dedupSuppressedSoFar, dedupBytesSuppressedSoFar,
+			otherBytesSoFar > 0 ? 100.0 * dedupBytesSuppressedSoFar / otherBytesSoFar : 0.0);
+}
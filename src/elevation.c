@@ -0,0 +1,369 @@
+/*
+ * elevation.c
+ *
+ * Removes low satellites from the MSM messages.
+ *
+ * Observations of satellites close to the horizon are noisy and most rovers
+ * ignore them, so sending them wastes bandwidth.  Given an elevation mask,
+ * the satellites below it are removed from each MSM (see removeMsmSatellites()
+ * in msm.c).
+ *
+ * The elevation of a satellite is computed from the base station position in
+ * the latest 1005 or 1006 message and the latest broadcast ephemeris of the
+ * satellite (1019, 1020, 1042, 1044, 1045 or 1046), all of which the RTKLIB
+ * decoder keeps in the rtcm_t.  This version of RTKLIB doesn't include the
+ * orbit functions (eph2pos() etc), so the satellite position is computed here
+ * - from the Keplerian elements for GPS, Galileo, QZSS and BeiDou and by
+ * integrating the equations of motion for GLONASS.
+ *
+ * A satellite moves less than a degree a minute across the sky, so the
+ * elevation of each satellite is cached and only recomputed when it's more
+ * than a few seconds old or the ephemeris or station position changes.
+ *
+ * A satellite is kept if its elevation can't be worked out - until the
+ * station position is known, if there is no current ephemeris for it, or if
+ * its constellation is not enabled in this build of RTKLIB.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtcmfilter.h"
+
+#define MSM_SATELLITE_MASK_BIT 97
+
+#define ELEVATION_REFRESH_SECONDS 5.0
+#define MAX_EPHEMERIS_AGE 14400.0			// seconds
+#define STATION_MOVE_LIMIT 100.0			// metres
+
+// Constants for the orbits (IS-GPS-200, Galileo OS SIS ICD, BeiDou ICD and
+// GLONASS ICD).
+#define MU_GPS 3.9860050E14
+#define MU_GAL 3.986004418E14
+#define MU_CMP 3.986004418E14
+#define OMGE_GAL 7.2921151467E-5
+#define OMGE_CMP 7.292115E-5
+#define MU_GLO 3.9860044E14
+#define OMGE_GLO 7.292115E-5
+#define J2_GLO 1.0826257E-3
+#define RE_GLO 6378136.0
+#define GLONASS_STEP 60.0					// seconds
+
+typedef struct cachedElevation {
+	int valid;
+	gtime_t time;				// When the elevation was computed.
+	gtime_t toe;				// The ephemeris it was computed from.
+	double elevation;			// Radians.
+} CachedElevation;
+
+static int masking = FALSE;
+static double mask = 0.0;		// Radians.
+
+static CachedElevation cache[MAXSAT];
+static double cachedStation[3];
+
+// Statistics.
+static unsigned long int satellitesCheckedSoFar = 0;
+static unsigned long int satellitesRemovedSoFar = 0;
+static unsigned long int satellitesUnknownSoFar = 0;
+static unsigned long int elevationMessagesRewrittenSoFar = 0;
+static unsigned long int elevationMessagesDroppedSoFar = 0;
+static unsigned long int elevationsComputedSoFar = 0;
+static double elevationSecondsTotal = 0.0;
+
+// setElevationMask removes satellites below the given elevation in degrees.
+// Returns FALSE if the elevation is not valid.
+int setElevationMask(double degrees) {
+	if (degrees < 0.0 || degrees >= 90.0) {
+		return FALSE;
+	}
+	mask = degrees * D2R;
+	masking = TRUE;
+	return TRUE;
+}
+
+// keplerPosition computes the position of a GPS, Galileo, QZSS or BeiDou
+// satellite from its broadcast ephemeris.
+void keplerPosition(gtime_t time, const eph_t * eph, int system, int prn, double * rs) {
+	double mu = system == SYS_GAL ? MU_GAL : system == SYS_CMP ? MU_CMP : MU_GPS;
+	double omge = system == SYS_GAL ? OMGE_GAL : system == SYS_CMP ? OMGE_CMP : OMGE;
+
+	double tk = timediff(time, eph->toe);
+	double M = eph->M0 + (sqrt(mu / (eph->A * eph->A * eph->A)) + eph->deln) * tk;
+
+	// Solve Kepler's equation for the eccentric anomaly.
+	double E = M, Ek = 0.0;
+	for (int n = 0; fabs(E - Ek) > 1E-13 && n < 30; n++) {
+		Ek = E;
+		E -= (E - eph->e * sin(E) - M) / (1.0 - eph->e * cos(E));
+	}
+	double sinE = sin(E), cosE = cos(E);
+
+	double u = atan2(sqrt(1.0 - eph->e * eph->e) * sinE, cosE - eph->e) + eph->omg;
+	double r = eph->A * (1.0 - eph->e * cosE);
+	double i = eph->i0 + eph->idot * tk;
+	double sin2u = sin(2.0 * u), cos2u = cos(2.0 * u);
+	u += eph->cus * sin2u + eph->cuc * cos2u;
+	r += eph->crs * sin2u + eph->crc * cos2u;
+	i += eph->cis * sin2u + eph->cic * cos2u;
+	double x = r * cos(u), y = r * sin(u), cosi = cos(i);
+
+	if (system == SYS_CMP && (prn <= 5 || prn >= 59)) {
+		// BeiDou geostationary satellites use an inclined frame.
+		double O = eph->OMG0 + eph->OMGd * tk - omge * eph->toes;
+		double sinO = sin(O), cosO = cos(O);
+		double xg = x * cosO - y * cosi * sinO;
+		double yg = x * sinO + y * cosi * cosO;
+		double zg = y * sin(i);
+		double sino = sin(omge * tk), coso = cos(omge * tk);
+		double cos5 = cos(-5.0 * D2R), sin5 = sin(-5.0 * D2R);
+		rs[0] = xg * coso + yg * sino * cos5 + zg * sino * sin5;
+		rs[1] = -xg * sino + yg * coso * cos5 + zg * coso * sin5;
+		rs[2] = -yg * sin5 + zg * cos5;
+		return;
+	}
+
+	double O = eph->OMG0 + (eph->OMGd - omge) * tk - omge * eph->toes;
+	double sinO = sin(O), cosO = cos(O);
+	rs[0] = x * cosO - y * cosi * sinO;
+	rs[1] = x * sinO + y * cosi * cosO;
+	rs[2] = y * sin(i);
+}
+
+// glonassDerivatives gives the derivatives of the GLONASS state (position and
+// velocity) in PZ-90.
+static void glonassDerivatives(const double * x, double * xdot, const double * acc) {
+	double r2 = x[0] * x[0] + x[1] * x[1] + x[2] * x[2];
+	double r3 = r2 * sqrt(r2);
+	double omg2 = OMGE_GLO * OMGE_GLO;
+
+	if (r2 <= 0.0) {
+		memset(xdot, 0, 6 * sizeof(double));
+		return;
+	}
+	double a = 1.5 * J2_GLO * MU_GLO * RE_GLO * RE_GLO / r2 / r3;
+	double b = 5.0 * x[2] * x[2] / r2;
+	double c = -MU_GLO / r3 - a * (1.0 - b);
+	xdot[0] = x[3];
+	xdot[1] = x[4];
+	xdot[2] = x[5];
+	xdot[3] = (c + omg2) * x[0] + 2.0 * OMGE_GLO * x[4] + acc[0];
+	xdot[4] = (c + omg2) * x[1] - 2.0 * OMGE_GLO * x[3] + acc[1];
+	xdot[5] = (c - 2.0 * a) * x[2] + acc[2];
+}
+
+// glonassPosition computes the position of a GLONASS satellite by integrating
+// from the state in the broadcast ephemeris with fourth order Runge-Kutta.
+void glonassPosition(gtime_t time, const geph_t * geph, double * rs) {
+	double x[6], k1[6], k2[6], k3[6], k4[6], w[6];
+	for (int i = 0; i < 3; i++) {
+		x[i] = geph->pos[i];
+		x[i + 3] = geph->vel[i];
+	}
+	double t = timediff(time, geph->toe);
+	while (fabs(t) > 1E-9) {
+		double step = t < 0.0 ? -GLONASS_STEP : GLONASS_STEP;
+		if (fabs(t) < GLONASS_STEP) {
+			step = t;
+		}
+		glonassDerivatives(x, k1, geph->acc);
+		for (int i = 0; i < 6; i++) w[i] = x[i] + k1[i] * step / 2.0;
+		glonassDerivatives(w, k2, geph->acc);
+		for (int i = 0; i < 6; i++) w[i] = x[i] + k2[i] * step / 2.0;
+		glonassDerivatives(w, k3, geph->acc);
+		for (int i = 0; i < 6; i++) w[i] = x[i] + k3[i] * step;
+		glonassDerivatives(w, k4, geph->acc);
+		for (int i = 0; i < 6; i++) x[i] += (k1[i] + 2.0 * k2[i] + 2.0 * k3[i] + k4[i]) * step / 6.0;
+		t -= step;
+	}
+	for (int i = 0; i < 3; i++) {
+		rs[i] = x[i];
+	}
+}
+
+// getSatelliteNumber converts the satellite ID in an MSM (1-64) to an RTKLIB
+// satellite number, or 0 if the constellation isn't enabled.
+static int getSatelliteNumber(int system, int id) {
+	switch (system) {
+	case SYS_SBS:
+		return satno(system, id + MINPRNSBS - 1);
+	case SYS_QZS:
+		return satno(system, id + 192);
+	default:
+		return satno(system, id);
+	}
+}
+
+// getEphemerisTime returns the time of the ephemeris held for a satellite.
+static gtime_t getEphemerisTime(const rtcm_t * rtcm, int sat) {
+	int prn;
+	if (satsys(sat, &prn) == SYS_GLO) {
+		return rtcm->nav.geph[prn - 1].toe;
+	}
+	return rtcm->nav.eph[sat - 1].toe;
+}
+
+// computeElevation computes the elevation of a satellite, returning FALSE if
+// there is no current ephemeris for it.
+static int computeElevation(const rtcm_t * rtcm, int sat, gtime_t time, const double * station,
+		double * elevation, gtime_t * toe) {
+	int prn;
+	int system = satsys(sat, &prn);
+	double rs[3];
+
+	if (system == SYS_GLO) {
+		if (prn < 1 || prn > MAXPRNGLO) {
+			return FALSE;
+		}
+		const geph_t * geph = rtcm->nav.geph + prn - 1;
+		if (geph->sat != sat || fabs(timediff(time, geph->toe)) > MAX_EPHEMERIS_AGE) {
+			return FALSE;
+		}
+		glonassPosition(time, geph, rs);
+		*toe = geph->toe;
+	} else {
+		const eph_t * eph = rtcm->nav.eph + sat - 1;
+		if (eph->sat != sat || eph->A <= 0.0 || fabs(timediff(time, eph->toe)) > MAX_EPHEMERIS_AGE) {
+			return FALSE;
+		}
+		keplerPosition(time, eph, system, prn, rs);
+		*toe = eph->toe;
+	}
+
+	double e[3], pos[3], azel[2];
+	if (geodist(rs, station, e) <= 0.0) {
+		return FALSE;
+	}
+	ecef2pos(station, pos);
+	*elevation = satazel(pos, e, azel);
+	return TRUE;
+}
+
+// getElevation returns the elevation of a satellite from the cache, computing
+// it if necessary.  Returns FALSE if it can't be worked out.
+static int getElevation(const rtcm_t * rtcm, int sat, gtime_t time, const double * station,
+		double * elevation) {
+	CachedElevation * cached = cache + sat - 1;
+	if (cached->valid && fabs(timediff(time, cached->time)) < ELEVATION_REFRESH_SECONDS
+			&& timediff(getEphemerisTime(rtcm, sat), cached->toe) == 0.0) {
+		*elevation = cached->elevation;
+		return TRUE;
+	}
+
+	struct timespec start, finish;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	cached->valid = computeElevation(rtcm, sat, time, station, &cached->elevation, &cached->toe);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	elevationSecondsTotal += (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+	elevationsComputedSoFar++;
+
+	cached->time = time;
+	*elevation = cached->elevation;
+	return cached->valid;
+}
+
+// stationKnown returns TRUE if the station position has arrived.  If it has
+// moved, the cached elevations are thrown away.
+static int stationKnown(const double * station) {
+	if (norm(station, 3) < RE_WGS84 / 2.0) {
+		return FALSE;
+	}
+	double moved[3] = {station[0] - cachedStation[0], station[1] - cachedStation[1], station[2] - cachedStation[2]};
+	if (norm(moved, 3) > STATION_MOVE_LIMIT) {
+		memset(cache, 0, sizeof(cache));
+		memcpy(cachedStation, station, sizeof(cachedStation));
+	}
+	return TRUE;
+}
+
+// belowElevationMask returns TRUE if a satellite is below the elevation mask
+// at the given time - FALSE if the mask is off or the elevation can't be
+// worked out.  It's used for the observations that the decoder has collected,
+// where pruneLowSatellites() works on the messages.
+int belowElevationMask(const rtcm_t * rtcm, int sat, gtime_t time) {
+	if (!masking || !stationKnown(rtcm->sta.pos)) {
+		return FALSE;
+	}
+	double elevation;
+	return getElevation(rtcm, sat, time, rtcm->sta.pos, &elevation) && elevation < mask;
+}
+
+// pruneLowSatellites removes the satellites below the elevation mask from an
+// MSM message, using the station position and ephemerides held by the
+// decoder.  It returns FALSE if the message should be dropped.  Otherwise the
+// length of the rewritten message in the output buffer is set, or 0 if the
+// original message should be sent.
+int pruneLowSatellites(const unsigned char * message, size_t length, const rtcm_t * rtcm,
+		unsigned char * output, size_t * outputLength) {
+	*outputLength = 0;
+	if (!masking) {
+		return TRUE;
+	}
+
+	MessageMetadata metadata;
+	if (!getMessageMetadata(message, length, &metadata) || metadata.system == SYS_NONE) {
+		return TRUE;
+	}
+
+	// The position is only known once a 1005 or 1006 has arrived.
+	const double * station = rtcm->sta.pos;
+	if (!stationKnown(station)) {
+		return TRUE;
+	}
+
+	uint64_t satelliteMask = (uint64_t) getbitu(message, MSM_SATELLITE_MASK_BIT, 32) << 32
+			| getbitu(message, MSM_SATELLITE_MASK_BIT + 32, 32);
+	uint64_t low = 0;
+	for (int id = 1; id <= 64; id++) {
+		uint64_t bit = (uint64_t) 1 << (64 - id);
+		if ((satelliteMask & bit) == 0) {
+			continue;
+		}
+		satellitesCheckedSoFar++;
+		int sat = getSatelliteNumber(metadata.system, id);
+		if (sat == 0) {
+			satellitesUnknownSoFar++;
+			continue;
+		}
+		// The epoch is resolved against the ephemeris, which gives the week.
+		double elevation;
+		gtime_t time = getEpochTime(metadata.epoch, getEphemerisTime(rtcm, sat));
+		if (!getElevation(rtcm, sat, time, station, &elevation)) {
+			satellitesUnknownSoFar++;
+			continue;
+		}
+		if (elevation < mask) {
+			low |= bit;
+		}
+	}
+	if (low == 0) {
+		return TRUE;
+	}
+
+	long result = removeMsmSatellites(message, length, low, output);
+	if (result == 0) {
+		return TRUE;
+	}
+	for (uint64_t bits = low; bits != 0; bits &= bits - 1) {
+		satellitesRemovedSoFar++;
+	}
+	if (result < 0) {
+		elevationMessagesDroppedSoFar++;
+		return FALSE;
+	}
+	elevationMessagesRewrittenSoFar++;
+	*outputLength = result;
+	return TRUE;
+}
+
+void displayElevationTotals() {
+	if (!masking) {
+		return;
+	}
+	fprintf(stderr, "elevation mask %.1f degrees: %ld satellites checked, %ld removed, %ld unknown, %ld messages rewritten (%ld dropped), %ld elevations computed, mean %.1f us\n",
+			mask * R2D, satellitesCheckedSoFar, satellitesRemovedSoFar, satellitesUnknownSoFar,
+			elevationMessagesRewrittenSoFar, elevationMessagesDroppedSoFar, elevationsComputedSoFar,
+			elevationsComputedSoFar > 0 ? elevationSecondsTotal / elevationsComputedSoFar * 1e6 : 0.0);
+}
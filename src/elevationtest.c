@@ -0,0 +1,308 @@
+/*
+ * elevationtest.c
+ *
+ * Tests of the elevation mask in elevation.c - the satellite positions and
+ * the decision about which satellites to remove.
+ *
+ * The position of a GPS satellite is computed from the broadcast ephemeris
+ * given as the example in the RINEX 2.10 specification and checked against
+ * the position worked out independently with the algorithm of IS-GPS-200.
+ * Simple orbits are checked against their positions worked out by hand - a
+ * circular equatorial orbit, which turns at the mean motion less the rotation
+ * of the Earth, and an inclined eccentric orbit at perigee and apogee.
+ *
+ * The position of a GLONASS satellite is integrated from the example in
+ * appendix A of the GLONASS ICD (edition 5.1), and checked against the
+ * result given there to within two metres.  The integration must also run backwards to where it
+ * started.
+ *
+ * The pruning decision is checked with a station on the equator and GPS
+ * satellites in circular equatorial orbits, placed so that their elevations
+ * are known: two above a 10 degree mask, three below it (one only half a
+ * degree below) and one with no ephemeris, which must be kept.  The MSM that
+ * comes out must hold just the satellites that should be kept, with their
+ * observations unchanged.  A message with every satellite below the mask is
+ * dropped, and nothing is removed until the station position is known.
+ *
+ *     make elevationtest && ./elevationtest
+ *
+ * The exit status is 0 if all of the tests pass.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtcmfilter.h"
+
+#define MASK 10.0							// degrees
+#define GPS_RADIUS 26560000.0				// metres, for the test orbits
+
+int verboseMode = 0;
+
+static long failures = 0;
+
+static void checkPosition(const char * what, const double * rs, const double * expected, double tolerance) {
+	double d[3] = {rs[0] - expected[0], rs[1] - expected[1], rs[2] - expected[2]};
+	double error = norm(d, 3);
+	if (error > tolerance) {
+		fprintf(stderr, "%s: position %.3f %.3f %.3f, expected %.3f %.3f %.3f, error %.3f m\n",
+				what, rs[0], rs[1], rs[2], expected[0], expected[1], expected[2], error);
+		failures++;
+	}
+	printf("%s: error %.4f m: %s\n", what, error, error <= tolerance ? "PASS" : "FAIL");
+}
+
+// testRinexExample checks the GPS ephemeris from the RINEX 2.10 example, PRN 6
+// at 1999/09/02 17:51:44.
+static void testRinexExample() {
+	eph_t eph;
+	memset(&eph, 0, sizeof(eph));
+	eph.sat = satno(SYS_GPS, 6);
+	eph.crs = 93.40625;
+	eph.deln = 1.16040547840E-09;
+	eph.M0 = 0.162092304801;
+	eph.cuc = 4.84101474285E-06;
+	eph.e = 6.26740418375E-03;
+	eph.cus = 6.52112066746E-06;
+	eph.A = 5153.65489006 * 5153.65489006;
+	eph.toes = 409904.0;
+	eph.cic = -2.42143869400E-08;
+	eph.OMG0 = 0.329237003460;
+	eph.cis = -5.96046447754E-08;
+	eph.i0 = 1.11541663136;
+	eph.crc = 326.59375;
+	eph.omg = 2.06958726335;
+	eph.OMGd = -6.38312302555E-09;
+	eph.idot = 3.07155651409E-10;
+	eph.toe = gpst2time(1025, eph.toes);
+
+	const double offsets[3] = {0.0, 1800.0, -3600.0};
+	const double expected[3][3] = {
+		{-4237540.536, -18156232.315, 18685002.295},
+		{-3664749.241, -21958970.756, 14205300.550},
+		{-8041595.722, -8934690.114, 23509423.293},
+	};
+	for (int t = 0; t < 3; t++) {
+		double rs[3];
+		char what[80];
+		keplerPosition(timeadd(eph.toe, offsets[t]), &eph, SYS_GPS, 6, rs);
+		sprintf(what, "GPS RINEX example at toe%+.0f s", offsets[t]);
+		checkPosition(what, rs, expected[t], 0.01);
+	}
+}
+
+// circularOrbit sets up an ephemeris for a circular orbit of the given
+// radius and inclination, at the given angle along the orbit from the
+// ascending node (which is on the Greenwich meridian) at the time of the
+// ephemeris.
+static void circularOrbit(eph_t * eph, int sat, gtime_t toe, double radius, double inclination, double angle) {
+	memset(eph, 0, sizeof(eph_t));
+	eph->sat = sat;
+	eph->A = radius;
+	eph->i0 = inclination;
+	eph->M0 = angle;
+	eph->toe = toe;
+	eph->toes = time2gpst(toe, NULL);
+	eph->OMG0 = OMGE * eph->toes;
+}
+
+static void testSimpleOrbits() {
+	gtime_t toe = gpst2time(2068, 388800.0);
+	eph_t eph;
+	double rs[3];
+
+	// An equatorial orbit turns at the mean motion less the Earth's rotation.
+	circularOrbit(&eph, satno(SYS_GPS, 1), toe, GPS_RADIUS, 0.0, 0.0);
+	double n = sqrt(3.9860050E14 / (GPS_RADIUS * GPS_RADIUS * GPS_RADIUS));
+	const double offsets[3] = {0.0, 900.0, 7200.0};
+	for (int t = 0; t < 3; t++) {
+		double angle = (n - OMGE) * offsets[t];
+		double expected[3] = {GPS_RADIUS * cos(angle), GPS_RADIUS * sin(angle), 0.0};
+		char what[80];
+		keplerPosition(timeadd(toe, offsets[t]), &eph, SYS_GPS, 1, rs);
+		sprintf(what, "circular equatorial orbit at toe%+.0f s", offsets[t]);
+		checkPosition(what, rs, expected, 0.001);
+	}
+
+	// A polar orbit with an eccentricity of 0.1, with perigee over the north
+	// pole and apogee over the south pole.
+	circularOrbit(&eph, satno(SYS_GAL, 1), toe, GPS_RADIUS, PI / 2.0, 0.0);
+	eph.e = 0.1;
+	eph.omg = PI / 2.0;
+	double perigee[3] = {0.0, 0.0, GPS_RADIUS * 0.9};
+	keplerPosition(toe, &eph, SYS_GAL, 1, rs);
+	checkPosition("eccentric polar orbit at perigee", rs, perigee, 0.001);
+	eph.M0 = PI;
+	double apogee[3] = {0.0, 0.0, -GPS_RADIUS * 1.1};
+	keplerPosition(toe, &eph, SYS_GAL, 1, rs);
+	checkPosition("eccentric polar orbit at apogee", rs, apogee, 0.001);
+}
+
+// testGlonassExample checks the example in appendix A.3.1.2 of the GLONASS
+// ICD, which integrates from 11700 s to 12300 s of the day.  The ICD works out
+// the lunar and solar accelerations along the way, where the broadcast ones
+// are held constant here, which puts the result about a metre out.
+static void testGlonassExample() {
+	geph_t geph;
+	memset(&geph, 0, sizeof(geph));
+	geph.toe = gpst2time(2068, 11700.0);
+	geph.pos[0] = 7003008.789;
+	geph.pos[1] = -12206626.953;
+	geph.pos[2] = 21280765.625;
+	geph.vel[0] = 783.5417;
+	geph.vel[1] = 2804.2530;
+	geph.vel[2] = 1352.5150;
+	geph.acc[0] = 0.0;
+	geph.acc[1] = 1.7E-06;
+	geph.acc[2] = -5.41E-06;
+
+	double rs[3];
+	double expected[3] = {7523174.853, -10506962.176, 21999239.866};
+	glonassPosition(timeadd(geph.toe, 600.0), &geph, rs);
+	checkPosition("GLONASS ICD example", rs, expected, 2.0);
+
+	// Integrating back from there gives the start.  The velocity there is
+	// taken from the positions half a second either side.
+	geph_t later = geph;
+	later.toe = timeadd(geph.toe, 600.0);
+	memcpy(later.pos, rs, sizeof(rs));
+	double before[3], after[3];
+	glonassPosition(timeadd(geph.toe, 599.5), &geph, before);
+	glonassPosition(timeadd(geph.toe, 600.5), &geph, after);
+	for (int i = 0; i < 3; i++) {
+		later.vel[i] = after[i] - before[i];
+	}
+	glonassPosition(geph.toe, &later, rs);
+	checkPosition("GLONASS integrated forwards and back", rs, geph.pos, 1.0);
+}
+
+// centralAngle gives the angle at the centre of the Earth between a station
+// on the surface and a satellite at the given radius seen at the given
+// elevation.
+static double centralAngle(double elevation, double radius) {
+	return PI / 2.0 - elevation - asin(RE_WGS84 * cos(elevation) / radius);
+}
+
+// encodeEpoch encodes an MSM4 of GPS observations of the given satellites.
+static size_t encodeEpoch(rtcm_t * encoder, gtime_t time, const int * prns, int count, int sync,
+		unsigned char * message) {
+	encoder->time = time;
+	encoder->obs.n = 0;
+	for (int s = 0; s < count; s++) {
+		obsd_t * d = encoder->obs.data + encoder->obs.n++;
+		memset(d, 0, sizeof(obsd_t));
+		d->time = time;
+		d->sat = satno(SYS_GPS, prns[s]);
+		d->P[0] = 2.2E7 + 1000.0 * prns[s];
+		d->L[0] = d->P[0] / (CLIGHT / FREQ1);
+		d->SNR[0] = 180;
+		d->code[0] = CODE_L1C;
+	}
+	if (!gen_rtcm3(encoder, 1074, sync)) {
+		return 0;
+	}
+	memcpy(message, encoder->buff, encoder->nbyte);
+	return encoder->nbyte;
+}
+
+// checkSatellites decodes an MSM and checks that it holds just the given
+// satellites.
+static void checkSatellites(const char * what, const unsigned char * message, size_t length,
+		gtime_t time, const int * prns, int count) {
+	rtcm_t * decoder = calloc(1, sizeof(rtcm_t));
+	init_rtcm(decoder);
+	decoder->time = time;
+	for (size_t i = 0; i < length; i++) {
+		input_rtcm3(decoder, message[i]);
+	}
+	int good = decoder->obs.n == count;
+	for (int s = 0; good && s < count; s++) {
+		const obsd_t * d = decoder->obs.data + s;
+		good = d->sat == satno(SYS_GPS, prns[s]) && fabs(d->P[0] - (2.2E7 + 1000.0 * prns[s])) < 0.1;
+	}
+	if (!good) {
+		fprintf(stderr, "%s: %d satellites, expected %d\n", what, decoder->obs.n, count);
+		for (int s = 0; s < decoder->obs.n; s++) {
+			fprintf(stderr, "    sat %d P %.3f\n", decoder->obs.data[s].sat, decoder->obs.data[s].P[0]);
+		}
+		failures++;
+	}
+	printf("%s: %s\n", what, good ? "PASS" : "FAIL");
+	free_rtcm(decoder);
+	free(decoder);
+}
+
+static void testPruning() {
+	rtcm_t * rtcm = calloc(1, sizeof(rtcm_t));
+	rtcm_t * encoder = calloc(1, sizeof(rtcm_t));
+	init_rtcm(rtcm);
+	init_rtcm(encoder);
+	setElevationMask(MASK);
+
+	// The satellites and their elevations.  PRN 6 has no ephemeris.
+	const int prns[6] = {1, 2, 3, 4, 5, 6};
+	const double elevations[5] = {45.0, MASK + 0.5, MASK - 0.5, 3.0, -20.0};
+	const int kept[3] = {1, 2, 6};
+	const int below[3] = {3, 4, 5};
+
+	gtime_t time = gpst2time(2068, 388800.0);
+	for (int s = 0; s < 5; s++) {
+		circularOrbit(rtcm->nav.eph + satno(SYS_GPS, prns[s]) - 1, satno(SYS_GPS, prns[s]), time,
+				GPS_RADIUS, 0.0, centralAngle(elevations[s] * D2R, GPS_RADIUS));
+	}
+
+	unsigned char message[MAX_RTCM_MESSAGE_LENGTH];
+	unsigned char output[MAX_RTCM_MESSAGE_LENGTH];
+	size_t outputLength;
+	size_t length = encodeEpoch(encoder, time, prns, 6, 0, message);
+
+	// Nothing is removed until the station position is known.
+	if (!pruneLowSatellites(message, length, rtcm, output, &outputLength) || outputLength != 0) {
+		fprintf(stderr, "satellites removed with no station position\n");
+		failures++;
+	}
+	printf("no station position: %s\n", outputLength == 0 ? "PASS" : "FAIL");
+
+	// The station is on the equator on the Greenwich meridian.
+	rtcm->sta.pos[0] = RE_WGS84;
+	if (!pruneLowSatellites(message, length, rtcm, output, &outputLength) || outputLength == 0) {
+		fprintf(stderr, "no satellites removed below the mask\n");
+		failures++;
+		printf("satellites below the mask: FAIL\n");
+	} else {
+		checkSatellites("satellites below the mask", output, outputLength, time, kept, 3);
+	}
+
+	// A message with only satellites below the mask is dropped, unless it
+	// ends the epoch.
+	length = encodeEpoch(encoder, time, below, 3, 1, message);
+	int dropped = !pruneLowSatellites(message, length, rtcm, output, &outputLength);
+	length = encodeEpoch(encoder, time, below, 3, 0, message);
+	int endKept = pruneLowSatellites(message, length, rtcm, output, &outputLength);
+	if (endKept && outputLength > 0) {
+		checkSatellites("all below the mask at the end of the epoch", output, outputLength, time, NULL, 0);
+	} else {
+		failures++;
+		printf("all below the mask at the end of the epoch: FAIL\n");
+	}
+	if (!dropped) {
+		fprintf(stderr, "message with all satellites below the mask not dropped\n");
+		failures++;
+	}
+	printf("all below the mask: %s\n", dropped ? "PASS" : "FAIL");
+
+	free_rtcm(rtcm);
+	free_rtcm(encoder);
+	free(rtcm);
+	free(encoder);
+}
+
+int main() {
+	testRinexExample();
+	testSimpleOrbits();
+	testGlonassExample();
+	testPruning();
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+/*
+ * fastpath.c
+ *
+ * The fast path for streams that are already pure RTCM.
+ *
+ * Many receivers are set up to send nothing but RTCM3, so every frame starts
+ * where the last one ended.  With the fast path turned on, once the stream
+ * has stayed aligned like that for a run of frames, getRtcmFrames() stops
+ * running each frame through the RTKLIB decoder.  It just takes the length
+ * from the header, checks the CRC over the frame where it lies in the input
+ * and passes it to the filters, which only need the header.  The moment a
+ * frame fails the CRC check or anything but a frame turns up between frames,
+ * alignment is lost and the filter goes back to scanning and decoding every
+ * frame until it has seen another run.
+ *
+ * The elevation mask and the legacy observations need every frame decoded,
+ * so they can't be used with the fast path.  A frame with a good CRC that the
+ * decoder would reject is passed on while the stream is aligned.
+ *
+ * The time spent in each mode, the frames and bytes handled in each and the
+ * number of times alignment was lost are reported with the totals.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "rtcmfilter.h"
+
+#define LENGTH_OF_CRC 3
+
+#define SCANNING 0
+#define ALIGNED 1
+
+static int enabled = FALSE;
+static unsigned long runNeeded = DEFAULT_FAST_PATH_RUN;
+
+static int mode = SCANNING;
+static unsigned long run = 0;		// Back-to-back good frames while scanning.
+static struct timespec modeStarted;
+
+// Statistics.
+static double secondsInMode[2];
+static unsigned long int framesInMode[2];
+static unsigned long long bytesInMode[2];
+static unsigned long int alignmentsSoFar = 0;
+static unsigned long int alignmentsLostSoFar = 0;
+
+// setFastPath turns on the fast path, which starts after the given number of
+// back-to-back good frames, or the default if it's 0.
+void setFastPath(unsigned long frames) {
+	enabled = TRUE;
+	if (frames > 0) {
+		runNeeded = frames;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &modeStarted);
+}
+
+int inFastPath() {
+	return mode == ALIGNED;
+}
+
+// The time in the current mode is added up when the mode changes and when
+// the totals are reported.
+static void accountTime() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secondsInMode[mode] += (now.tv_sec - modeStarted.tv_sec) + (now.tv_nsec - modeStarted.tv_nsec) / 1e9;
+	modeStarted = now;
+}
+
+static void setMode(int newMode) {
+	if (newMode != mode) {
+		accountTime();
+		mode = newMode;
+	}
+}
+
+// fastPathCheck checks the CRC of a frame that arrived while the stream is
+// aligned, in place of the decoder.
+int fastPathCheck(const unsigned char * frame, size_t length) {
+	ENTER_STAGE(STAGE_CRC);
+	if (stageCosting) {
+		countStage(STAGE_CRC, 1, length);
+	}
+	return rtk_crc24q(frame, length - LENGTH_OF_CRC)
+			== getbitu(frame, (length - LENGTH_OF_CRC) * 8, 24);
+}
+
+// fastPathFrame notes a good frame that started where the last one ended.
+void fastPathFrame(size_t length) {
+	if (!enabled) {
+		return;
+	}
+	framesInMode[mode]++;
+	bytesInMode[mode] += length;
+	if (mode == SCANNING && ++run >= runNeeded) {
+		setMode(ALIGNED);
+		alignmentsSoFar++;
+	}
+}
+
+// fastPathLost notes a bad frame or bytes that are not part of a frame.
+void fastPathLost() {
+	if (!enabled) {
+		return;
+	}
+	run = 0;
+	if (mode == ALIGNED) {
+		setMode(SCANNING);
+		alignmentsLostSoFar++;
+	}
+}
+
+void resetFastPathTotals() {
+	if (enabled) {
+		accountTime();
+	}
+	for (int m = SCANNING; m <= ALIGNED; m++) {
+		secondsInMode[m] = 0.0;
+		framesInMode[m] = 0;
+		bytesInMode[m] = 0;
+	}
+	alignmentsSoFar = 0;
+	alignmentsLostSoFar = 0;
+}
+
+// writeFastPathStats writes the time and traffic in each mode.
+void writeFastPathStats(FILE * out) {
+	if (!enabled) {
+		return;
+	}
+	accountTime();
+	double total = secondsInMode[SCANNING] + secondsInMode[ALIGNED];
+	fprintf(out, "fast path aligned: %.3f s (%.1f%%), %lu frames, %llu bytes\n",
+			secondsInMode[ALIGNED], total > 0.0 ? 100.0 * secondsInMode[ALIGNED] / total : 0.0,
+			framesInMode[ALIGNED], bytesInMode[ALIGNED]);
+	fprintf(out, "fast path scanning: %.3f s (%.1f%%), %lu frames, %llu bytes\n",
+			secondsInMode[SCANNING], total > 0.0 ? 100.0 * secondsInMode[SCANNING] / total : 0.0,
+			framesInMode[SCANNING], bytesInMode[SCANNING]);
+	fprintf(out, "fast path transitions: aligned %lu times, lost alignment %lu times\n",
+			alignmentsSoFar, alignmentsLostSoFar);
+}
+
+void displayFastPathTotals() {
+	if (!enabled) {
+		return;
+	}
+	accountTime();
+	double total = secondsInMode[SCANNING] + secondsInMode[ALIGNED];
+	unsigned long int frames = framesInMode[SCANNING] + framesInMode[ALIGNED];
+	fprintf(stderr, "fast path: aligned %.1f%% of the time, %.1f%% of the frames, aligned %ld times, lost alignment %ld times\n",
+			total > 0.0 ? 100.0 * secondsInMode[ALIGNED] / total : 0.0,
+			frames > 0 ? 100.0 * framesInMode[ALIGNED] / frames : 0.0,
+			alignmentsSoFar, alignmentsLostSoFar);
+}
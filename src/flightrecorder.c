@@ -0,0 +1,357 @@
+/*
+ * flightrecorder.c
+ *
+ * A flight recorder - a ring buffer in memory that holds the recent history
+ * of the filter in a compact binary form: the raw data of each read from the
+ * input, the changes of state of the framer, the decision taken about each
+ * frame, the bytes discarded, the fragments carried over and the writes.
+ *
+ * Verbose mode writes a hex dump of the same things to stderr as it goes,
+ * which is slow enough to change the timing of the problem being chased, and
+ * only covers the first few buffers.  Recording into memory is cheap, so the
+ * recorder can run all the time.  Its contents are dumped to a file on
+ * SIGUSR2 or when there is a burst of CRC failures.  The dump holds the
+ * records of the last minute or so, oldest first, and rtcmflight prints it.
+ *
+ * The ring can be kept in a memory-mapped file rather than ordinary memory.
+ * Then the kernel writes it back to the file, so the history survives the
+ * filter crashing, and rtcmflight can read the file directly.  A ring file
+ * left by an earlier run holds the history leading up to a crash, so it's
+ * renamed with ".prev" added before the new ring is created rather than
+ * overwritten.
+ *
+ * Each record is a FlightRecord header followed by a payload, padded to a
+ * multiple of 8 bytes.  Records never wrap around the end of the ring - if a
+ * record doesn't fit, the space at the end is filled with a padding record
+ * (or left, if it's too small for one) and the record goes at the start.
+ * Writing a record reclaims the oldest records that it overlaps.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rtcmfilter.h"
+
+#define CRC_BURST_COUNT 5			// CRC failures...
+#define CRC_BURST_SECONDS 1			// ...within this time trigger a dump,
+#define MIN_SECONDS_BETWEEN_DUMPS 60	// but not too often.
+#define MAX_FLIGHT_RECORD_LENGTH 0xfff8
+
+static FlightRecorderHeader * recorder = NULL;
+static unsigned char * ring = NULL;
+static const char * dumpPath = NULL;
+static long keepSeconds = DEFAULT_FLIGHT_RECORDER_SECONDS;
+
+static uint64_t crcFailureTimes[CRC_BURST_COUNT];
+static int nextCrcFailure = 0;
+static uint64_t lastDump = 0;
+
+// Statistics.
+static unsigned long int dumpsSoFar = 0;
+
+static uint64_t nanosecondsNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void setWallClockOffset(FlightRecorderHeader * header) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	header->wallClockOffset = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec
+			- (int64_t) nanosecondsNow();
+}
+
+// recordLengthAt returns the length of the record at a position in a ring,
+// treating a gap at the end that's too small for a record as padding.
+static uint64_t recordLengthAt(const FlightRecorderHeader * header, const unsigned char * records,
+		uint64_t position) {
+	if (header->size - position < sizeof(FlightRecord)) {
+		return header->size - position;
+	}
+	return ((const FlightRecord *) (records + position))->length;
+}
+
+// reclaim discards the oldest records while they lie in [from, to).
+static void reclaim(uint64_t from, uint64_t to) {
+	while (!recorder->empty && recorder->tail >= from && recorder->tail < to) {
+		recorder->tail += recordLengthAt(recorder, ring, recorder->tail);
+		if (recorder->tail >= recorder->size) {
+			recorder->tail = 0;
+		}
+		if (recorder->tail == recorder->head) {
+			recorder->empty = TRUE;
+		}
+	}
+}
+
+// addRecord adds a record with an optional payload to the ring.
+static void addRecord(int kind, int detail, uint32_t value, const void * payload, size_t payloadLength) {
+	uint64_t length = (sizeof(FlightRecord) + payloadLength + 7) & ~7UL;
+	if (length > MAX_FLIGHT_RECORD_LENGTH) {
+		return;
+	}
+
+	if (recorder->size - recorder->head < length) {
+		// It doesn't fit at the end.  Pad the end out and start again at 0.
+		reclaim(recorder->head, recorder->size);
+		if (recorder->size - recorder->head >= sizeof(FlightRecord)) {
+			FlightRecord * padding = (FlightRecord *) (ring + recorder->head);
+			padding->nanoseconds = 0;
+			padding->length = recorder->size - recorder->head;
+			padding->kind = FR_PADDING;
+		}
+		if (recorder->empty) {
+			recorder->tail = 0;
+		}
+		recorder->head = 0;
+	}
+	reclaim(recorder->head, recorder->head + length);
+	if (recorder->empty) {
+		recorder->tail = recorder->head;
+		recorder->empty = FALSE;
+	}
+
+	FlightRecord * record = (FlightRecord *) (ring + recorder->head);
+	record->nanoseconds = nanosecondsNow();
+	record->length = length;
+	record->kind = kind;
+	record->detail = detail;
+	record->value = value;
+	if (payloadLength > 0) {
+		memcpy(record + 1, payload, payloadLength);
+	}
+	recorder->head += length;
+	if (recorder->head >= recorder->size) {
+		recorder->head = 0;
+	}
+}
+
+// setFlightRecorder starts recording.  Dumps go to files named after the
+// given path with the time added.  If ringPath is not NULL, the ring is kept
+// in that memory-mapped file.  Returns FALSE on failure.
+int setFlightRecorder(const char * path, const char * ringPath, long seconds) {
+	size_t totalSize = sizeof(FlightRecorderHeader) + FLIGHT_RECORDER_SIZE;
+	void * memory;
+	if (ringPath != NULL) {
+		char previous[strlen(ringPath) + 6];
+		sprintf(previous, "%s.prev", ringPath);
+		if (rename(ringPath, previous) == 0) {
+			fprintf(stderr, "flight recorder: the last ring is kept in %s\n", previous);
+		} else if (errno != ENOENT) {
+			perror("ERROR: keeping the last flight recorder ring");
+			return FALSE;
+		}
+		int file = open(ringPath, O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (file < 0 || ftruncate(file, totalSize) != 0) {
+			perror("ERROR: creating the flight recorder ring");
+			return FALSE;
+		}
+		memory = mmap(NULL, totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		close(file);
+		if (memory == MAP_FAILED) {
+			perror("ERROR: mapping the flight recorder ring");
+			return FALSE;
+		}
+	} else {
+		memory = calloc(1, totalSize);
+		if (memory == NULL) {
+			return FALSE;
+		}
+	}
+
+	recorder = memory;
+	ring = (unsigned char *) (recorder + 1);
+	memcpy(recorder->magic, FLIGHT_RECORDER_MAGIC, sizeof(recorder->magic));
+	recorder->size = FLIGHT_RECORDER_SIZE;
+	recorder->head = 0;
+	recorder->tail = 0;
+	recorder->empty = TRUE;
+	setWallClockOffset(recorder);
+	dumpPath = path;
+	if (seconds > 0) {
+		keepSeconds = seconds;
+	}
+	return TRUE;
+}
+
+int flightRecording() {
+	return recorder != NULL;
+}
+
+void recordRead(const unsigned char * data, size_t length) {
+	if (recorder != NULL) {
+		addRecord(FR_READ, 0, length, data, length);
+	}
+}
+
+void recordState(unsigned int state, size_t position) {
+	if (recorder != NULL) {
+		addRecord(FR_STATE, state, position, NULL, 0);
+	}
+}
+
+// recordFrame records the decision taken about a frame.  A burst of CRC
+// failures triggers a dump.
+void recordFrame(int decision, unsigned int type, size_t position, size_t length, int status) {
+	if (recorder == NULL) {
+		return;
+	}
+	FlightFrame frame = { position, length, status, 0 };
+	addRecord(FR_FRAME, decision, type, &frame, sizeof(frame));
+
+	if (decision == FR_CRC_FAILURE) {
+		uint64_t now = nanosecondsNow();
+		uint64_t oldest = crcFailureTimes[nextCrcFailure];
+		crcFailureTimes[nextCrcFailure] = now;
+		nextCrcFailure = (nextCrcFailure + 1) % CRC_BURST_COUNT;
+		if (oldest > 0 && now - oldest < CRC_BURST_SECONDS * 1000000000ULL
+				&& (lastDump == 0 || now - lastDump >= MIN_SECONDS_BETWEEN_DUMPS * 1000000000ULL)) {
+			dumpFlightRecorder("crc burst");
+		}
+	}
+}
+
+void recordEaten(size_t length) {
+	if (recorder != NULL) {
+		addRecord(FR_EATEN, 0, length, NULL, 0);
+	}
+}
+
+void recordFragment(size_t length) {
+	if (recorder != NULL) {
+		addRecord(FR_FRAGMENT, 0, length, NULL, 0);
+	}
+}
+
+void recordWrite(size_t length) {
+	if (recorder != NULL) {
+		addRecord(FR_WRITE, 0, length, NULL, 0);
+	}
+}
+
+// dumpFlightRecorder writes the records of the last few seconds to a new
+// file, oldest first.
+void dumpFlightRecorder(const char * reason) {
+	if (recorder == NULL) {
+		return;
+	}
+	addRecord(FR_DUMP, 0, 0, reason, strlen(reason) + 1);
+
+	uint64_t now = nanosecondsNow();
+	lastDump = now;
+	uint64_t since = now > keepSeconds * 1000000000ULL ? now - keepSeconds * 1000000000ULL : 0;
+
+	time_t wallClock = time(NULL);
+	struct tm * tm = gmtime(&wallClock);
+	char path[strlen(dumpPath) + 24];
+	sprintf(path, "%s.%04d%02d%02d-%02d%02d%02d", dumpPath,
+			tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+	FILE * out = fopen(path, "w");
+	if (out == NULL) {
+		perror("WARNING: dumping the flight recorder");
+		return;
+	}
+
+	// The dump is a ring that hasn't wrapped, so the reader handles both.
+	FlightRecorderHeader header = *recorder;
+	setWallClockOffset(&header);
+	header.head = 0;
+	header.tail = 0;
+	header.empty = TRUE;
+	fwrite(&header, sizeof(header), 1, out);
+
+	uint64_t position = recorder->tail;
+	int first = TRUE;
+	while (!recorder->empty && (first || position != recorder->head)) {
+		first = FALSE;
+		uint64_t length = recordLengthAt(recorder, ring, position);
+		const FlightRecord * record = (const FlightRecord *) (ring + position);
+		if (length >= sizeof(FlightRecord) && record->kind != FR_PADDING && record->nanoseconds >= since) {
+			fwrite(record, length, 1, out);
+			header.head += length;
+			header.empty = FALSE;
+		}
+		position += length;
+		if (position >= recorder->size) {
+			position = 0;
+		}
+	}
+	// It's a full ring that starts at 0.
+	header.size = header.head;
+	header.head = 0;
+
+	// Now that the length is known, rewrite the header.
+	fseek(out, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, out);
+	if (fclose(out) != 0) {
+		perror("WARNING: dumping the flight recorder");
+		return;
+	}
+	dumpsSoFar++;
+	fprintf(stderr, "flight recorder dumped to %s (%s)\n", path, reason);
+}
+
+// readFlightRecords calls the given function for each record in a dump or a
+// ring file, oldest first.  Returns FALSE if the file is not valid.
+int readFlightRecords(const char * path, void (* handle)(const FlightRecorderHeader * header,
+		const FlightRecord * record)) {
+	FILE * in = fopen(path, "r");
+	if (in == NULL) {
+		perror(path);
+		return FALSE;
+	}
+	FlightRecorderHeader header;
+	if (fread(&header, sizeof(header), 1, in) != 1
+			|| memcmp(header.magic, FLIGHT_RECORDER_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "%s is not a flight recorder file\n", path);
+		fclose(in);
+		return FALSE;
+	}
+	unsigned char * records = malloc(header.size > 0 ? header.size : 1);
+	if (records == NULL || fread(records, 1, header.size, in) != header.size) {
+		fprintf(stderr, "%s is truncated\n", path);
+		free(records);
+		fclose(in);
+		return FALSE;
+	}
+	fclose(in);
+
+	uint64_t position = header.tail;
+	int first = TRUE;
+	while (!header.empty && (first || position != header.head)) {
+		first = FALSE;
+		uint64_t length = recordLengthAt(&header, records, position);
+		const FlightRecord * record = (const FlightRecord *) (records + position);
+		if (length == 0 || position + length > header.size) {
+			fprintf(stderr, "%s has a damaged record at %lld\n", path, (long long) position);
+			break;
+		}
+		if (length >= sizeof(FlightRecord) && record->kind != FR_PADDING) {
+			handle(&header, record);
+		}
+		position += length;
+		if (position >= header.size) {
+			position = 0;
+		}
+	}
+	free(records);
+	return TRUE;
+}
+
+void displayFlightRecorderTotals() {
+	if (recorder == NULL) {
+		return;
+	}
+	fprintf(stderr, "flight recorder: %lld bytes used of %lld, %ld dumps\n",
+			(long long) (recorder->empty ? 0
+					: recorder->head > recorder->tail ? recorder->head - recorder->tail
+					: recorder->size - recorder->tail + recorder->head),
+			(long long) recorder->size, dumpsSoFar);
+}
@@ -0,0 +1,199 @@
+/*
+ * framer.c
+ *
+ * The framer of librtcmfilter - see rtcmframer.h for the API - and of the
+ * filter itself, which drives it through getRtcmFrames().
+ *
+ * The framing is: skip to a 0xd3, take the length from the header, hand the
+ * whole frame to a handler that checks it, and if the handler says it's bad,
+ * skip the 0xd3 and scan on from the next byte.  The library's handler checks
+ * the CRC-24Q and passes the frame to the caller's callback.  The filter's
+ * handler runs the frame through the RTKLIB decoder (or just checks the CRC
+ * on the fast path) and then the filters, so RTKLIB can reject a frame with a
+ * good CRC there.
+ *
+ * A frame that lies wholly within the span being pushed is handed over where
+ * it is.  A frame that runs off the end of a span is copied into the carry
+ * buffer, the following pushes fill that up to the end of the header and
+ * then to the length of the frame, and it's handed over from there.  If it
+ * then turns out to be bad, the scan resumes from the next 0xd3 in the carry
+ * buffer, which holds the bytes of the stream immediately before the rest of
+ * the span, so nothing is lost.
+ *
+ * The positions given to the handlers are offsets from the start of the
+ * carried fragment, as if it had been joined to the span.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtcmfilter.h"
+#include "rtcmframer.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+#define RTCM_HEADER_BYTE 0xd3
+
+struct rtcmFramer {
+	FramerHandlers handlers;
+	void * context;
+	RtcmFrameCallback callback;	// For a framer made by rtcmFramerCreate().
+	void * callbackContext;
+	size_t carried;			// Bytes of a frame from earlier pushes in the carry buffer.
+	RtcmFramerCounts counts;
+	unsigned char carry[MAX_RTCM_MESSAGE_LENGTH];
+};
+
+static size_t frameLength(const unsigned char * frame) {
+	return getbitu(frame, 14, 10) + LENGTH_OF_HEADER + LENGTH_OF_CRC;
+}
+
+static int goodCrc(const unsigned char * frame, size_t length) {
+	return rtk_crc24q(frame, length - LENGTH_OF_CRC)
+			== getbitu(frame, (length - LENGTH_OF_CRC) * 8, 24);
+}
+
+// deliver is the library's frame handler.  It checks the CRC and hands a good
+// frame to the callback.
+static int deliver(const unsigned char * frame, size_t length, size_t position __attribute__((__unused__)),
+		int inCarry __attribute__((__unused__)), void * context) {
+	RtcmFramer * framer = context;
+	if (!goodCrc(frame, length)) {
+		return FALSE;
+	}
+	MessageMetadata metadata;
+	getMessageMetadata(frame, length, &metadata);
+	framer->callback(frame, length, metadata.type, metadata.stationID,
+			metadata.hasEpoch ? (int64_t) metadata.epoch : -1, framer->callbackContext);
+	return TRUE;
+}
+
+// createFramer returns a new framer that passes each complete frame to the
+// given handlers, or NULL if there's no memory.
+RtcmFramer * createFramer(const FramerHandlers * handlers, void * context) {
+	RtcmFramer * framer = calloc(1, sizeof(RtcmFramer));
+	if (framer != NULL) {
+		framer->handlers = *handlers;
+		framer->context = context;
+	}
+	return framer;
+}
+
+RtcmFramer * rtcmFramerCreate(RtcmFrameCallback callback, void * context) {
+	static const FramerHandlers handlers = { deliver, NULL, NULL };
+	RtcmFramer * framer = createFramer(&handlers, NULL);
+	if (framer != NULL) {
+		framer->context = framer;
+		framer->callback = callback;
+		framer->callbackContext = context;
+	}
+	return framer;
+}
+
+void rtcmFramerDestroy(RtcmFramer * framer) {
+	free(framer);
+}
+
+void rtcmFramerReset(RtcmFramer * framer) {
+	framer->counts.bytesDiscarded += framer->carried;
+	framer->carried = 0;
+}
+
+void rtcmFramerGetCounts(const RtcmFramer * framer, RtcmFramerCounts * counts) {
+	*counts = framer->counts;
+}
+
+static void skip(RtcmFramer * framer, size_t length, size_t position) {
+	framer->counts.bytesDiscarded += length;
+	if (framer->handlers.skipped != NULL) {
+		framer->handlers.skipped(length, position, framer->context);
+	}
+}
+
+static int handle(RtcmFramer * framer, const unsigned char * frame, size_t length, size_t position,
+		int inCarry) {
+	if (framer->handlers.frame(frame, length, position, inCarry, framer->context)) {
+		framer->counts.frames++;
+		return TRUE;
+	}
+	framer->counts.crcFailures++;
+	framer->counts.bytesDiscarded++;
+	return FALSE;
+}
+
+static void carried(RtcmFramer * framer, size_t position) {
+	if (framer->handlers.carried != NULL) {
+		framer->handlers.carried(framer->carried, position, framer->context);
+	}
+}
+
+// dropCarried removes the given number of bytes from the start of the carry
+// buffer, and then any more up to the next 0xd3, which are skipped.
+static void dropCarried(RtcmFramer * framer, size_t dropped, size_t position) {
+	const unsigned char * next = memchr(framer->carry + dropped, RTCM_HEADER_BYTE, framer->carried - dropped);
+	size_t kept = next != NULL ? (size_t) (framer->carry + framer->carried - next) : 0;
+	if (framer->carried - dropped - kept > 0) {
+		skip(framer, framer->carried - dropped - kept, position + dropped);
+	}
+	memmove(framer->carry, framer->carry + framer->carried - kept, kept);
+	framer->carried = kept;
+}
+
+void rtcmFramerPush(RtcmFramer * framer, const unsigned char * data, size_t length) {
+	size_t start = framer->carried;		// The position of the span.
+	size_t i = 0;
+
+	// Complete the frame carried over from the last push, and any more that
+	// start in the carry buffer if it turns out to be bad.
+	while (framer->carried > 0) {
+		size_t wanted = framer->carried < LENGTH_OF_HEADER
+				? LENGTH_OF_HEADER : frameLength(framer->carry);
+		if (framer->carried < wanted) {
+			size_t copied = wanted - framer->carried < length - i ? wanted - framer->carried : length - i;
+			memcpy(framer->carry + framer->carried, data + i, copied);
+			framer->carried += copied;
+			i += copied;
+			if (framer->carried < wanted) {
+				// Still incomplete.
+				carried(framer, start + i - framer->carried);
+				return;
+			}
+			if (wanted == LENGTH_OF_HEADER) {
+				// Now the length is known.
+				continue;
+			}
+		}
+		size_t position = start + i - framer->carried;
+		if (handle(framer, framer->carry, wanted, position, TRUE)) {
+			dropCarried(framer, wanted, position);
+		} else {
+			dropCarried(framer, 1, position);
+		}
+	}
+
+	// Then scan the rest of the span in place.
+	while (i < length) {
+		if (data[i] != RTCM_HEADER_BYTE) {
+			// Skip everything up to the start of the next frame.
+			const unsigned char * next = memchr(data + i, RTCM_HEADER_BYTE, length - i);
+			size_t skipped = next != NULL ? (size_t) (next - (data + i)) : length - i;
+			skip(framer, skipped, start + i);
+			i += skipped;
+			continue;
+		}
+		size_t remaining = length - i;
+		if (remaining < LENGTH_OF_HEADER || remaining < frameLength(data + i)) {
+			// The rest of the span is the start of a frame.  Carry it over.
+			memcpy(framer->carry, data + i, remaining);
+			framer->carried = remaining;
+			carried(framer, start + i);
+			return;
+		}
+		size_t total = frameLength(data + i);
+		if (handle(framer, data + i, total, start + i, FALSE)) {
+			i += total;
+		} else {
+			i++;
+		}
+	}
+}
@@ -0,0 +1,206 @@
+/*
+ * latency.c
+ *
+ * Measures how long each frame spends inside the filter, from the read that
+ * completed it to the end of the write that sent it on.
+ *
+ * Each read from the input is timestamped with the monotonic clock.  When a
+ * message is added to the frame list, the time of the current read goes with
+ * it, in the list's array of read times, which has one entry per message in
+ * the order of the messages.  Epoch batching and the rate limiter hold
+ * messages back, and the rate limiter may reorder or drop them, so they keep
+ * the read time alongside each message they hold.  When the output writes a
+ * run of messages, it hands over their read times and the latency of each one
+ * is recorded.  Identical messages from different reads are each measured
+ * from their own read.
+ *
+ * The latencies go into histograms in the style of HdrHistogram - linear
+ * buckets of one microsecond up to 128 us, then 64 buckets for each power of
+ * two - so any value is recorded to within 1.6% and a histogram has a fixed
+ * size however long the latencies.  There is one for all messages and one for
+ * each message type, allocated when the type is first seen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtcmfilter.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+
+#define NUMBER_OF_MESSAGE_TYPES 4096
+
+#define SUB_BUCKET_BITS 6
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define LINEAR_BUCKETS (2 * SUB_BUCKETS)
+#define NUMBER_OF_BUCKETS (LINEAR_BUCKETS + (64 - SUB_BUCKET_BITS - 1) * SUB_BUCKETS)
+
+typedef struct histogram {
+	unsigned long count;
+	uint64_t max;						// microseconds
+	unsigned long buckets[NUMBER_OF_BUCKETS];
+} Histogram;
+
+static int measuring = FALSE;
+static struct timespec lastRead;
+static Histogram allTypes;
+static Histogram * byType[NUMBER_OF_MESSAGE_TYPES];
+
+// Statistics.
+static unsigned long int untrackedSoFar = 0;
+
+void setLatencyMeasurement() {
+	measuring = TRUE;
+}
+
+int measuringLatency() {
+	return measuring;
+}
+
+// bucketOf returns the bucket for a latency in microseconds.
+static int bucketOf(uint64_t value) {
+	if (value < LINEAR_BUCKETS) {
+		return value;
+	}
+	int magnitude = 63 - __builtin_clzll(value);
+	int subBucket = (value >> (magnitude - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+	return LINEAR_BUCKETS + (magnitude - SUB_BUCKET_BITS - 1) * SUB_BUCKETS + subBucket;
+}
+
+// bucketValue returns the highest latency that goes in a bucket.
+static uint64_t bucketValue(int bucket) {
+	if (bucket < LINEAR_BUCKETS) {
+		return bucket;
+	}
+	int magnitude = (bucket - LINEAR_BUCKETS) / SUB_BUCKETS + SUB_BUCKET_BITS + 1;
+	uint64_t subBucket = (bucket - LINEAR_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+	return ((subBucket + 1) << (magnitude - SUB_BUCKET_BITS)) - 1;
+}
+
+static void record(Histogram * histogram, uint64_t microseconds) {
+	histogram->count++;
+	histogram->buckets[bucketOf(microseconds)]++;
+	if (microseconds > histogram->max) {
+		histogram->max = microseconds;
+	}
+}
+
+// percentile returns the latency in microseconds below which the given
+// fraction of the values fall.
+static uint64_t percentile(const Histogram * histogram, double fraction) {
+	unsigned long wanted = (unsigned long) (fraction * histogram->count + 0.5);
+	if (wanted == 0) {
+		wanted = 1;
+	}
+	unsigned long seen = 0;
+	for (int bucket = 0; bucket < NUMBER_OF_BUCKETS; bucket++) {
+		seen += histogram->buckets[bucket];
+		if (seen >= wanted) {
+			uint64_t value = bucketValue(bucket);
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+// noteRead timestamps a read from the input.
+void noteRead() {
+	if (measuring) {
+		clock_gettime(CLOCK_MONOTONIC, &lastRead);
+	}
+}
+
+// getReadTime returns the time of the current read, for a message that is
+// going to the output.
+void getReadTime(struct timespec * readTime) {
+	*readTime = lastRead;
+}
+
+// latencyWritten records the latency of each message in a run of complete
+// messages that has just been written, given the time of the read of each
+// one.  A message without a read time - the read times are NULL or its entry
+// is zero - is counted as untracked.  Returns the number of messages.
+int latencyWritten(const unsigned char * messages, size_t length, const struct timespec * readTimes) {
+	if (!measuring) {
+		return 0;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	int count = 0;
+	size_t i = 0;
+	while (i + LENGTH_OF_HEADER <= length) {
+		const unsigned char * frame = messages + i;
+		size_t frameLength = getbitu(frame, 14, 10) + LENGTH_OF_HEADER + LENGTH_OF_CRC;
+		if (i + frameLength > length) {
+			break;
+		}
+		const struct timespec * readTime = readTimes == NULL ? NULL : readTimes + count;
+		if (readTime == NULL || (readTime->tv_sec == 0 && readTime->tv_nsec == 0)) {
+			untrackedSoFar++;
+		} else {
+			int64_t microseconds = (now.tv_sec - readTime->tv_sec) * 1000000
+					+ (now.tv_nsec - readTime->tv_nsec) / 1000;
+			if (microseconds < 0) {
+				microseconds = 0;
+			}
+			unsigned int type = getbitu(frame, 24, 12);
+			record(&allTypes, microseconds);
+			if (byType[type] == NULL) {
+				byType[type] = calloc(1, sizeof(Histogram));
+			}
+			if (byType[type] != NULL) {
+				record(byType[type], microseconds);
+			}
+		}
+		count++;
+		i += frameLength;
+	}
+	return count;
+}
+
+static void writeHistogram(FILE * out, const char * name, const Histogram * histogram) {
+	fprintf(out, "latency %s: %ld frames, p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+			name, histogram->count,
+			percentile(histogram, 0.5) / 1000.0, percentile(histogram, 0.99) / 1000.0,
+			percentile(histogram, 0.999) / 1000.0, histogram->max / 1000.0);
+}
+
+// writeLatencyStats writes the percentiles for all messages and for each
+// message type.
+void writeLatencyStats(FILE * out) {
+	if (!measuring) {
+		return;
+	}
+	writeHistogram(out, "all", &allTypes);
+	for (int type = 0; type < NUMBER_OF_MESSAGE_TYPES; type++) {
+		if (byType[type] != NULL && byType[type]->count > 0) {
+			char name[16];
+			sprintf(name, "%d", type);
+			writeHistogram(out, name, byType[type]);
+		}
+	}
+	if (untrackedSoFar > 0) {
+		fprintf(out, "latency: %ld frames written without a read time\n", untrackedSoFar);
+	}
+}
+
+void resetLatencyTotals() {
+	memset(&allTypes, 0, sizeof(allTypes));
+	for (int type = 0; type < NUMBER_OF_MESSAGE_TYPES; type++) {
+		if (byType[type] != NULL) {
+			memset(byType[type], 0, sizeof(Histogram));
+		}
+	}
+	untrackedSoFar = 0;
+}
+
+void displayLatencyTotals() {
+	if (!measuring) {
+		return;
+	}
+	writeHistogram(stderr, "all", &allTypes);
+}
@@ -0,0 +1,183 @@
+/*
+ * legacy.c
+ *
+ * Makes legacy observation messages (1004 and 1012) from MSM epochs.
+ *
+ * Some older rovers only understand the legacy observation messages, while
+ * modern receivers only send MSM.  The filter already runs every message
+ * through the RTKLIB decoder to check it, and the decoder collects the
+ * observations of the MSMs of an epoch in rtcm->obs.  When the last MSM of the
+ * epoch arrives (the one with the sync bit clear), the observations are given
+ * to a separate RTKLIB encoder, which produces a 1004 for the GPS satellites
+ * and a 1012 for the GLONASS satellites.  So the conversion costs one encode
+ * per epoch on top of the decoding that's done anyway, which allows many
+ * streams to be converted on one core, without an str2str process for each.
+ *
+ * The observations get the same treatment as the MSMs - the satellites below
+ * the elevation mask and the stripped signals are left out.
+ *
+ * The legacy messages can be sent as well as the MSMs or instead of them.
+ * They go out just before the MSM that completed the epoch.  The last of
+ * them is made with the sync bit clear.  Whether that MSM is sent depends on
+ * the mode and the filters, so the caller sets the sync bit of the last
+ * legacy message that it sends if the MSM follows, and the end of the epoch
+ * is still marked by the last message.
+ *
+ * Only constellations enabled in the RTKLIB build can be decoded, so by default
+ * only 1004 is produced and only the GPS MSMs are replaced.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtcmfilter.h"
+
+#define LEGACY_OFF 0
+#define LEGACY_ADD 1
+#define LEGACY_REPLACE 2
+
+static int legacyMode = LEGACY_OFF;
+static rtcm_t * encoder = NULL;
+
+// Statistics.
+static unsigned long int legacyEpochsSoFar = 0;
+static unsigned long int legacyMessagesSoFar = 0;
+static unsigned long long legacyBytesSoFar = 0;
+static unsigned long int msmReplacedSoFar = 0;
+static unsigned long int legacySatellitesMaskedSoFar = 0;
+static unsigned long int legacySignalsStrippedSoFar = 0;
+static double legacySecondsTotal = 0.0;
+static double legacySecondsMax = 0.0;
+
+// setLegacyObservations turns on the legacy observations.  The mode is "add"
+// to send them as well as the MSMs or "replace" to send them instead.
+// Returns FALSE if the mode is not valid.
+int setLegacyObservations(const char * mode) {
+	if (strcmp(mode, "add") == 0) {
+		legacyMode = LEGACY_ADD;
+	} else if (strcmp(mode, "replace") == 0) {
+		legacyMode = LEGACY_REPLACE;
+	} else {
+		return FALSE;
+	}
+	if (encoder == NULL) {
+		encoder = calloc(1, sizeof(rtcm_t));
+		init_rtcm(encoder);
+	}
+	return TRUE;
+}
+
+// legacyReplacesMsm returns true if messages of this type should be dropped
+// because they are replaced by legacy observations.  That's only the MSMs of
+// the constellations that the decoder can handle.
+int legacyReplacesMsm(unsigned int type) {
+	if (legacyMode != LEGACY_REPLACE) {
+		return FALSE;
+	}
+	int system = getMsmSystem(type);
+	return (system == SYS_GPS || system == SYS_GLO) && satno(system, 1) != 0;
+}
+
+// filterObservations removes the satellites below the elevation mask and the
+// stripped signals from the observations in the encoder, and any satellite
+// that has no signals left.
+static void filterObservations(const rtcm_t * decoder) {
+	int kept = 0;
+	for (int i = 0; i < encoder->obs.n; i++) {
+		obsd_t * d = encoder->obs.data + i;
+		if (belowElevationMask(decoder, d->sat, d->time)) {
+			legacySatellitesMaskedSoFar++;
+			continue;
+		}
+		int system = satsys(d->sat, NULL);
+		int signals = 0;
+		for (int f = 0; f < NFREQ + NEXOBS; f++) {
+			if (signalStripped(system, d->code[f])) {
+				d->P[f] = d->L[f] = 0.0;
+				d->D[f] = 0.0f;
+				d->SNR[f] = d->LLI[f] = d->code[f] = 0;
+				legacySignalsStrippedSoFar++;
+			}
+			if (d->code[f] != CODE_NONE) {
+				signals++;
+			}
+		}
+		if (signals > 0) {
+			encoder->obs.data[kept++] = *d;
+		}
+	}
+	encoder->obs.n = kept;
+}
+
+// makeLegacyObservations makes the legacy observation messages for the epoch
+// that the decoder has just completed with an MSM.  The last one has the sync
+// bit clear.  It returns their total length in the output buffer, which must
+// hold two messages of MAX_RTCM_MESSAGE_LENGTH bytes.
+size_t makeLegacyObservations(const rtcm_t * decoder, unsigned char * output) {
+	if (legacyMode == LEGACY_OFF || decoder->obs.n == 0) {
+		return 0;
+	}
+
+	struct timespec start, finish;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int gps = FALSE, glonass = FALSE;
+	for (int i = 0; i < decoder->obs.n; i++) {
+		int system = satsys(decoder->obs.data[i].sat, NULL);
+		gps |= system == SYS_GPS;
+		glonass |= system == SYS_GLO;
+	}
+
+	encoder->staid = decoder->staid;
+	encoder->time = decoder->obs.data[0].time;
+	encoder->obs.n = decoder->obs.n;
+	memcpy(encoder->obs.data, decoder->obs.data, decoder->obs.n * sizeof(obsd_t));
+
+	// A message goes out for each constellation in the epoch even if all of
+	// its satellites are filtered out, as an empty MSM does, so that the
+	// rover still sees the epoch.
+	filterObservations(decoder);
+	if (glonass) {
+		memcpy(encoder->nav.geph, decoder->nav.geph, MAXPRNGLO * sizeof(geph_t));
+	}
+
+	size_t length = 0;
+	if (gps && gen_rtcm3(encoder, 1004, glonass)) {
+		memcpy(output, encoder->buff, encoder->nbyte);
+		length += encoder->nbyte;
+		legacyMessagesSoFar++;
+	}
+	if (glonass && gen_rtcm3(encoder, 1012, FALSE)) {
+		memcpy(output + length, encoder->buff, encoder->nbyte);
+		length += encoder->nbyte;
+		legacyMessagesSoFar++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	double seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+	legacySecondsTotal += seconds;
+	if (seconds > legacySecondsMax) {
+		legacySecondsMax = seconds;
+	}
+	legacyEpochsSoFar++;
+	legacyBytesSoFar += length;
+	return length;
+}
+
+// countReplacedMsm counts an MSM dropped because it's replaced.
+void countReplacedMsm() {
+	msmReplacedSoFar++;
+}
+
+void displayLegacyTotals() {
+	if (legacyMode == LEGACY_OFF) {
+		return;
+	}
+	fprintf(stderr, "legacy observations: %ld epochs, %ld messages, %lld bytes, %ld MSMs replaced, %ld satellites masked, %ld signals stripped, mean %.1f us max %.1f us per epoch\n",
+			legacyEpochsSoFar, legacyMessagesSoFar, legacyBytesSoFar, msmReplacedSoFar,
+			legacySatellitesMaskedSoFar, legacySignalsStrippedSoFar,
+			legacyEpochsSoFar > 0 ? legacySecondsTotal / legacyEpochsSoFar * 1e6 : 0.0,
+			legacySecondsMax * 1e6);
+}
@@ -0,0 +1,220 @@
+/*
+ * legacytest.c
+ *
+ * Round trip tests of the legacy observations made in legacy.c - MSM epoch to
+ * 1004 and back.
+ *
+ * Generates epochs of GPS observations on L1 and L2 for satellites in
+ * geostationary orbits, placed so that their elevations from a station on the
+ * equator are known and don't change.  Each epoch is encoded as an MSM4, decoded with
+ * the RTKLIB decoder as the filter does, made into a 1004 and decoded again.
+ * The observations from the 1004 must agree with the ones from the MSM within
+ * the resolution of the 1004.  That's done three times:
+ *
+ *     with no filters, when every satellite and signal must come through;
+ *     with a 10 degree elevation mask, when the satellites below it must be
+ *     missing from the 1004 just as they are removed from the MSMs;
+ *     with the mask and L2 stripped, when the 1004 must only have L1.
+ *
+ * This build of RTKLIB only has GPS, so the 1012 is not tested.
+ *
+ *     make legacytest && ./legacytest [epochs]
+ *
+ * The exit status is 0 if all of the observations are as expected.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtcmfilter.h"
+
+#define SATELLITES 6
+#define MASK 10.0							// degrees
+#define ORBIT_RADIUS 42164170.0				// metres, geostationary
+
+// The resolution of a 1004 is 0.02 m in pseudorange and 0.0005 m in phase
+// range less pseudorange.  The MSM4 has been decoded already, so the 1004 is
+// rounded once.
+#define PSEUDORANGE_TOLERANCE 0.011			// metres
+#define PHASE_RANGE_TOLERANCE 0.011			// metres
+
+int verboseMode = 0;
+
+static long failures = 0;
+
+// The elevations of the satellites, PRN 1 to 6.  Three are below the mask.
+static const double elevations[SATELLITES] = {60.0, 30.0, MASK + 0.5, MASK - 0.5, 5.0, -5.0};
+
+static double randomBetween(double low, double high) {
+	return low + (high - low) * rand() / (double) RAND_MAX;
+}
+
+// placeSatellites gives the decoder a station on the equator and ephemerides
+// of geostationary orbits that put the satellites at their elevations.
+static void placeSatellites(rtcm_t * decoder, gtime_t time) {
+	decoder->sta.pos[0] = RE_WGS84;
+	for (int s = 0; s < SATELLITES; s++) {
+		eph_t * eph = decoder->nav.eph + satno(SYS_GPS, s + 1) - 1;
+		double elevation = elevations[s] * D2R;
+		memset(eph, 0, sizeof(eph_t));
+		eph->sat = satno(SYS_GPS, s + 1);
+		eph->A = ORBIT_RADIUS;
+		eph->M0 = PI / 2.0 - elevation - asin(RE_WGS84 * cos(elevation) / ORBIT_RADIUS);
+		eph->toe = time;
+		eph->toes = time2gpst(time, NULL);
+		eph->OMG0 = OMGE * eph->toes;
+	}
+}
+
+// generateEpoch fills the encoder with observations of the satellites on L1
+// and L2.
+static void generateEpoch(rtcm_t * encoder, double * ranges, gtime_t time) {
+	encoder->time = time;
+	encoder->obs.n = 0;
+	for (int s = 0; s < SATELLITES; s++) {
+		obsd_t * d = encoder->obs.data + encoder->obs.n++;
+		memset(d, 0, sizeof(obsd_t));
+		d->time = time;
+		d->sat = satno(SYS_GPS, s + 1);
+		ranges[s] += randomBetween(-800.0, 800.0);
+		d->P[0] = ranges[s];
+		d->L[0] = (ranges[s] + randomBetween(-5.0, 5.0)) / (CLIGHT / FREQ1);
+		d->SNR[0] = (unsigned char) randomBetween(120.0, 220.0);
+		d->code[0] = CODE_L1C;
+		d->P[1] = ranges[s] + randomBetween(-10.0, 10.0);
+		d->L[1] = (ranges[s] + randomBetween(-5.0, 5.0)) / (CLIGHT / FREQ2);
+		d->SNR[1] = (unsigned char) randomBetween(100.0, 200.0);
+		d->code[1] = CODE_L2W;
+	}
+}
+
+// decode runs a message through a decoder and returns the status of the
+// last byte.
+static int decode(rtcm_t * rtcm, const unsigned char * message, size_t length, gtime_t time) {
+	int status = 0;
+	rtcm->time = time;
+	for (size_t i = 0; i < length; i++) {
+		status = input_rtcm3(rtcm, message[i]);
+	}
+	return status;
+}
+
+// checkEpoch checks the observations from the 1004 against the ones from the
+// MSM, which must be there unless the satellite is below the mask.
+static void checkEpoch(const obs_t * msm, const obs_t * legacy, int masked, int l2Stripped,
+		const char * what, int epoch) {
+	int expected = 0;
+	for (int s = 0; s < msm->n; s++) {
+		const obsd_t * m = msm->data + s;
+		int prn;
+		satsys(m->sat, &prn);
+		if (masked && elevations[prn - 1] < MASK) {
+			continue;
+		}
+		expected++;
+		const obsd_t * l = NULL;
+		for (int t = 0; t < legacy->n; t++) {
+			if (legacy->data[t].sat == m->sat) {
+				l = legacy->data + t;
+			}
+		}
+		if (l == NULL) {
+			if (failures++ < 10) {
+				fprintf(stderr, "%s epoch %d: sat %d missing\n", what, epoch, m->sat);
+			}
+			continue;
+		}
+		for (int f = 0; f < 2; f++) {
+			double lambda = f == 0 ? CLIGHT / FREQ1 : CLIGHT / FREQ2;
+			if (f == 1 && l2Stripped) {
+				if (l->P[1] != 0.0 || l->L[1] != 0.0) {
+					if (failures++ < 10) {
+						fprintf(stderr, "%s epoch %d: sat %d has L2\n", what, epoch, m->sat);
+					}
+				}
+				continue;
+			}
+			double dp = fabs(m->P[f] - l->P[f]);
+			double dl = fabs(m->L[f] - l->L[f]) * lambda;
+			if (dp > PSEUDORANGE_TOLERANCE || dl > PHASE_RANGE_TOLERANCE || l->P[f] == 0.0 || l->L[f] == 0.0) {
+				if (failures++ < 10) {
+					fprintf(stderr, "%s epoch %d: sat %d freq %d dP %.4f m dL %.4f m\n",
+							what, epoch, m->sat, f, dp, dl);
+				}
+			}
+		}
+	}
+	if (legacy->n != expected && failures++ < 10) {
+		fprintf(stderr, "%s epoch %d: %d satellites, expected %d\n", what, epoch, legacy->n, expected);
+	}
+}
+
+static void test(const char * what, int masked, int l2Stripped, int epochs) {
+	rtcm_t * encoder = calloc(1, sizeof(rtcm_t));
+	rtcm_t * decoder = calloc(1, sizeof(rtcm_t));
+	rtcm_t * legacyDecoder = calloc(1, sizeof(rtcm_t));
+	init_rtcm(encoder);
+	init_rtcm(decoder);
+	init_rtcm(legacyDecoder);
+
+	double ranges[SATELLITES];
+	for (int s = 0; s < SATELLITES; s++) {
+		ranges[s] = randomBetween(2.0e7, 2.6e7);
+	}
+
+	unsigned char legacy[2 * MAX_RTCM_MESSAGE_LENGTH];
+	long failuresBefore = failures;
+	size_t bytes = 0;
+
+	gtime_t start = gpst2time(2068, 388800.0);
+	placeSatellites(decoder, start);
+	for (int e = 0; e < epochs; e++) {
+		gtime_t time = timeadd(start, e);
+		generateEpoch(encoder, ranges, time);
+		if (!gen_rtcm3(encoder, 1074, 0)) {
+			fprintf(stderr, "can't encode MSM4\n");
+			failures++;
+			break;
+		}
+		if (decode(decoder, encoder->buff, encoder->nbyte, time) != 1) {
+			fprintf(stderr, "%s epoch %d: MSM4 doesn't complete the epoch\n", what, e);
+			failures++;
+			continue;
+		}
+		size_t length = makeLegacyObservations(decoder, legacy);
+		if (length == 0 || getbitu(legacy, 24, 12) != 1004
+				|| length != getbitu(legacy, 14, 10) + 6u
+				|| decode(legacyDecoder, legacy, length, time) != 1) {
+			fprintf(stderr, "%s epoch %d: no 1004 made\n", what, e);
+			failures++;
+			continue;
+		}
+		bytes += length;
+		checkEpoch(&decoder->obs, &legacyDecoder->obs, masked, l2Stripped, what, e);
+	}
+
+	printf("%s: %d epochs, %ld bytes of 1004: %s\n", what, epochs, bytes,
+			failures == failuresBefore ? "PASS" : "FAIL");
+
+	free_rtcm(encoder);
+	free_rtcm(decoder);
+	free_rtcm(legacyDecoder);
+	free(encoder);
+	free(decoder);
+	free(legacyDecoder);
+}
+
+int main(int argc, char ** argv) {
+	int epochs = argc > 1 ? atoi(argv[1]) : 1000;
+
+	srand(1);
+	setLegacyObservations("replace");
+	test("MSM4 to 1004", FALSE, FALSE, epochs);
+	setElevationMask(MASK);
+	test("MSM4 to 1004 with the elevation mask", TRUE, FALSE, epochs);
+	addSignalStripping("gps:L2");
+	test("MSM4 to 1004 with the elevation mask and L2 stripped", TRUE, TRUE, epochs);
+	return failures == 0 ? 0 : 1;
+}
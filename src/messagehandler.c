@@ -32,10 +32,12 @@
 #endif
 
 #include "rtcmfilter.h"
+#include "probes.h"
 
 #define MAX_BUFFERS_TO_DISPLAY 50
 #define LENGTH_OF_HEADER 3
 #define LENGTH_OF_CRC 3
+#define RTCM_HEADER_BYTE 0xd3
 #define STATE_EATING_MESSAGES 0
 #define STATE_PROCESSING_RTCM_MESSAGE 1
 
@@ -45,18 +47,24 @@ extern int verboseMode;
 
 static int numberOfBuffersDisplayed = 0;
 
-// Message counts.
+// Message counts since the last reset.  The counts by type come from the
+// metrics registry, less the counts when the totals were last reset.
 static unsigned long int rtcmMessagesSoFar = 0;
 static unsigned long int illegalMessagesSoFar = 0;
-static unsigned long int type1005MessagesSoFar = 0;
-static unsigned long int type1074MessagesSoFar = 0;
-static unsigned long int type1084MessagesSoFar = 0;
-static unsigned long int type1097MessagesSoFar = 0;
-static unsigned long int type1094MessagesSoFar = 0;
-static unsigned long int type1124MessagesSoFar = 0;
-static unsigned long int type1127MessagesSoFar = 0;
-static unsigned long int type1230MessagesSoFar = 0;
-static unsigned long int unexpectedMessagesSoFar = 0;
+
+#define NUMBER_OF_DISPLAYED_TYPES 8
+static const unsigned int displayedTypes[NUMBER_OF_DISPLAYED_TYPES] = {
+	1005, 1074, 1084, 1094, 1097, 1124, 1127, 1230
+};
+static unsigned long int displayedTypesAtReset[NUMBER_OF_DISPLAYED_TYPES];
+
+// setState changes the state of the framer and records the change.
+static void setState(unsigned int newState, size_t position) {
+	if (newState != state) {
+		recordState(newState, position);
+		state = newState;
+	}
+}
 
 // Get the length of the RTCM message.  The three bytes of the header form a big-endian
 // 24-bit value. The bottom ten bits is the message length.
@@ -227,15 +235,16 @@ void displayRtcmMessage(rtcm_t * rtcm) {
 void resetTotals() {
 	rtcmMessagesSoFar = 0;
 	illegalMessagesSoFar = 0;
-	type1005MessagesSoFar = 0;
-	type1074MessagesSoFar = 0;
-	type1084MessagesSoFar = 0;
-	type1097MessagesSoFar = 0;
-	type1094MessagesSoFar = 0;
-	type1124MessagesSoFar = 0;
-	type1127MessagesSoFar = 0;
-	type1230MessagesSoFar = 0;
-	unexpectedMessagesSoFar = 0;
+	for (int t = 0; t < NUMBER_OF_DISPLAYED_TYPES; t++) {
+		displayedTypesAtReset[t] = getFrameCount(displayedTypes[t]);
+	}
+	resetTypeFilterTotals();
+	resetDecimationTotals();
+	resetDeduplicationTotals();
+	resetDecodeCacheTotals();
+	resetLatencyTotals();
+	resetStageCostTotals();
+	resetFastPathTotals();
 }
 
 void displayTotals() {
@@ -246,43 +255,186 @@ void displayTotals() {
 	sprintf(timeStr, "%04d/%02d/%02d %02d:%02d:%02d",
 			tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
 
+	unsigned long int counts[NUMBER_OF_DISPLAYED_TYPES];
+	unsigned long int unexpectedMessages = rtcmMessagesSoFar;
+	for (int t = 0; t < NUMBER_OF_DISPLAYED_TYPES; t++) {
+		counts[t] = getFrameCount(displayedTypes[t]) - displayedTypesAtReset[t];
+		unexpectedMessages -= counts[t];
+	}
+
 	fprintf(stderr, "%s %ld messages, %ld failures,: %ld 1005, %ld 1074, %ld 1084, %ld 1094, %ld 1097, %ld 1124, %ld 1127, %ld 1230, %ld unexpected.\n",
 		timeStr,
 		rtcmMessagesSoFar,
 		illegalMessagesSoFar,
-		type1005MessagesSoFar,
-		type1074MessagesSoFar,
-		type1084MessagesSoFar,
-		type1094MessagesSoFar,
-		type1097MessagesSoFar,
-		type1124MessagesSoFar,
-		type1127MessagesSoFar,
-		type1230MessagesSoFar,
-		unexpectedMessagesSoFar);
+		counts[0], counts[1], counts[2], counts[3], counts[4], counts[5], counts[6], counts[7],
+		unexpectedMessages);
+
+	displayTypeFilterTotals();
+	displayDecimationTotals();
+	displayDeduplicationTotals();
+	displayDecodeCacheTotals();
+	displayFastPathTotals();
+	displayLegacyTotals();
+	displayStripTotals();
+	displayElevationTotals();
+	displayTranscodeTotals();
+	displayShaperTotals();
+	displayOutputTotals();
+	displayArchiveTotals();
+	displayLatencyTotals();
+	displayFlightRecorderTotals();
+}
+
+// The totals are reported at the end of each report interval, aligned to the
+// clock, so the default interval gives a report on the hour.  They are reset
+// just after midnight.  The deadlines are kept on the coarse monotonic clock,
+// which is cheap enough to check after every read, and the caller waits for
+// input no longer than getReportTimeout(), so the reports come on time whether
+// the input is busy or quiet.  The deadlines are set from the precise clocks,
+// and the coarse clock never runs ahead of the precise one, so a report never
+// comes before its boundary on the wall clock.
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define REPORT_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define REPORT_CLOCK CLOCK_MONOTONIC
+#endif
+
+static long reportSeconds = DEFAULT_REPORT_INTERVAL;
+static const char * statsFile = NULL;
+static int reportsScheduled = FALSE;
+static struct timespec nextReport;
+static struct timespec nextReset;
+static time_t reportBoundary = 0;		// The wall clock time of the next report.
+static time_t resetBoundary = 0;
+
+// setReportInterval sets the interval between reports of the totals in
+// seconds.  Returns FALSE if it is not valid.
+int setReportInterval(long seconds) {
+	if (seconds <= 0) {
+		return FALSE;
+	}
+	reportSeconds = seconds;
+	reportBoundary = 0;
+	reportsScheduled = FALSE;
+	return TRUE;
 }
 
-void displayTotalsEveryHour() {
-	static int currentDay = 0;
-	static int currentHour = 0;
+// setStatsFile sets a file that the detailed statistics are written to with
+// each report.
+void setStatsFile(const char * path) {
+	statsFile = path;
+}
 
+// writeStats writes the detailed statistics - the latency percentiles and the
+// time spent in each stage.
+void writeStats(FILE * out) {
 	time_t now = time(NULL);
 	struct tm * tm = gmtime(&now);
-	if (currentDay == 0) {
-		currentDay = tm->tm_mday;
-		currentHour = 23;
+	fprintf(out, "%04d/%02d/%02d %02d:%02d:%02d statistics\n",
+			tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+	writeLatencyStats(out);
+	writeCostStats(out);
+	writeFastPathStats(out);
+}
+
+// writeStatsFile writes the detailed statistics to the stats file, if there
+// is one.  It's written under a temporary name and renamed, so a reader never
+// sees half of it.
+void writeStatsFile() {
+	if (statsFile == NULL) {
+		return;
+	}
+	char temporary[strlen(statsFile) + 5];
+	sprintf(temporary, "%s.tmp", statsFile);
+	FILE * out = fopen(temporary, "w");
+	if (out == NULL) {
+		perror("WARNING: writing stats file");
+		return;
 	}
+	writeStats(out);
+	if (fclose(out) != 0 || rename(temporary, statsFile) != 0) {
+		perror("WARNING: writing stats file");
+	}
+}
 
-	// Report every hour.
-	if (currentHour != tm->tm_hour) {
-		currentHour = tm->tm_hour;
-		displayTotals();
+// scheduleDeadline sets a deadline on the monotonic clock for the next
+// multiple of the period on the wall clock, which is later than the last
+// boundary, so a boundary is never used twice.
+static void scheduleDeadline(struct timespec * deadline, time_t * boundary, long period,
+		const struct timespec * monotonic, const struct timespec * realTime) {
+	time_t next = (realTime->tv_sec / period + 1) * period;
+	if (next <= *boundary) {
+		next = *boundary + period;
 	}
+	*boundary = next;
+	int64_t nanoseconds = (int64_t) (next - realTime->tv_sec) * 1000000000 - realTime->tv_nsec;
+	int64_t due = (int64_t) monotonic->tv_sec * 1000000000 + monotonic->tv_nsec + nanoseconds;
+	deadline->tv_sec = due / 1000000000;
+	deadline->tv_nsec = due % 1000000000;
+}
+
+// scheduleReports sets the deadlines for the next report and the next reset.
+static void scheduleReports() {
+	struct timespec monotonic, realTime;
+	clock_gettime(CLOCK_MONOTONIC, &monotonic);
+	clock_gettime(CLOCK_REALTIME, &realTime);
+	scheduleDeadline(&nextReport, &reportBoundary, reportSeconds, &monotonic, &realTime);
+	scheduleDeadline(&nextReset, &resetBoundary, 86400, &monotonic, &realTime);
+	reportsScheduled = TRUE;
+}
 
-	// Reset totals once after midnight.
-	if (currentDay !=tm->tm_mday) {
-		currentDay =tm->tm_mday;
+static int reached(const struct timespec * deadline, const struct timespec * now) {
+	return now->tv_sec > deadline->tv_sec
+			|| (now->tv_sec == deadline->tv_sec && now->tv_nsec >= deadline->tv_nsec);
+}
+
+// millisecondsUntil rounds up, so that a wait for the deadline doesn't end
+// just before it.
+static long millisecondsUntil(const struct timespec * deadline, const struct timespec * now) {
+	if (reached(deadline, now)) {
+		return 0;
+	}
+	int64_t nanoseconds = (int64_t) (deadline->tv_sec - now->tv_sec) * 1000000000
+			+ (deadline->tv_nsec - now->tv_nsec);
+	return (nanoseconds + 999999) / 1000000;
+}
+
+// getReportTimeout returns the time in milliseconds until serviceReports()
+// has something to do.
+long getReportTimeout() {
+	struct timespec now;
+	clock_gettime(REPORT_CLOCK, &now);
+	if (!reportsScheduled) {
+		scheduleReports();
+	}
+	long untilReport = millisecondsUntil(&nextReport, &now);
+	long untilReset = millisecondsUntil(&nextReset, &now);
+	return untilReport < untilReset ? untilReport : untilReset;
+}
+
+// serviceReports displays the totals when the report interval runs out and
+// resets them after midnight.
+void serviceReports() {
+	struct timespec now;
+	clock_gettime(REPORT_CLOCK, &now);
+	if (!reportsScheduled) {
+		scheduleReports();
+		return;
+	}
+	int report = reached(&nextReport, &now);
+	int reset = reached(&nextReset, &now);
+	if (!report && !reset) {
+		return;
+	}
+	if (report) {
+		displayTotals();
+		writeStatsFile();
+	}
+	if (reset) {
 		resetTotals();
 	}
+	scheduleReports();
 }
 
 // addMessageFragmentToBuffer adds a message fragment to a buffer, which may be empty or may
@@ -308,13 +460,357 @@ Buffer * addMessageFragmentToBuffer(Buffer * buffer, unsigned char * fragment, s
 }
 
 
-// Given a Buffer containing messages and message fragments, extract any RTCM data blocks or
-// fragments of them and return a Buffer containing just those data.
-Buffer * getRtcmDataBlocks(Buffer inputBuffer, rtcm_t * rtcm) {
+// The framer, which holds the start of a message that runs off the end of a
+// buffer until the rest of it arrives - see framer.c.
+static RtcmFramer * framer = NULL;
+static rtcm_t * decoder = NULL;		// The decoder for the buffer being framed.
+
+// The list returned by getRtcmFrames().  It's reused by each call, so once it
+// has grown to fit the traffic there are no more allocations.
+static FrameList frameList;
+
+// TRUE if observations of an epoch have been sent but not the last of them,
+// the one with the sync bit clear.
+static int epochOpen = FALSE;
+
+// resetFraming discards any fragment carried over from the last buffer and
+// starts scanning afresh, as if getRtcmDataBlocks() had never been called.
+void resetFraming() {
+	if (framer != NULL) {
+		rtcmFramerReset(framer);
+	}
+	frameList.count = 0;
+	frameList.length = 0;
+	frameList.messages = 0;
+	frameList.storeLength = 0;
+	epochOpen = FALSE;
+	state = STATE_EATING_MESSAGES;
+}
+
+// addFrame adds a message to the frame list.  If the message is in memory
+// that won't last until it's written - the carry buffer or the workspace of
+// a filter - it's copied into the list's store, otherwise the list just
+// points at it.  When latency is being measured, the time of the current
+// read goes with it.
+static void addFrame(const unsigned char * message, size_t length, int copy) {
+	FrameList * list = &frameList;
+	if (measuringLatency()) {
+		if (list->messages == list->readTimesCapacity) {
+			list->readTimesCapacity = list->readTimesCapacity > 0 ? list->readTimesCapacity * 2 : 64;
+			list->readTimes = realloc(list->readTimes, list->readTimesCapacity * sizeof(struct timespec));
+		}
+		getReadTime(list->readTimes + list->messages);
+	}
+	list->messages++;
+	if (copy) {
+		if (list->storeLength + length > list->storeCapacity) {
+			size_t newCapacity = list->storeCapacity > 0 ? list->storeCapacity * 2 : 16 * 1024;
+			while (newCapacity < list->storeLength + length) {
+				newCapacity *= 2;
+			}
+			// Entries that point into the old store must follow it.
+			uintptr_t oldStore = (uintptr_t) list->store;
+			list->store = realloc(list->store, newCapacity);
+			list->storeCapacity = newCapacity;
+			for (int f = 0; f < list->count; f++) {
+				uintptr_t base = (uintptr_t) list->frames[f].iov_base;
+				if (base >= oldStore && base < oldStore + list->storeLength) {
+					list->frames[f].iov_base = list->store + (base - oldStore);
+				}
+			}
+		}
+		memcpy(list->store + list->storeLength, message, length);
+		message = list->store + list->storeLength;
+		list->storeLength += length;
+	}
+	list->length += length;
+
+	// A message that follows on from the last one extends its entry, as long
+	// as both are in the store or neither is.
+	if (list->count > 0) {
+		struct iovec * last = list->frames + list->count - 1;
+		const unsigned char * end = (const unsigned char *) last->iov_base + last->iov_len;
+		int lastInStore = (unsigned char *) last->iov_base >= list->store
+				&& (unsigned char *) last->iov_base < list->store + list->storeLength;
+		if (end == message && (lastInStore != 0) == (copy != 0)) {
+			last->iov_len += length;
+			return;
+		}
+	}
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+		list->frames = realloc(list->frames, list->capacity * sizeof(struct iovec));
+	}
+	list->frames[list->count].iov_base = (void *) message;
+	list->frames[list->count].iov_len = length;
+	list->count++;
+}
+
+// endEpoch is called when a filter drops an observation message.  If it's the
+// last message of an epoch that has been partly sent, a message with the same
+// header and no satellites is sent in its place, so that the rover still sees
+// the end of the epoch.
+static void endEpoch(const unsigned char * message, size_t length, const MessageMetadata * metadata) {
+	if (!metadata->hasEpoch || metadata->sync || !epochOpen) {
+		return;
+	}
+	unsigned char terminator[MAX_RTCM_MESSAGE_LENGTH];
+	size_t terminatorLength = makeEpochTerminator(message, length, terminator);
+	if (terminatorLength == 0) {
+		return;
+	}
+	if (displayingBuffers()) {
+		fprintf(stderr, "sending an empty message type %d to end the epoch\n", metadata->type);
+	}
+	addFrame(terminator, terminatorLength, TRUE);
+	archiveMessage(terminator, terminatorLength, metadata);
+	epochOpen = FALSE;
+}
+
+// processFrame checks and decodes a complete RTCM message, runs it through the
+// filters and adds what's left of it to the frame list.  The position is the
+// offset of the message in the stream since the last buffer was processed,
+// for the trace.  The message is copied if it's in the carry buffer.  Returns
+// FALSE if the message is not legal.
+static int processFrame(const unsigned char * frame, size_t totalRtcmMessageLength, size_t position,
+		int inCarry, rtcm_t * rtcm) {
+
+	size_t rtcmMessageLength = totalRtcmMessageLength - LENGTH_OF_HEADER - LENGTH_OF_CRC;
+
+	// The header fields of the message.
+	MessageMetadata metadata;
+
+	// Workspace for rewriting a message.
+	unsigned char stripped[MAX_RTCM_MESSAGE_LENGTH];
+	unsigned char pruned[MAX_RTCM_MESSAGE_LENGTH];
+	unsigned char transcoded[MAX_RTCM_MESSAGE_LENGTH];
+	unsigned char legacy[2 * MAX_RTCM_MESSAGE_LENGTH];
+
+	if (displayingBuffers()) {
+		fprintf(stderr, "\nchecking message\n");
+	}
+	if (stageCosting) {
+		countStage(STAGE_SCAN, 1, 0);
+	}
+	PROBE_FRAME_FOUND(position, totalRtcmMessageLength);
+	int messageStatus;
+	if (inFastPath()) {
+		// The stream is aligned, so only the CRC is checked - see fastpath.c.
+		messageStatus = fastPathCheck(frame, totalRtcmMessageLength) ? 0 : -2;
+	} else {
+		// RTKLIB decodes from its own buffer.
+		memcpy(rtcm->buff, frame, totalRtcmMessageLength);
+		rtcm->nbyte = totalRtcmMessageLength;
+		rtcm->len = rtcmMessageLength + LENGTH_OF_HEADER;
+		messageStatus = decodeRtcmFrame(rtcm);
+	}
+	ENTER_STAGE(STAGE_PROCESS);
+	if (messageStatus < 0) {
+		// The message is not legal.  Log it and start eating.
+		illegalMessagesSoFar++;
+		fastPathLost();
+		if (messageStatus == -2) {
+			countCrcFailure();
+			PROBE_CRC_FAILURE(position, totalRtcmMessageLength);
+		} else {
+			countDecodeFailure();
+		}
+		recordFrame(messageStatus == -2 ? FR_CRC_FAILURE : FR_DECODE_FAILURE,
+				getbitu(frame, 24, 12), position, totalRtcmMessageLength, messageStatus);
+		if (displayingBuffers()) {
+			switch (messageStatus) {
+			case -2:
+				fprintf(stderr, "RTCM message fails CRC check - position %ld given message length %ld\n",
+					position, rtcmMessageLength);
+				break;
+			case -1:
+				fprintf(stderr, "error - cannot decode RTCM message - position %ld given message length %ld\n",
+					position, rtcmMessageLength);
+				break;
+			default:
+				fprintf(stderr, "unexpected error while reading RTCM message - position %ld given message length %ld\n",
+						position, rtcmMessageLength);
+				break;
+			}
+		}
+		setState(STATE_EATING_MESSAGES, position);
+		return FALSE;
+	}
+
+	getMessageMetadata(frame, totalRtcmMessageLength, &metadata);
+	PROBE_MESSAGE_DECODED(metadata.type, totalRtcmMessageLength, messageStatus);
+	if (displayingBuffers()) {
+		fprintf(stderr, "RTCM message at position %ld.  Status %d type %d given message length %ld\n",
+			position, messageStatus, metadata.type, rtcmMessageLength);
+		displayMessageMetadata(&metadata);
+	}
+	rtcmMessagesSoFar++;
+	countFrame(metadata.type, totalRtcmMessageLength);
+	fastPathFrame(totalRtcmMessageLength);
+	if (stageCosting) {
+		countStage(STAGE_PROCESS, 1, totalRtcmMessageLength);
+	}
+
+	// The message is legal.  Drop it if it's replaced by the legacy
+	// observations, its type is filtered out, it's too soon after the last
+	// one or it repeats one sent recently.  That's decided first, so that the
+	// legacy observations know whether it follows them.
+	int replaced = legacyReplacesMsm(metadata.type);
+	int allowed = !replaced && messageTypeAllowed(metadata.type);
+	int passed = allowed && decimationAllows(&metadata)
+			&& deduplicationAllows(frame, totalRtcmMessageLength, &metadata);
+
+	// If the message completes an MSM epoch, optionally send the legacy
+	// observation messages for the epoch, subject to the same filters.  The
+	// last one sent ends the epoch unless the MSM follows.
+	if (messageStatus == 1 && isMsmMessage(metadata.type)) {
+		size_t legacyLength = makeLegacyObservations(rtcm, legacy);
+		size_t kept = 0;
+		size_t last = 0;
+		size_t j = 0;
+		while (j < legacyLength) {
+			MessageMetadata legacyMetadata;
+			size_t length = getRtcmLength(legacy + j, legacyLength - j) + LENGTH_OF_HEADER + LENGTH_OF_CRC;
+			getMessageMetadata(legacy + j, length, &legacyMetadata);
+			if (messageTypeAllowed(legacyMetadata.type) && decimationAllows(&legacyMetadata)) {
+				memmove(legacy + kept, legacy + j, length);
+				last = kept;
+				kept += length;
+			}
+			j += length;
+		}
+		if (kept > 0) {
+			setEpochSync(legacy + last, kept - last, passed);
+		}
+		j = 0;
+		while (j < kept) {
+			MessageMetadata legacyMetadata;
+			size_t length = getRtcmLength(legacy + j, kept - j) + LENGTH_OF_HEADER + LENGTH_OF_CRC;
+			getMessageMetadata(legacy + j, length, &legacyMetadata);
+			addFrame(legacy + j, length, TRUE);
+			archiveMessage(legacy + j, length, &legacyMetadata);
+			epochOpen = legacyMetadata.sync;
+			j += length;
+		}
+	}
+	if (replaced) {
+		countReplacedMsm();
+		recordFrame(FR_REPLACED, metadata.type, position, totalRtcmMessageLength, messageStatus);
+		endEpoch(frame, totalRtcmMessageLength, &metadata);
+		return TRUE;
+	}
+
+	// If a message that ends an epoch is dropped, the epoch is ended anyway.
+	if (!passed) {
+		if (displayingBuffers()) {
+			fprintf(stderr, "dropping message type %d - position %ld\n", metadata.type, position);
+		}
+		recordFrame(FR_FILTERED, metadata.type, position, totalRtcmMessageLength, messageStatus);
+		endEpoch(frame, totalRtcmMessageLength, &metadata);
+		return TRUE;
+	}
+
+	// Add it to the frame list.
+	if (displayingBuffers()) {
+		fprintf(stderr, "processing complete RTCM message - position %ld message length %ld\n",
+				position, totalRtcmMessageLength);
+	}
+	const unsigned char * message = frame;
+	size_t messageLength = totalRtcmMessageLength;
+	int copy = inCarry;
+
+	// Optionally remove some signals from an MSM.
+	size_t strippedLength;
+	if (!stripMessage(message, messageLength, stripped, &strippedLength)) {
+		if (displayingBuffers()) {
+			fprintf(stderr, "dropping message type %d - no signals left\n", metadata.type);
+		}
+		recordFrame(FR_NO_SIGNALS, metadata.type, position, totalRtcmMessageLength, messageStatus);
+		return TRUE;
+	}
+	if (strippedLength > 0) {
+		message = stripped;
+		messageLength = strippedLength;
+		copy = TRUE;
+	}
+
+	// Optionally remove the satellites below the elevation mask.
+	size_t prunedLength;
+	if (!pruneLowSatellites(message, messageLength, rtcm, pruned, &prunedLength)) {
+		if (displayingBuffers()) {
+			fprintf(stderr, "dropping message type %d - no satellites above the mask\n", metadata.type);
+		}
+		recordFrame(FR_BELOW_MASK, metadata.type, position, totalRtcmMessageLength, messageStatus);
+		return TRUE;
+	}
+	if (prunedLength > 0) {
+		message = pruned;
+		messageLength = prunedLength;
+		copy = TRUE;
+	}
+
+	// Optionally replace a high resolution MSM with an MSM4.
+	size_t transcodedLength = transcodeMessage(message, messageLength, transcoded);
+	if (transcodedLength > 0) {
+		message = transcoded;
+		messageLength = transcodedLength;
+		metadata.type = getbitu(transcoded, 24, 12);
+		copy = TRUE;
+	}
+
+	addFrame(message, messageLength, copy);
+	if (metadata.hasEpoch) {
+		epochOpen = metadata.sync;
+	}
+	recordFrame(FR_PASSED, metadata.type, position, totalRtcmMessageLength, messageStatus);
+	archiveMessage(message, messageLength, &metadata);
+
+	if (displayingBuffers()) {
+		displayRtcmMessage(rtcm);
+	}
+	return TRUE;
+}
+
+// frameFound is the framer's handler for a complete message.
+static int frameFound(const unsigned char * frame, size_t length, size_t position, int inCarry,
+		void * context __attribute__((__unused__))) {
+	setState(STATE_PROCESSING_RTCM_MESSAGE, position);
+	if (displayingBuffers()) {
+		fprintf(stderr, "\nFound RTCM message - position %ld total length %ld\n", position, length);
+	}
+	int legal = processFrame(frame, length, position, inCarry, decoder);
+	if (legal) {
+		setState(STATE_EATING_MESSAGES, position + length);
+	}
+	ENTER_STAGE(STAGE_SCAN);
+	return legal;
+}
+
+// skipBytes is the framer's handler for bytes that are not part of a message.
+static void skipBytes(size_t length, size_t position, void * context __attribute__((__unused__))) {
+	if (displayingBuffers()) {
+		fprintf(stderr, "\neating %ld bytes from position %ld\n", length, position);
+	}
+	fastPathLost();
+}
+
+// carryFragment is the framer's handler for a fragment at the end of a buffer
+// that's kept for next time.
+static void carryFragment(size_t carried, size_t position, void * context __attribute__((__unused__))) {
+	setState(STATE_PROCESSING_RTCM_MESSAGE, position);
+	if (displayingBuffers()) {
+		fprintf(stderr, "\nincomplete RTCM message at position %ld remaining %ld - deferring\n",
+				position, carried);
+	}
+	PROBE_FRAGMENT_CARRIED(carried);
+	recordFragment(carried);
+}
+
+FrameList * getRtcmFrames(Buffer inputBuffer, rtcm_t * rtcm) {
 
     /*
-     * getRtcmDataBlocks() takes a buffer containing satellite navigation messages of all sorts and
-     * returns a buffer containing only RTCM messages.  Data is read from a satnav device in real time
+     * getRtcmFrames() takes a buffer containing satellite navigation messages of all sorts and
+     * returns a list of just the RTCM messages in it.  Data is read from a satnav device in real time
      * with a timeout specified and using a bounded buffer.  The resulting input buffer typically contains
      * a fragment of a message that is continued from the previous buffer, a series of complete messages
      * and a fragment of a message that is continued in the next buffer.  Variations on that include a
@@ -341,8 +837,8 @@ Buffer * getRtcmDataBlocks(Buffer inputBuffer, rtcm_t * rtcm) {
      *
      * Having the message length specified in the message and given that an RTCM block can be spread over many
      * input buffers, there's an edge case where the buffer contains just the first one or two bytes of an
-     * RTCM block, say 0xD3 0x00.  That's not enough to figure out the message length.  The filter needs to write
-     * those data but remember them until the next block arrives so that it can make sense of the start of that.
+     * RTCM block, say 0xD3 0x00.  That's not enough to figure out the message length.  The filter needs to
+     * remember those data until the next block arrives so that it can make sense of the start of that.
      *
      * The format of the message embedded in the RTCM data block are defined in a standard.  It's not open-source
      * and I haven't bought a copy.  There are several numbered message types.  Each messages type has a
@@ -350,290 +846,94 @@ Buffer * getRtcmDataBlocks(Buffer inputBuffer, rtcm_t * rtcm) {
      * of the embedded message gives the message type.  The open source library RTKLIB has methods to decode the
      * various messages, so the format can be gleaned by reading that source code.
      *
-     * This method takes the input buffer, scans it for RTCM data blocks, copies those to the output buffer
-     * and discards anything else.  Since messages can span many buffers, some state must be preserved
-     * between input buffers.
-     *
-     * The output buffer is built up on the fly using malloc() and realloc().  Since it only ever contains some or
-     * all of the messages in the input buffer, and the length of that is bounded, the output buffer is bounded
-     * automatically.
+     * This method takes the input buffer, scans it for RTCM data blocks, and returns a list of the ones
+     * that pass the filters, for writev().  The list points into the input buffer, so the messages are not
+     * copied, and it's only valid until the input buffer is reused or this is called again.  A message
+     * that starts near the end of the buffer is copied into the carry buffer and completed from the next
+     * one, and it and any message that a filter rewrites are copied into the list's store.  Since messages
+     * can span many buffers, some state must be preserved between input buffers.
      *
      * To keep track of state between input buffers there is a state machine with states representing:
-     * not processing an RTCM message (discarding whatever it sees); processing the start (possibly all) of an RTCM
-     * data block; processing the continuation of an RTCM data block of unknown length, processing the continuation
-     * of an RTCM data block of known length.  State data includes static variables to track how much of a message
-     * that spans many buffers has already been processed.
+     * not processing an RTCM message (discarding whatever it sees) and processing the start (possibly
+     * all) of an RTCM data block.  State data includes the carry buffer, which holds the part of a message
+     * that spans many buffers that has already arrived.  The positions in the trace are offsets from the
+     * start of the carried fragment, as if it had been joined to the input buffer.
      *
      * In verbose mode, the filter displays the first few input buffers and any RTCM messages in those buffers.
      *
      * Some messages (including RTCM) are binary so the buffer may contain several null bytes, which means
      * (a) you can't treat the buffer as a simple C string and (b) messages may contain what look like newlines or
      * RTCM headers, but which are just part of the data.  Also, in a noisy environment we should assume that
-     * characters could be dropped.  To guard against all this, the function should check the CRC (using the code
-     * from RTKLIB) and ignore any messages that are badly formatted, but at present it doesn't.  The destination
-     * caster should have some error checking of its own, so letting some junk through should not be catastrophic.
+     * characters could be dropped.  To guard against all this, each message is checked and decoded by RTKLIB
+     * and one that fails is skipped a byte at a time, scanning on for the next 0xd3.
      */
 
-	const unsigned char rtcm_header_byte = 0xd3;
-	static Buffer * trailingFragment = NULL;	// Holds any unprocessed fragment of the previous buffer.
+	FrameList * list = &frameList;
+	list->count = 0;
+	list->length = 0;
+	list->messages = 0;
+	list->storeLength = 0;
 
-	// The combinedBuffer is our workspace.  If there is a trailing fragment from
-	// last time, it contains that followed by the input buffer, otherwise it contains
-	// just the input buffer.
-	Buffer * combinedBuffer = NULL;
-
-	// The outputBuffer.  Complete RTCM messages are copied into here.
-	Buffer * outputBuffer = NULL;
-
-	if (inputBuffer.length == 0) {
-		return NULL;
+	if (inputBuffer.length == 0 || inputBuffer.content == NULL) {
+		return list;
 	}
-	if (inputBuffer.content == NULL) {
-		return NULL;
-	}
-
-	if (trailingFragment != NULL && trailingFragment->content != NULL) {
-		// There is a fragment left to process from the end of the last buffer.
-		// It should start with a 0xd3 byte.
-		// Combine the trailing part from last time and the new input buffer.
-		combinedBuffer = addMessageFragmentToBuffer(
-				combinedBuffer, trailingFragment->content, trailingFragment->length);
-		combinedBuffer = addMessageFragmentToBuffer(
-				combinedBuffer, inputBuffer.content, inputBuffer.length);
-		freeBuffer(trailingFragment);
-		trailingFragment = NULL;
-		if (displayingBuffers()) {
-			fprintf(stderr, "processing combined buffer length %ld\n", combinedBuffer->length);
-		}
 
-		//We need at least the first three bytes of the message to figure out the length.
-		if ((combinedBuffer->length) < LENGTH_OF_HEADER) {
-			// Edge case.  The header is still incomplete! Copy what we have and exit.
-			if (displayingBuffers()) {
-				fprintf(stderr, "not enough in combined buffer to get the header - length %ld\n",
-						combinedBuffer->length);
-			}
-			trailingFragment = addMessageFragmentToBuffer(
-					trailingFragment, combinedBuffer->content, combinedBuffer->length);
-			return NULL;
-		}
+	ENTER_STAGE(STAGE_SCAN);
+	if (stageCosting) {
+		countStage(STAGE_SCAN, 0, inputBuffer.length);
+	}
 
-		if (displayingBuffers()) {
-			fprintf(stderr, "combined input buffer");
-			displayBuffer(combinedBuffer);
-		}
-
-	} else {
-		// The previous buffer was completely processed.  Process just the
-		// new input buffer.
-		combinedBuffer = addMessageFragmentToBuffer(
-				combinedBuffer, inputBuffer.content, inputBuffer.length);
-		if (displayingBuffers()) {
-			fprintf(stderr, "processing input buffer length %ld\n", combinedBuffer->length);
+	if (framer == NULL) {
+		static const FramerHandlers handlers = { frameFound, skipBytes, carryFragment };
+		framer = createFramer(&handlers, NULL);
+		if (framer == NULL) {
+			fprintf(stderr, "ERROR: no memory for the framer\n");
+			exit(1);
 		}
 	}
 
-	int displayEating = TRUE;
-
-	size_t i = 0;
-	while (i < combinedBuffer->length) {
-
-		// Scan the buffer for the next RTCM message.
-
-		unsigned char * remainingBuffer = combinedBuffer->content + i;
-		size_t lengthOfRemainingBuffer = combinedBuffer->length - i;
-
-		// This could be a case statement, except that we use break to escape from the while loop.
-		if (state == STATE_EATING_MESSAGES) {
-			// Process messages which are not RTCM by ignoring them.  If we see the start of an
-			// RTCM message, stop eating.
-			if (displayingBuffers() && combinedBuffer->content[i] != rtcm_header_byte) {
-
-			}
-			if (combinedBuffer->content[i] == rtcm_header_byte) {
-				// Stop eating.
-				if (displayingBuffers()) {
-					fprintf(stderr, "\nStart of RTCM message, stop eating - position %ld\n", i);
-				}
-				state = STATE_PROCESSING_RTCM_MESSAGE;
-				continue;
-			} else {
-				// Eat.
-				if (displayingBuffers()) {
-					if (displayEating) {
-						// Only display this once.
-						displayEating = FALSE;
-						fprintf(stderr, "\neating messages from position %ld\n", i);
-					}
-					putc(combinedBuffer->content[i], stderr);
-				}
-				i++;
-				continue;
-			}
-
-		} else if (state == STATE_PROCESSING_RTCM_MESSAGE) {
-
-			// This point in the input buffer is the start of an RTCM message.  Either the buffer contains
-			// the whole message or the first fragment of it and it will be continued in the next buffer.
-			// The message is binary, variable length and in three parts:
-			//     header containing 0xd3 plus two bytes containing the 10-bit message length
-			//     the message
-			//     three-byte CRC,
-			// So the total message is (length+6) bytes long and we need the first three bytes to figure
-			// out the length.
-
-			if (displayingBuffers()) {
-				fprintf(stderr, "processing RTCM message - position %ld\n", i);
-			}
-
-			if (combinedBuffer->content[i] != rtcm_header_byte) {
-				fprintf(stderr, "\nError: state is processing start of RTCM message but byte is 0x%x - position %ld\n",
-						combinedBuffer->content[i], i);
-				state = STATE_EATING_MESSAGES;
-				i++;
-				continue;
-			}
-
-			size_t rtcmMessageLength = getRtcmLength(remainingBuffer, lengthOfRemainingBuffer);
-
-			if (rtcmMessageLength == 0) {
-				// We don't have enough of the message to figure out the length.  Put the
-				// remainder into the trailing buffer for next time and exit.
-				if (displayingBuffers()) {
-					fprintf(stderr, "\nincomplete RTCM message at position %ld given message length %ld remaining %ld - deferring\n",
-							i, rtcmMessageLength, lengthOfRemainingBuffer);
-				}
-				trailingFragment = addMessageFragmentToBuffer(
-						trailingFragment, remainingBuffer, lengthOfRemainingBuffer);
-				break;
-			}
-
-			// We have the message length.
-			if (displayingBuffers()) {
-				fprintf(stderr, "\nFound RTCM message - position %ld given message length %ld\n",
-						i, rtcmMessageLength);
-			}
-
-			size_t totalRtcmMessageLength = rtcmMessageLength + LENGTH_OF_HEADER + LENGTH_OF_CRC;
-
-			if (totalRtcmMessageLength > lengthOfRemainingBuffer) {
-				// The rest of the input buffer does not contain the whole message.
-				// Copy what we have into the trailing fragment and carry on.
-				if (displayingBuffers()) {
-					fprintf(stderr, "\nincomplete RTCM message - position %ld message length %ld/%ld remaining %ld\n",
-							i, rtcmMessageLength, totalRtcmMessageLength, lengthOfRemainingBuffer);
-				}
-				trailingFragment = addMessageFragmentToBuffer(
-						trailingFragment, remainingBuffer, lengthOfRemainingBuffer);
-				break;
-			}
-
-			// The whole message is contained in this input buffer.  Check it.
-			if (displayingBuffers()) {
-				fprintf(stderr, "\nchecking message\n");
-			}
-			memcpy(rtcm->buff, remainingBuffer, totalRtcmMessageLength);
-			rtcm->nbyte = totalRtcmMessageLength;
-			rtcm->len = rtcmMessageLength + LENGTH_OF_HEADER;
-			int messageStatus = input_rtcm3(rtcm, rtcm_header_byte);
-			if (messageStatus < 0) {
-				// The message is not legal.  Log it and start eating.
-				illegalMessagesSoFar++;
-				if (displayingBuffers()) {
-					switch (messageStatus) {
-					case -2:
-						fprintf(stderr, "RTCM message fails CRC check - position %ld given message length %ld\n",
-							i, rtcmMessageLength);
-						break;
-					case -1:
-						fprintf(stderr, "error - cannot decode RTCM message - position %ld given message length %ld\n",
-							i, rtcmMessageLength);
-						break;
-					default:
-						fprintf(stderr, "unexpected error while reading RTCM message - position %ld given message length %ld\n",
-								i, rtcmMessageLength);
-						break;
-					}
-				}
-				state = STATE_EATING_MESSAGES;
-				i++;
-				continue;
-			} else {
-				if (displayingBuffers()) {
-					fprintf(stderr, "RTCM message at position %ld.  Status %d type %d given message length %ld\n",
-						i, messageStatus, rtcm->outtype, rtcmMessageLength);
-				}
-				rtcmMessagesSoFar++;
-				switch (rtcm->outtype) {
-				case 1005:
-					type1005MessagesSoFar++;
-					break;
-				case 1074:
-					type1074MessagesSoFar++;
-					break;
-				case 1084:
-					type1084MessagesSoFar++;
-					break;
-				case 1094:
-					type1094MessagesSoFar++;
-					break;
-				case 1097:
-					type1097MessagesSoFar++;
-					break;
-				case 1124:
-					type1124MessagesSoFar++;
-					break;
-				case 1127:
-					type1127MessagesSoFar++;
-					break;
-				case 1230:
-					type1230MessagesSoFar++;
-					break;
-				default:
-					unexpectedMessagesSoFar++;
-					fprintf(stderr, "unexpected message type %d\n", rtcm->outtype);
-					break;
-				}
-			}
-
-			// The message is legal.  Copy it to the output buffer.
-			if (displayingBuffers()) {
-				fprintf(stderr, "processing complete RTCM message - position %ld message length %ld\n",
-						i, totalRtcmMessageLength);
-			}
-			outputBuffer = addMessageFragmentToBuffer(outputBuffer, remainingBuffer, totalRtcmMessageLength);
-
-			if (displayingBuffers()) {
-				displayRtcmMessage(rtcm);
-			}
-
-			// Move the position to the next message.
-			i += totalRtcmMessageLength;
-			state = STATE_EATING_MESSAGES;
-			continue;
-
-		} else {
-			// Shouldn't happen.
-			fprintf(stderr, "warning:  unknown state value %d at i=%ld\n", state, i);
-			i++;
-			state = STATE_EATING_MESSAGES;
-		}   // end if
-	}  // end while
-
-	freeBuffer(combinedBuffer);
+	// The framer scans the buffer, completing the message carried over from
+	// the last one first, and hands each message to processFrame().
+	RtcmFramerCounts before, after;
+	rtcmFramerGetCounts(framer, &before);
+	decoder = rtcm;
+	rtcmFramerPush(framer, inputBuffer.content, inputBuffer.length);
+	rtcmFramerGetCounts(framer, &after);
+	size_t eaten = after.bytesDiscarded - before.bytesDiscarded;
+
+	countBytesEaten(eaten);
+	if (eaten > 0) {
+		PROBE_BYTES_EATEN(eaten);
+		recordEaten(eaten);
+	}
+	ENTER_STAGE(STAGE_NONE);
 
 	if (displayingBuffers()) {
-		if (outputBuffer == NULL || outputBuffer->length == 0) {
-			fprintf(stderr, "returning empty output buffer\n");
+		if (list->count == 0) {
+			fprintf(stderr, "returning empty frame list\n");
 		} else {
-			fprintf(stderr, "returning output buffer\n");
+			fprintf(stderr, "returning %d frames, %ld bytes\n", list->count, list->length);
 		}
 		// Totals are displayed frequently at first.
 		displayTotals();
 	}
 
-	// Totals are displayed every hour in normal running.
-	displayTotalsEveryHour();
+	return list;
+}
 
+// getRtcmDataBlocks is getRtcmFrames() for callers that want the messages in
+// one buffer.  It returns NULL if there are none, otherwise the caller must
+// free the buffer.
+Buffer * getRtcmDataBlocks(Buffer inputBuffer, rtcm_t * rtcm) {
+	FrameList * list = getRtcmFrames(inputBuffer, rtcm);
+	if (list->count == 0) {
+		return NULL;
+	}
+	Buffer * outputBuffer = createBuffer(list->length);
+	size_t i = 0;
+	for (int f = 0; f < list->count; f++) {
+		memcpy(outputBuffer->content + i, list->frames[f].iov_base, list->frames[f].iov_len);
+		i += list->frames[f].iov_len;
+	}
 	return outputBuffer;
 }
@@ -0,0 +1,301 @@
+/*
+ * metadata.c
+ *
+ * Light-weight extraction of the header fields of an RTCM3 message.
+ *
+ * Monitoring, archive indexing and epoch grouping only need a few fields from
+ * each message - the type, the station ID, the epoch time and so on.  Getting
+ * those by running the full RTKLIB decoder means decoding every observation
+ * into an obs_t or nav_t, which costs far more than the few bit fields that
+ * are actually wanted.  getMessageMetadata() reads just the header fields
+ * straight from the message, without touching the rtcm_t structure.
+ *
+ * For a Multiple Signal Message (MSM) it gets the type, station ID, epoch,
+ * multiple message bit (sync), IODS and the number of satellites, signals and
+ * cells, which are the population counts of the satellite, signal and cell
+ * masks.  For the legacy observation messages 1001-1012 it gets the type,
+ * station ID, epoch, sync flag and number of satellites.  For ephemerides it
+ * gets the type, the satellite and the issue of data.  For the station
+ * messages it gets the type and station ID.
+ *
+ * The epoch is given as milliseconds into the GPS week, whatever the
+ * constellation, so that the MSM messages for the same epoch from different
+ * constellations have the same epoch value.  GLONASS messages give the time as
+ * Moscow time of day plus the day of week, and the day of week may be unknown
+ * (7).  In that case the epoch is only known modulo a day, so epochs should be
+ * compared using sameEpoch().
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rtcmfilter.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+#define MILLISECONDS_PER_DAY 86400000
+#define MILLISECONDS_PER_WEEK (7 * MILLISECONDS_PER_DAY)
+#define BDT_TO_GPST_MILLISECONDS 14000
+#define MOSCOW_TIME_OFFSET_MILLISECONDS (3 * 3600 * 1000)
+
+// Start bit of the fields of the MSM header.
+#define MSM_EPOCH_BIT 48
+#define MSM_SYNC_BIT 78
+#define MSM_IODS_BIT 79
+#define MSM_SATELLITE_MASK_BIT 97
+#define MSM_SIGNAL_MASK_BIT 161
+#define MSM_CELL_MASK_BIT 193
+
+// The difference between GPS time and UTC, for GLONASS times.
+static int leapMilliseconds = -1;
+
+static int getLeapMilliseconds() {
+	if (leapMilliseconds < 0) {
+		gtime_t now = timeget();
+		leapMilliseconds = (int) (timediff(utc2gpst(now), now) * 1000.0 + 0.5);
+	}
+	return leapMilliseconds;
+}
+
+// Count the bits that are set in a bit field of up to 64 bits.
+static unsigned int countBits(const unsigned char * buffer, int position, int length) {
+	unsigned int count = 0;
+	while (length > 0) {
+		int chunk = length > 32 ? 32 : length;
+		count += __builtin_popcount(getbitu(buffer, position, chunk));
+		position += chunk;
+		length -= chunk;
+	}
+	return count;
+}
+
+// Convert a GLONASS day of week and Moscow time of day to milliseconds into
+// the GPS week.  If the day of week is unknown, the result is just the time
+// into the GPS day.
+static uint32_t glonassToGpsMilliseconds(unsigned int dayOfWeek, unsigned int timeOfDay) {
+	int64_t milliseconds = (int64_t) timeOfDay - MOSCOW_TIME_OFFSET_MILLISECONDS + getLeapMilliseconds();
+	if (dayOfWeek < 7) {
+		milliseconds += (int64_t) dayOfWeek * MILLISECONDS_PER_DAY;
+		milliseconds = (milliseconds + MILLISECONDS_PER_WEEK) % MILLISECONDS_PER_WEEK;
+	} else {
+		milliseconds = (milliseconds + MILLISECONDS_PER_DAY) % MILLISECONDS_PER_DAY;
+	}
+	return (uint32_t) milliseconds;
+}
+
+// isMsmMessage returns true if the message type is one of the Multiple Signal
+// Messages, 1071-1127 (MSM1 to MSM7 for each constellation).
+int isMsmMessage(unsigned int type) {
+	return type >= 1071 && type <= 1127 && (type % 10) >= 1 && (type % 10) <= 7;
+}
+
+// getMsmSystem returns the constellation of an MSM message type, or SYS_NONE.
+int getMsmSystem(unsigned int type) {
+	if (!isMsmMessage(type)) {
+		return SYS_NONE;
+	}
+	switch (type / 10) {
+	case 107:
+		return SYS_GPS;
+	case 108:
+		return SYS_GLO;
+	case 109:
+		return SYS_GAL;
+	case 110:
+		return SYS_SBS;
+	case 111:
+		return SYS_QZS;
+	case 112:
+		return SYS_CMP;
+	default:
+		return SYS_NONE;
+	}
+}
+
+// sameEpoch returns true if two epochs returned by getMessageMetadata() are
+// the same.  The comparison is modulo a day, because the day is unknown in some
+// GLONASS messages.
+int sameEpoch(uint32_t epoch1, uint32_t epoch2) {
+	return epoch1 % MILLISECONDS_PER_DAY == epoch2 % MILLISECONDS_PER_DAY;
+}
+
+// getMessageMetadata fills in the metadata from a complete RTCM3 message,
+// including the three-byte header and the CRC.  The CRC is not checked.
+// Returns FALSE if the message is too short for its type.
+int getMessageMetadata(const unsigned char * message, size_t length, MessageMetadata * metadata) {
+
+	memset(metadata, 0, sizeof(MessageMetadata));
+
+	if (length < LENGTH_OF_HEADER + LENGTH_OF_CRC + 2) {
+		return FALSE;
+	}
+
+	// The position of the end of the embedded message, in bits.
+	size_t end = (length - LENGTH_OF_CRC) * 8;
+
+	metadata->type = getbitu(message, 24, 12);
+	metadata->system = getMsmSystem(metadata->type);
+
+	if (metadata->system != SYS_NONE) {
+		// An MSM.  The header is 169 bits plus the cell mask.
+		if (end < MSM_CELL_MASK_BIT) {
+			return FALSE;
+		}
+		metadata->stationID = getbitu(message, 36, 12);
+		if (metadata->system == SYS_GLO) {
+			metadata->epoch = glonassToGpsMilliseconds(
+					getbitu(message, MSM_EPOCH_BIT, 3), getbitu(message, MSM_EPOCH_BIT + 3, 27));
+		} else if (metadata->system == SYS_CMP) {
+			metadata->epoch = (getbitu(message, MSM_EPOCH_BIT, 30) + BDT_TO_GPST_MILLISECONDS)
+					% MILLISECONDS_PER_WEEK;
+		} else {
+			metadata->epoch = getbitu(message, MSM_EPOCH_BIT, 30);
+		}
+		metadata->hasEpoch = TRUE;
+		metadata->sync = getbitu(message, MSM_SYNC_BIT, 1);
+		metadata->iods = getbitu(message, MSM_IODS_BIT, 3);
+		metadata->satellites = countBits(message, MSM_SATELLITE_MASK_BIT, 64);
+		metadata->signals = countBits(message, MSM_SIGNAL_MASK_BIT, 32);
+		int cellMaskLength = metadata->satellites * metadata->signals;
+		if (cellMaskLength > 64 || MSM_CELL_MASK_BIT + (size_t) cellMaskLength > end) {
+			return FALSE;
+		}
+		metadata->cells = countBits(message, MSM_CELL_MASK_BIT, cellMaskLength);
+		return TRUE;
+	}
+
+	switch (metadata->type) {
+	case 1001: case 1002: case 1003: case 1004:
+		// GPS observations - staid, tow (ms), sync, number of satellites.
+		if (end < 24 + 64) {
+			return FALSE;
+		}
+		metadata->stationID = getbitu(message, 36, 12);
+		metadata->epoch = getbitu(message, 48, 30);
+		metadata->hasEpoch = TRUE;
+		metadata->sync = getbitu(message, 78, 1);
+		metadata->satellites = getbitu(message, 79, 5);
+		break;
+	case 1009: case 1010: case 1011: case 1012:
+		// GLONASS observations - staid, tod (ms), sync, number of satellites.
+		if (end < 24 + 61) {
+			return FALSE;
+		}
+		metadata->stationID = getbitu(message, 36, 12);
+		metadata->epoch = glonassToGpsMilliseconds(7, getbitu(message, 48, 27));
+		metadata->hasEpoch = TRUE;
+		metadata->sync = getbitu(message, 75, 1);
+		metadata->satellites = getbitu(message, 76, 5);
+		break;
+	case 1005: case 1006: case 1007: case 1008: case 1033: case 1230:
+		// Station and antenna information.
+		if (end < 24 + 24) {
+			return FALSE;
+		}
+		metadata->stationID = getbitu(message, 36, 12);
+		break;
+	case 1019:
+		// GPS ephemeris.
+		if (end < 24 + 12 + 44) {
+			return FALSE;
+		}
+		metadata->system = SYS_GPS;
+		metadata->satellite = getbitu(message, 36, 6);
+		metadata->iode = getbitu(message, 36 + 6 + 10 + 4 + 2 + 14, 8);
+		break;
+	case 1020:
+		// GLONASS ephemeris.  It has no IODE, so use tb, the index of the
+		// time interval of the ephemeris.
+		if (end < 24 + 12 + 47) {
+			return FALSE;
+		}
+		metadata->system = SYS_GLO;
+		metadata->satellite = getbitu(message, 36, 6);
+		metadata->iode = getbitu(message, 36 + 6 + 5 + 2 + 2 + 5 + 6 + 1 + 1 + 1, 7);
+		break;
+	case 1042: case 63:
+		// BeiDou ephemeris.  The issue of data is the AODE.
+		if (end < 24 + 12 + 42) {
+			return FALSE;
+		}
+		metadata->system = SYS_CMP;
+		metadata->satellite = getbitu(message, 36, 6);
+		metadata->iode = getbitu(message, 36 + 6 + 13 + 4 + 14, 5);
+		break;
+	case 1044:
+		// QZSS ephemeris.
+		if (end < 24 + 12 + 74) {
+			return FALSE;
+		}
+		metadata->system = SYS_QZS;
+		metadata->satellite = getbitu(message, 36, 4) + 192;
+		metadata->iode = getbitu(message, 36 + 4 + 16 + 8 + 16 + 22, 8);
+		break;
+	case 1045: case 1046:
+		// Galileo F/NAV and I/NAV ephemeris.  The issue of data is the IODnav.
+		if (end < 24 + 12 + 28) {
+			return FALSE;
+		}
+		metadata->system = SYS_GAL;
+		metadata->satellite = getbitu(message, 36, 6);
+		metadata->iode = getbitu(message, 36 + 6 + 12, 10);
+		break;
+	default:
+		break;
+	}
+
+	return TRUE;
+}
+
+// getEpochTime converts an epoch returned by getMessageMetadata() to a time,
+// using the week of the reference time, or the week before or after, whichever
+// gives the time closest to the reference.
+gtime_t getEpochTime(uint32_t epoch, gtime_t reference) {
+	int week;
+	double referenceTow = time2gpst(reference, &week);
+	double tow = epoch / 1000.0;
+
+	if (tow < referenceTow - 302400.0) {
+		tow += 604800.0;
+	} else if (tow > referenceTow + 302400.0) {
+		tow -= 604800.0;
+	}
+	return gpst2time(week, tow);
+}
+
+// getMessageTime converts the epoch of an observation message to a time, as
+// getEpochTime() does.  The legacy GLONASS observations only give the time of
+// day, so for them the day comes from the reference time, or the day before or
+// after, whichever gives the time closest to the reference.
+gtime_t getMessageTime(const MessageMetadata * metadata, gtime_t reference) {
+	if (metadata->type < 1009 || metadata->type > 1012) {
+		return getEpochTime(metadata->epoch, reference);
+	}
+	double referenceTod = fmod(time2gpst(reference, NULL), 86400.0);
+	double tod = metadata->epoch / 1000.0;
+	if (tod < referenceTod - 43200.0) {
+		tod += 86400.0;
+	} else if (tod > referenceTod + 43200.0) {
+		tod -= 86400.0;
+	}
+	return timeadd(reference, tod - referenceTod);
+}
+
+// displayMessageMetadata displays the metadata of a message, for debugging.
+void displayMessageMetadata(const MessageMetadata * metadata) {
+	if (isMsmMessage(metadata->type)) {
+		fprintf(stderr, "type %d station %d epoch %d sync %d iods %d satellites %d signals %d cells %d\n",
+				metadata->type, metadata->stationID, metadata->epoch, metadata->sync,
+				metadata->iods, metadata->satellites, metadata->signals, metadata->cells);
+	} else if (metadata->hasEpoch) {
+		fprintf(stderr, "type %d station %d epoch %d sync %d satellites %d\n",
+				metadata->type, metadata->stationID, metadata->epoch, metadata->sync,
+				metadata->satellites);
+	} else if (metadata->satellite > 0) {
+		fprintf(stderr, "type %d satellite %d iode %d\n",
+				metadata->type, metadata->satellite, metadata->iode);
+	} else {
+		fprintf(stderr, "type %d station %d\n", metadata->type, metadata->stationID);
+	}
+}
@@ -0,0 +1,393 @@
+/*
+ * metrics.c
+ *
+ * A registry of counters, exported in the Prometheus text format.
+ *
+ * The totals that the filter writes to stderr are meant for people, and they
+ * only cover a handful of message types.  The registry counts the frames and
+ * bytes of every message type (the whole 12-bit type space), the frames that
+ * fail the CRC check or can't be decoded, the bytes that are eaten because
+ * they are not RTCM and the reads from the input and their sizes.  With rate
+ * limiting, it also counts the messages that the shaper defers and drops for
+ * each priority and the bytes that it sends and drops, and holds the tokens in
+ * its bucket and the bytes waiting as gauges.  The counters are never reset,
+ * as Prometheus expects.
+ *
+ * The counters are C11 atomics.  They are only ever written by the thread that
+ * processes the input, so an increment is a relaxed load and store rather than
+ * a locked read-modify-write, and a reader in another thread sees a value that
+ * may be slightly stale but is never torn.
+ *
+ * The metrics can be scraped over HTTP on a Unix socket - each connection
+ * sends a request, gets the current values and is closed - and they can be
+ * written to a file every few seconds, for the node exporter's textfile
+ * collector.  The file is written under a temporary name and renamed, so a
+ * reader never sees half of it.  Both are served by a thread of their own, so
+ * exporting never holds up the filter.  The thread is stopped by writing to a
+ * pipe that it polls along with the socket, so it's never stopped in the
+ * middle of a scrape or a file write.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rtcmfilter.h"
+
+#define NUMBER_OF_MESSAGE_TYPES 4096
+#define NUMBER_OF_READ_SIZE_BUCKETS 17		// Powers of two up to 64K.
+#define METRICS_FILE_INTERVAL 10			// seconds
+#define REQUEST_TIMEOUT 1000				// milliseconds
+#define MAX_REQUEST_LENGTH 4096
+
+static atomic_ulong framesByType[NUMBER_OF_MESSAGE_TYPES];
+static atomic_ulong bytesByType[NUMBER_OF_MESSAGE_TYPES];
+static atomic_ulong crcFailures;
+static atomic_ulong decodeFailures;
+static atomic_ulong bytesEaten;
+static atomic_ulong reads;
+static atomic_ulong readBytes;
+static atomic_ulong readSizes[NUMBER_OF_READ_SIZE_BUCKETS + 1];	// The last is the overflow.
+static int shaperMetrics = FALSE;		// Set once the shaper is in use.
+static atomic_ulong shaperDeferred[SHAPER_PRIORITIES];
+static atomic_ulong shaperDropped[SHAPER_PRIORITIES];
+static atomic_ulong shaperBytesSent;
+static atomic_ulong shaperBytesDropped;
+static atomic_ulong shaperTokens;		// Gauge, whole bytes.
+static atomic_ulong shaperBytesWaiting;	// Gauge.
+
+static const char * socketPath = NULL;
+static const char * filePath = NULL;
+static int listener = -1;
+static pthread_t exporter;
+static int exporting = FALSE;
+static int stopPipe[2] = {-1, -1};		// Written to stop the exporter.
+
+// add increments a counter.  Each counter has a single writer.
+static inline void add(atomic_ulong * counter, unsigned long n) {
+	atomic_store_explicit(counter,
+			atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline unsigned long get(atomic_ulong * counter) {
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void countRead(size_t length) {
+	add(&reads, 1);
+	add(&readBytes, length);
+	int bucket = 0;
+	while (bucket < NUMBER_OF_READ_SIZE_BUCKETS && length > (1UL << bucket)) {
+		bucket++;
+	}
+	add(&readSizes[bucket], 1);
+}
+
+void countFrame(unsigned int type, size_t length) {
+	type %= NUMBER_OF_MESSAGE_TYPES;
+	add(&framesByType[type], 1);
+	add(&bytesByType[type], length);
+}
+
+void countCrcFailure() {
+	add(&crcFailures, 1);
+}
+
+void countDecodeFailure() {
+	add(&decodeFailures, 1);
+}
+
+void countBytesEaten(size_t length) {
+	add(&bytesEaten, length);
+}
+
+void countShaperDeferred(int priority) {
+	add(&shaperDeferred[priority], 1);
+}
+
+void countShaperDropped(int priority, size_t length) {
+	add(&shaperDropped[priority], 1);
+	add(&shaperBytesDropped, length);
+}
+
+void countShaperSent(size_t length) {
+	add(&shaperBytesSent, length);
+}
+
+// setShaperLevels sets the gauges of the tokens in the shaper's bucket and the
+// bytes waiting in its queues.
+void setShaperLevels(double tokens, size_t waiting) {
+	shaperMetrics = TRUE;
+	atomic_store_explicit(&shaperTokens, tokens > 0.0 ? (unsigned long) tokens : 0, memory_order_relaxed);
+	atomic_store_explicit(&shaperBytesWaiting, waiting, memory_order_relaxed);
+}
+
+unsigned long getFrameCount(unsigned int type) {
+	return get(&framesByType[type % NUMBER_OF_MESSAGE_TYPES]);
+}
+
+unsigned long getFailureCount() {
+	return get(&crcFailures) + get(&decodeFailures);
+}
+
+// writeMetrics writes the counters in the Prometheus text format.
+void writeMetrics(FILE * out) {
+	fprintf(out, "# HELP rtcmfilter_frames_total Valid RTCM3 frames by message type.\n");
+	fprintf(out, "# TYPE rtcmfilter_frames_total counter\n");
+	for (int type = 0; type < NUMBER_OF_MESSAGE_TYPES; type++) {
+		unsigned long frames = get(&framesByType[type]);
+		if (frames > 0) {
+			fprintf(out, "rtcmfilter_frames_total{type=\"%d\"} %lu\n", type, frames);
+		}
+	}
+	fprintf(out, "# HELP rtcmfilter_frame_bytes_total Bytes of valid RTCM3 frames by message type.\n");
+	fprintf(out, "# TYPE rtcmfilter_frame_bytes_total counter\n");
+	for (int type = 0; type < NUMBER_OF_MESSAGE_TYPES; type++) {
+		unsigned long bytes = get(&bytesByType[type]);
+		if (bytes > 0) {
+			fprintf(out, "rtcmfilter_frame_bytes_total{type=\"%d\"} %lu\n", type, bytes);
+		}
+	}
+
+	fprintf(out, "# HELP rtcmfilter_crc_failures_total Frames that failed the CRC check.\n");
+	fprintf(out, "# TYPE rtcmfilter_crc_failures_total counter\n");
+	fprintf(out, "rtcmfilter_crc_failures_total %lu\n", get(&crcFailures));
+	fprintf(out, "# HELP rtcmfilter_decode_failures_total Frames with a good CRC that could not be decoded.\n");
+	fprintf(out, "# TYPE rtcmfilter_decode_failures_total counter\n");
+	fprintf(out, "rtcmfilter_decode_failures_total %lu\n", get(&decodeFailures));
+	fprintf(out, "# HELP rtcmfilter_bytes_eaten_total Input bytes discarded because they are not RTCM3.\n");
+	fprintf(out, "# TYPE rtcmfilter_bytes_eaten_total counter\n");
+	fprintf(out, "rtcmfilter_bytes_eaten_total %lu\n", get(&bytesEaten));
+	fprintf(out, "# HELP rtcmfilter_reads_total Reads from the input.\n");
+	fprintf(out, "# TYPE rtcmfilter_reads_total counter\n");
+	fprintf(out, "rtcmfilter_reads_total %lu\n", get(&reads));
+
+	fprintf(out, "# HELP rtcmfilter_read_size_bytes Size of the reads from the input.\n");
+	fprintf(out, "# TYPE rtcmfilter_read_size_bytes histogram\n");
+	unsigned long cumulative = 0;
+	for (int bucket = 0; bucket < NUMBER_OF_READ_SIZE_BUCKETS; bucket++) {
+		cumulative += get(&readSizes[bucket]);
+		fprintf(out, "rtcmfilter_read_size_bytes_bucket{le=\"%lu\"} %lu\n", 1UL << bucket, cumulative);
+	}
+	cumulative += get(&readSizes[NUMBER_OF_READ_SIZE_BUCKETS]);
+	fprintf(out, "rtcmfilter_read_size_bytes_bucket{le=\"+Inf\"} %lu\n", cumulative);
+	fprintf(out, "rtcmfilter_read_size_bytes_sum %lu\n", get(&readBytes));
+	fprintf(out, "rtcmfilter_read_size_bytes_count %lu\n", cumulative);
+
+	if (!shaperMetrics) {
+		return;
+	}
+	fprintf(out, "# HELP rtcmfilter_shaper_deferred_total Messages held back by the rate limiter, by priority.\n");
+	fprintf(out, "# TYPE rtcmfilter_shaper_deferred_total counter\n");
+	for (int priority = 0; priority < SHAPER_PRIORITIES; priority++) {
+		fprintf(out, "rtcmfilter_shaper_deferred_total{priority=\"%s\"} %lu\n",
+				getShaperPriorityName(priority), get(&shaperDeferred[priority]));
+	}
+	fprintf(out, "# HELP rtcmfilter_shaper_dropped_total Messages dropped by the rate limiter, by priority.\n");
+	fprintf(out, "# TYPE rtcmfilter_shaper_dropped_total counter\n");
+	for (int priority = 0; priority < SHAPER_PRIORITIES; priority++) {
+		fprintf(out, "rtcmfilter_shaper_dropped_total{priority=\"%s\"} %lu\n",
+				getShaperPriorityName(priority), get(&shaperDropped[priority]));
+	}
+	fprintf(out, "# HELP rtcmfilter_shaper_sent_bytes_total Bytes sent by the rate limiter.\n");
+	fprintf(out, "# TYPE rtcmfilter_shaper_sent_bytes_total counter\n");
+	fprintf(out, "rtcmfilter_shaper_sent_bytes_total %lu\n", get(&shaperBytesSent));
+	fprintf(out, "# HELP rtcmfilter_shaper_dropped_bytes_total Bytes dropped by the rate limiter.\n");
+	fprintf(out, "# TYPE rtcmfilter_shaper_dropped_bytes_total counter\n");
+	fprintf(out, "rtcmfilter_shaper_dropped_bytes_total %lu\n", get(&shaperBytesDropped));
+	fprintf(out, "# HELP rtcmfilter_shaper_tokens Tokens (bytes) in the rate limiter's bucket.\n");
+	fprintf(out, "# TYPE rtcmfilter_shaper_tokens gauge\n");
+	fprintf(out, "rtcmfilter_shaper_tokens %lu\n", get(&shaperTokens));
+	fprintf(out, "# HELP rtcmfilter_shaper_waiting_bytes Bytes held back by the rate limiter.\n");
+	fprintf(out, "# TYPE rtcmfilter_shaper_waiting_bytes gauge\n");
+	fprintf(out, "rtcmfilter_shaper_waiting_bytes %lu\n", get(&shaperBytesWaiting));
+}
+
+// writeMetricsFile writes the metrics to a temporary file and renames it.
+static void writeMetricsFile() {
+	char temporary[strlen(filePath) + 5];
+	sprintf(temporary, "%s.tmp", filePath);
+	FILE * out = fopen(temporary, "w");
+	if (out == NULL) {
+		perror("WARNING: writing metrics file");
+		return;
+	}
+	writeMetrics(out);
+	if (fclose(out) != 0 || rename(temporary, filePath) != 0) {
+		perror("WARNING: writing metrics file");
+	}
+}
+
+// readRequest reads the HTTP request up to the blank line that ends its
+// headers.  Whatever is asked for, the answer is the metrics, so the request
+// is not parsed.  A client that sends nothing gets the answer after a second,
+// which is as long as the thread will wait for it.
+static void readRequest(int connection) {
+	char request[MAX_REQUEST_LENGTH + 1];
+	size_t length = 0;
+	struct pollfd pfd = { connection, POLLIN, 0 };
+	while (length < MAX_REQUEST_LENGTH && poll(&pfd, 1, REQUEST_TIMEOUT) > 0) {
+		ssize_t n = recv(connection, request + length, MAX_REQUEST_LENGTH - length, 0);
+		if (n <= 0) {
+			return;
+		}
+		length += n;
+		request[length] = '\0';
+		if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+			return;
+		}
+	}
+}
+
+// sendAll sends the whole of the text with MSG_NOSIGNAL, as a client that
+// hangs up early must not raise SIGPIPE, which stops the filter.
+static int sendAll(int connection, const char * text, size_t length) {
+	size_t sent = 0;
+	while (sent < length) {
+		ssize_t n = send(connection, text + sent, length - sent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			return FALSE;
+		}
+		sent += n;
+	}
+	return TRUE;
+}
+
+// sendMetrics answers a scrape with an HTTP response carrying the metrics.
+static void sendMetrics(int connection) {
+	readRequest(connection);
+	char * text = NULL;
+	size_t length = 0;
+	FILE * out = open_memstream(&text, &length);
+	if (out == NULL) {
+		return;
+	}
+	writeMetrics(out);
+	fclose(out);
+	char header[200];
+	int headerLength = snprintf(header, sizeof(header),
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %lu\r\n"
+			"Connection: close\r\n"
+			"\r\n", (unsigned long) length);
+	if (sendAll(connection, header, headerLength)) {
+		sendAll(connection, text, length);
+	}
+	free(text);
+}
+
+// serveMetrics answers scrapes on the socket and rewrites the file until
+// closeMetrics() writes to the stop pipe.
+static void * serveMetrics(void * unused __attribute__((__unused__))) {
+	struct pollfd pfd[2] = { { stopPipe[0], POLLIN, 0 }, { listener, POLLIN, 0 } };
+	int descriptors = listener >= 0 ? 2 : 1;
+	time_t nextFileWrite = time(NULL) + METRICS_FILE_INTERVAL;
+	while (TRUE) {
+		int timeout = -1;
+		if (filePath != NULL) {
+			time_t now = time(NULL);
+			timeout = nextFileWrite > now ? (nextFileWrite - now) * 1000 : 0;
+		}
+		int ready = poll(pfd, descriptors, timeout);
+		if (ready < 0 && errno != EINTR) {
+			perror("WARNING: metrics socket");
+			return NULL;
+		}
+		if (ready > 0 && pfd[0].revents != 0) {
+			return NULL;
+		}
+		if (ready > 0 && pfd[1].revents != 0) {
+			int connection = accept(listener, NULL, NULL);
+			if (connection >= 0) {
+				sendMetrics(connection);
+				close(connection);
+			}
+		}
+		if (filePath != NULL && time(NULL) >= nextFileWrite) {
+			writeMetricsFile();
+			nextFileWrite = time(NULL) + METRICS_FILE_INTERVAL;
+		}
+	}
+	return NULL;
+}
+
+// setMetricsSocket serves the metrics on a Unix socket with the given path.
+void setMetricsSocket(const char * path) {
+	socketPath = path;
+}
+
+// setMetricsFile writes the metrics to the given file every few seconds.
+void setMetricsFile(const char * path) {
+	filePath = path;
+}
+
+// startMetricsExport opens the socket and starts the exporting thread.
+// Returns FALSE if that fails.
+int startMetricsExport() {
+	if (socketPath == NULL && filePath == NULL) {
+		return TRUE;
+	}
+
+	if (socketPath != NULL) {
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (strlen(socketPath) >= sizeof(address.sun_path)) {
+			fprintf(stderr, "ERROR: metrics socket path %s is too long\n", socketPath);
+			return FALSE;
+		}
+		strcpy(address.sun_path, socketPath);
+		unlink(socketPath);
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0
+				|| listen(listener, 8) < 0) {
+			perror("ERROR: opening metrics socket");
+			return FALSE;
+		}
+	}
+
+	if (pipe(stopPipe) != 0) {
+		perror("ERROR: creating the metrics thread's pipe");
+		return FALSE;
+	}
+	if (pthread_create(&exporter, NULL, serveMetrics, NULL) != 0) {
+		fprintf(stderr, "ERROR: can't start the metrics thread\n");
+		return FALSE;
+	}
+	exporting = TRUE;
+	return TRUE;
+}
+
+// closeMetrics writes the final values to the file and removes the socket.
+void closeMetrics() {
+	if (!exporting) {
+		return;
+	}
+	// The exporter finishes what it's doing, sees the pipe and returns.
+	if (write(stopPipe[1], "x", 1) == 1) {
+		pthread_join(exporter, NULL);
+	} else {
+		perror("WARNING: stopping the metrics thread");
+	}
+	close(stopPipe[0]);
+	close(stopPipe[1]);
+	if (listener >= 0) {
+		close(listener);
+		listener = -1;
+	}
+	if (filePath != NULL) {
+		writeMetricsFile();
+	}
+	if (socketPath != NULL) {
+		unlink(socketPath);
+	}
+}
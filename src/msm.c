@@ -0,0 +1,666 @@
+/*
+ * msm.c
+ *
+ * Bit-level rewriting of Multiple Signal Messages (MSM).
+ *
+ * An MSM has a header, which includes the satellite, signal and cell masks,
+ * then the satellite data and then the signal (cell) data.  The data is laid
+ * out field by field - all of the satellites' rough ranges, then all of their
+ * extended information and so on - and the fields that are present and their
+ * sizes depend on the MSM level:
+ *
+ *     satellite data           MSM4  MSM5  MSM6  MSM7
+ *         rough range (ms)        8     8     8     8
+ *         extended info           -     4     -     4
+ *         rough range mod 1ms    10    10    10    10
+ *         rough phase-range rate  -    14     -    14
+ *
+ *     signal data
+ *         fine pseudorange       15    15    20    20
+ *         fine phase-range       22    22    24    24
+ *         lock time indicator     4     4    10    10
+ *         half-cycle ambiguity    1     1     1     1
+ *         CNR                     6     6    10    10
+ *         fine phase-range rate   -    15     -    15
+ *
+ * The RTKLIB encoder (encode_msm4() etc) works from decoded observations,
+ * which lose the MSM structure and, since this build only enables GPS, any
+ * other constellation.  The messages are instead rewritten field by field.
+ *
+ * Two rewrites are done.  MSM5, MSM6 and MSM7 can be transcoded to the
+ * smaller MSM4, and chosen signals or satellites can be removed from the
+ * messages of any level.  Removing a signal clears its bit in the signal mask,
+ * removes its column from the cell mask and removes its cells from each of the
+ * signal data fields, and similarly for a satellite.  Satellites and signals
+ * that are left with no cells are removed as well.  If nothing is left, the
+ * message is dropped, unless it's the last message of an epoch (the sync bit
+ * is clear), in which case a message with no satellites is sent so that the
+ * rover still sees the end of the epoch.  The same empty message stands in
+ * for the last message of an epoch when a filter drops it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "rtcmfilter.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+
+// The number of satellites and the end of the header of the legacy GPS (1001
+// to 1004) and GLONASS (1009 to 1012) observation messages.
+#define GPS_SATELLITES_BIT 79
+#define GPS_HEADER_END_BIT 88
+#define GLONASS_SATELLITES_BIT 76
+#define GLONASS_HEADER_END_BIT 85
+
+// Start bit of the fields of the MSM header.
+#define MSM_SYNC_BIT 78
+#define MSM_HEADER_END_BIT 193		// With no satellites or signals.
+#define MSM_SATELLITE_MASK_BIT 97
+#define MSM_SIGNAL_MASK_BIT 161
+#define MSM_CELL_MASK_BIT 193
+
+#define MAX_MSM_CELLS 64
+
+// The MSM constellations, in order of message type (1071, 1081 ...).
+#define NUMBER_OF_MSM_SYSTEMS 7
+
+// The RINEX signal codes of the signal IDs (DF395), from rtcm3.c.
+extern const char *msm_sig_gps[32];
+extern const char *msm_sig_glo[32];
+extern const char *msm_sig_gal[32];
+extern const char *msm_sig_qzs[32];
+extern const char *msm_sig_sbs[32];
+extern const char *msm_sig_cmp[32];
+
+static const struct {
+	const char * name;
+	const char * letter;
+	const char ** signals;		// NULL if the signals have no codes.
+} msmSystems[NUMBER_OF_MSM_SYSTEMS] = {
+	{"gps", "G", msm_sig_gps},
+	{"glonass", "R", msm_sig_glo},
+	{"galileo", "E", msm_sig_gal},
+	{"sbas", "S", msm_sig_sbs},
+	{"qzss", "J", msm_sig_qzs},
+	{"beidou", "C", msm_sig_cmp},
+	{"navic", "I", NULL},
+};
+
+// The lengths of the satellite data fields and signal data fields of each
+// level of MSM, ending with 0.
+static const int satelliteFieldsOfLevel[8][5] = {
+	{0},
+	{10, 0}, {10, 0}, {10, 0},
+	{8, 10, 0}, {8, 4, 10, 14, 0}, {8, 10, 0}, {8, 4, 10, 14, 0}
+};
+static const int signalFieldsOfLevel[8][7] = {
+	{0},
+	{15, 0}, {22, 4, 1, 0}, {15, 22, 4, 1, 0},
+	{15, 22, 4, 1, 6, 0}, {15, 22, 4, 1, 6, 15, 0},
+	{20, 24, 10, 1, 10, 0}, {20, 24, 10, 1, 10, 15, 0}
+};
+
+// For each constellation, the signals to strip, in the same bit order as the
+// signal mask - the bit for signal ID 1 is the most significant.
+static uint32_t strippedSignals[NUMBER_OF_MSM_SYSTEMS];
+static int stripping = FALSE;
+
+// Statistics.
+static unsigned long int strippedSoFar = 0;
+static unsigned long int strippedDroppedSoFar = 0;
+static unsigned long long stripCellsInSoFar = 0;
+static unsigned long long stripCellsOutSoFar = 0;
+static unsigned long long strippedBytesInSoFar = 0;
+static unsigned long long strippedBytesOutSoFar = 0;
+static double stripSecondsTotal = 0.0;
+
+static int transcoding = FALSE;
+static unsigned long int transcodedSoFar = 0;
+static unsigned long long transcodedBytesInSoFar = 0;
+static unsigned long long transcodedBytesOutSoFar = 0;
+static double transcodeSecondsTotal = 0.0;
+static double transcodeSecondsMax = 0.0;
+
+// getMsmLevel returns the level (1-7) of an MSM type, or 0.
+int getMsmLevel(unsigned int type) {
+	return isMsmMessage(type) ? type % 10 : 0;
+}
+
+// The minimum lock time in milliseconds given by an extended lock time
+// indicator (DF407).
+static long extendedLockTime(unsigned int indicator) {
+	if (indicator < 64) {
+		return indicator;
+	}
+	if (indicator > 704) {
+		indicator = 704;
+	}
+	int k = (indicator - 64) / 32 + 1;
+	return ((long) (indicator - 32 * (k + 1)) << k) + (1L << (k + 5));
+}
+
+// The lock time indicator (DF402) for a lock time in milliseconds.
+static unsigned int lockIndicator(long milliseconds) {
+	unsigned int indicator = 0;
+	for (long limit = 32; milliseconds >= limit && indicator < 15; limit *= 2) {
+		indicator++;
+	}
+	return indicator;
+}
+
+// Reduce the resolution of a signed field by a number of bits, rounding to
+// the nearest and keeping the result clear of the invalid value, which is the
+// most negative value.
+static int reduceResolution(int value, int inLength, int outLength, int shift) {
+	if (value == -(1 << (inLength - 1))) {
+		return -(1 << (outLength - 1));
+	}
+	int result = (value + (1 << (shift - 1))) >> shift;
+	int limit = (1 << (outLength - 1)) - 1;
+	if (result > limit) {
+		result = limit;
+	} else if (result < -limit) {
+		result = -limit;
+	}
+	return result;
+}
+
+// getMsmCounts gets the number of satellites, signals and cells of an MSM.
+// Returns FALSE if the message is too short for its header.
+static int getMsmCounts(const unsigned char * message, size_t length,
+		int * satellites, int * signals, int * cells) {
+	MessageMetadata metadata;
+	if (!getMessageMetadata(message, length, &metadata) || !isMsmMessage(metadata.type)) {
+		return FALSE;
+	}
+	*satellites = metadata.satellites;
+	*signals = metadata.signals;
+	*cells = metadata.cells;
+	return TRUE;
+}
+
+// finishMsmMessage sets the length and CRC of a message that has been written up
+// to the given bit position, and returns its total length.
+size_t finishMsmMessage(unsigned char * output, int position) {
+	// Pad to a whole byte.
+	int padding = (8 - position % 8) % 8;
+	if (padding > 0) {
+		setbitu(output, position, padding, 0);
+		position += padding;
+	}
+	size_t messageLength = position / 8 - LENGTH_OF_HEADER;
+	setbitu(output, 0, 8, 0xd3);
+	setbitu(output, 8, 6, 0);
+	setbitu(output, 14, 10, messageLength);
+	unsigned int crc = rtk_crc24q(output, messageLength + LENGTH_OF_HEADER);
+	setbitu(output, (messageLength + LENGTH_OF_HEADER) * 8, 24, crc);
+	return messageLength + LENGTH_OF_HEADER + LENGTH_OF_CRC;
+}
+
+// makeEpochTerminator makes an observation message with the same header as
+// the given one (including the sync bit) but no satellites, to stand in for
+// it at the end of an epoch.  It returns the length of the new message, or 0
+// if the message is not an MSM or legacy observation message.  The output
+// buffer must hold MAX_RTCM_MESSAGE_LENGTH bytes.
+size_t makeEpochTerminator(const unsigned char * message, size_t length, unsigned char * output) {
+	unsigned int type = getbitu(message, 24, 12);
+	int end;
+	if (isMsmMessage(type)) {
+		end = MSM_HEADER_END_BIT;
+	} else if (type >= 1001 && type <= 1004) {
+		end = GPS_HEADER_END_BIT;
+	} else if (type >= 1009 && type <= 1012) {
+		end = GLONASS_HEADER_END_BIT;
+	} else {
+		return 0;
+	}
+	if ((size_t) end > (length - LENGTH_OF_CRC) * 8) {
+		return 0;
+	}
+
+	memcpy(output, message, (end + 7) / 8);
+	if (isMsmMessage(type)) {
+		// Empty satellite and signal masks, so no cell mask.
+		setbitu(output, MSM_SATELLITE_MASK_BIT, 32, 0);
+		setbitu(output, MSM_SATELLITE_MASK_BIT + 32, 32, 0);
+		setbitu(output, MSM_SIGNAL_MASK_BIT, 32, 0);
+	} else {
+		setbitu(output, end == GPS_HEADER_END_BIT ? GPS_SATELLITES_BIT : GLONASS_SATELLITES_BIT, 5, 0);
+	}
+	return finishMsmMessage(output, end);
+}
+
+// setEpochSync sets or clears the sync bit of an MSM or legacy observation
+// message in place, and its CRC to match.
+void setEpochSync(unsigned char * message, size_t length, int sync) {
+	unsigned int type = getbitu(message, 24, 12);
+	int bit;
+	if (isMsmMessage(type) || (type >= 1001 && type <= 1004)) {
+		bit = MSM_SYNC_BIT;		// The same place in the GPS legacy header.
+	} else if (type >= 1009 && type <= 1012) {
+		bit = GLONASS_SATELLITES_BIT - 1;
+	} else {
+		return;
+	}
+	setbitu(message, bit, 1, sync ? 1 : 0);
+	setbitu(message, (length - LENGTH_OF_CRC) * 8, 24, rtk_crc24q(message, length - LENGTH_OF_CRC));
+}
+
+// transcodeToMsm4 rewrites an MSM5, MSM6 or MSM7 message as an MSM4 message
+// with the same header (including the sync bit and IODS), satellites and
+// signals, and returns its length, or 0 if the message can't be transcoded.
+// The output buffer must hold MAX_RTCM_MESSAGE_LENGTH bytes.
+//
+// MSM5 to MSM4 is exact.  From MSM6 and MSM7 the fine pseudorange loses 5 bits
+// of resolution (to 2^-24 ms, about 1.8cm), the fine phase-range 2 bits (to
+// 2^-29 ms, about 0.6mm) and the CNR 4 bits (to 1 dB-Hz), and the lock time is
+// converted to the coarser indicator.  The GLONASS frequency channel numbers
+// in the extended satellite information of MSM5 and MSM7 are lost, so a rover
+// has to get them from the ephemeris (1020) or 1230.
+size_t transcodeToMsm4(const unsigned char * message, size_t length, unsigned char * output) {
+	unsigned int type = getbitu(message, 24, 12);
+	int level = getMsmLevel(type);
+	if (level < 5) {
+		return 0;
+	}
+
+	int satellites, signals, cells;
+	if (!getMsmCounts(message, length, &satellites, &signals, &cells)) {
+		return 0;
+	}
+
+	int extended = level == 5 || level == 7;	// Has extended info and rates.
+	int high = level >= 6;						// Has high resolution signal data.
+	int prLength = high ? 20 : 15;
+	int cpLength = high ? 24 : 22;
+	int lockLength = high ? 10 : 4;
+	int cnrLength = high ? 10 : 6;
+
+	int headerEnd = MSM_CELL_MASK_BIT + satellites * signals;
+	int satelliteBits = satellites * (extended ? 8 + 4 + 10 + 14 : 8 + 10);
+	int cellBits = cells * (prLength + cpLength + lockLength + 1 + cnrLength + (extended ? 15 : 0));
+	if ((size_t) (headerEnd + satelliteBits + cellBits) > (length - LENGTH_OF_CRC) * 8) {
+		return 0;
+	}
+
+	// The header is the same apart from the type.
+	memcpy(output, message, (headerEnd + 7) / 8);
+	setbitu(output, 24, 12, type - level + 4);
+
+	int in = headerEnd;
+	int out = headerEnd;
+	int i;
+
+	// Satellite data - rough range, then modulo 1 ms.
+	for (i = 0; i < satellites; i++, in += 8, out += 8) {
+		setbitu(output, out, 8, getbitu(message, in, 8));
+	}
+	if (extended) {
+		in += satellites * 4;
+	}
+	for (i = 0; i < satellites; i++, in += 10, out += 10) {
+		setbitu(output, out, 10, getbitu(message, in, 10));
+	}
+	if (extended) {
+		in += satellites * 14;
+	}
+
+	// Signal data.
+	for (i = 0; i < cells; i++, in += prLength, out += 15) {
+		int pr = getbits(message, in, prLength);
+		setbits(output, out, 15, high ? reduceResolution(pr, 20, 15, 5) : pr);
+	}
+	for (i = 0; i < cells; i++, in += cpLength, out += 22) {
+		int cp = getbits(message, in, cpLength);
+		setbits(output, out, 22, high ? reduceResolution(cp, 24, 22, 2) : cp);
+	}
+	for (i = 0; i < cells; i++, in += lockLength, out += 4) {
+		unsigned int lock = getbitu(message, in, lockLength);
+		setbitu(output, out, 4, high ? lockIndicator(extendedLockTime(lock)) : lock);
+	}
+	for (i = 0; i < cells; i++, in += 1, out += 1) {
+		setbitu(output, out, 1, getbitu(message, in, 1));
+	}
+	for (i = 0; i < cells; i++, in += cnrLength, out += 6) {
+		unsigned int cnr = getbitu(message, in, cnrLength);
+		setbitu(output, out, 6, high ? (cnr + 8) >> 4 > 63 ? 63 : (cnr + 8) >> 4 : cnr);
+	}
+
+	return finishMsmMessage(output, out);
+}
+
+void setMsmTranscoding() {
+	transcoding = TRUE;
+}
+
+// transcodeMessage transcodes an MSM5, MSM6 or MSM7 message to MSM4 if
+// transcoding is turned on.  It returns the length of the MSM4 message in the
+// output buffer, or 0 if the original message should be sent.
+size_t transcodeMessage(const unsigned char * message, size_t length, unsigned char * output) {
+	if (!transcoding || getMsmLevel(getbitu(message, 24, 12)) < 5) {
+		return 0;
+	}
+
+	struct timespec start, finish;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t outputLength = transcodeToMsm4(message, length, output);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+
+	if (outputLength > 0) {
+		double seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+		transcodeSecondsTotal += seconds;
+		if (seconds > transcodeSecondsMax) {
+			transcodeSecondsMax = seconds;
+		}
+		transcodedSoFar++;
+		transcodedBytesInSoFar += length;
+		transcodedBytesOutSoFar += outputLength;
+	}
+	return outputLength;
+}
+
+static int findMsmSystem(const char * name) {
+	for (int system = 0; system < NUMBER_OF_MSM_SYSTEMS; system++) {
+		if (strcasecmp(name, msmSystems[system].name) == 0
+				|| strcasecmp(name, msmSystems[system].letter) == 0) {
+			return system;
+		}
+	}
+	return -1;
+}
+
+// parseSignal converts a signal to a mask of signal IDs.  The signal is a
+// RINEX code such as "5Q", a band such as "L5" (all of the signals whose codes
+// start with 5), "all", or a signal ID 1-32.  Returns 0 if it's not valid.
+static uint32_t parseSignal(int system, const char * signal) {
+	const char ** codes = msmSystems[system].signals;
+	uint32_t mask = 0;
+
+	if (strcasecmp(signal, "all") == 0) {
+		return 0xffffffff;
+	}
+
+	char * end;
+	long id = strtol(signal, &end, 10);
+	if (end != signal && *end == '\0') {
+		return id >= 1 && id <= 32 ? (uint32_t) 1 << (32 - id) : 0;
+	}
+
+	if (codes == NULL) {
+		return 0;
+	}
+	int band = (signal[0] == 'L' || signal[0] == 'l') && signal[1] != '\0' && signal[2] == '\0';
+	for (id = 1; id <= 32; id++) {
+		const char * code = codes[id - 1];
+		if (code[0] == '\0') {
+			continue;
+		}
+		if (band ? code[0] == signal[1] : strcasecmp(code, signal) == 0) {
+			mask |= (uint32_t) 1 << (32 - id);
+		}
+	}
+	return mask;
+}
+
+// addSignalStripping adds signals to be stripped from the MSM messages.  The
+// argument is "<constellation>:<signal>,<signal>...", for example "gps:L5" or
+// "galileo:7I,7Q,7X".  Returns FALSE if the argument is not valid.
+int addSignalStripping(const char * argument) {
+	const char * colon = strchr(argument, ':');
+	if (colon == NULL || colon == argument || colon[1] == '\0') {
+		fprintf(stderr, "ERROR: signals <%s> should be <constellation>:<signal>,<signal>...\n", argument);
+		return FALSE;
+	}
+
+	char name[colon - argument + 1];
+	memcpy(name, argument, colon - argument);
+	name[colon - argument] = '\0';
+	int system = findMsmSystem(name);
+	if (system < 0) {
+		fprintf(stderr, "ERROR: unknown constellation <%s>\n", name);
+		return FALSE;
+	}
+
+	char list[strlen(colon + 1) + 1];
+	strcpy(list, colon + 1);
+	char * saved;
+	for (char * signal = strtok_r(list, ",", &saved); signal != NULL; signal = strtok_r(NULL, ",", &saved)) {
+		uint32_t mask = parseSignal(system, signal);
+		if (mask == 0) {
+			fprintf(stderr, "ERROR: unknown %s signal <%s>\n", msmSystems[system].name, signal);
+			return FALSE;
+		}
+		strippedSignals[system] |= mask;
+	}
+	stripping = TRUE;
+	return TRUE;
+}
+
+// signalStripped returns TRUE if the signal with the given RTKLIB code is
+// stripped from the MSMs of the constellation (SYS_GPS etc).
+int signalStripped(int system, unsigned char code) {
+	if (!stripping || code == CODE_NONE) {
+		return FALSE;
+	}
+	for (int s = 0; s < NUMBER_OF_MSM_SYSTEMS; s++) {
+		if (getMsmSystem(1071 + s * 10) != system || msmSystems[s].signals == NULL) {
+			continue;
+		}
+		const char * obs = code2obs(code, NULL);
+		for (int id = 1; id <= 32; id++) {
+			if ((strippedSignals[s] & (uint32_t) 1 << (32 - id)) != 0
+					&& strcmp(msmSystems[s].signals[id - 1], obs) == 0) {
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
+
+// rewriteMsm rewrites an MSM message without the given satellites and signals
+// (masks in the same bit order as the satellite and signal masks).  Satellites
+// and signals that are left with no cells are removed as well.  It returns the
+// length of the new message, 0 if the message has none of the satellites or
+// signals or can't be rewritten, or -1 if nothing is left and the message
+// should be dropped.  The output buffer must hold MAX_RTCM_MESSAGE_LENGTH bytes.
+static long rewriteMsm(const unsigned char * message, size_t length, uint64_t removedSatellites,
+		uint32_t removedSignals, unsigned char * output) {
+	int level = getMsmLevel(getbitu(message, 24, 12));
+	if (level == 0) {
+		return 0;
+	}
+	uint64_t satelliteMask = (uint64_t) getbitu(message, MSM_SATELLITE_MASK_BIT, 32) << 32
+			| getbitu(message, MSM_SATELLITE_MASK_BIT + 32, 32);
+	uint32_t signalMask = getbitu(message, MSM_SIGNAL_MASK_BIT, 32);
+	if ((satelliteMask & removedSatellites) == 0 && (signalMask & removedSignals) == 0) {
+		return 0;
+	}
+
+	int satellites, signals, cells;
+	if (!getMsmCounts(message, length, &satellites, &signals, &cells)) {
+		return 0;
+	}
+	if (satellites * signals > MAX_MSM_CELLS) {
+		return 0;
+	}
+
+	int headerEnd = MSM_CELL_MASK_BIT + satellites * signals;
+	int bits = headerEnd;
+	for (const int * field = satelliteFieldsOfLevel[level]; *field > 0; field++) {
+		bits += satellites * *field;
+	}
+	for (const int * field = signalFieldsOfLevel[level]; *field > 0; field++) {
+		bits += cells * *field;
+	}
+	if ((size_t) bits > (length - LENGTH_OF_CRC) * 8) {
+		return 0;
+	}
+
+	// The satellite and signal IDs of the message's satellites and signals.
+	uint64_t satelliteBit[64];
+	uint32_t signalBit[32];
+	for (int bit = 0, s = 0; bit < 64; bit++) {
+		if (satelliteMask & (uint64_t) 1 << (63 - bit)) {
+			satelliteBit[s++] = (uint64_t) 1 << (63 - bit);
+		}
+	}
+	for (int bit = 0, g = 0; bit < 32; bit++) {
+		if (signalMask & (uint32_t) 1 << (31 - bit)) {
+			signalBit[g++] = (uint32_t) 1 << (31 - bit);
+		}
+	}
+
+	// Which cells are kept, and so which satellites and signals.
+	int keepCell[MAX_MSM_CELLS];
+	int keepSatellite[64] = {0};
+	int keepSignal[32] = {0};
+	int cellsKept = 0;
+	for (int s = 0, c = 0; s < satellites; s++) {
+		for (int g = 0; g < signals; g++) {
+			if (getbitu(message, MSM_CELL_MASK_BIT + s * signals + g, 1)) {
+				keepCell[c] = (satelliteBit[s] & removedSatellites) == 0 && (signalBit[g] & removedSignals) == 0;
+				if (keepCell[c]) {
+					keepSatellite[s] = TRUE;
+					keepSignal[g] = TRUE;
+					cellsKept++;
+				}
+				c++;
+			}
+		}
+	}
+	if (cellsKept == 0 && getbitu(message, MSM_SYNC_BIT, 1)) {
+		return -1;
+	}
+
+	// The header up to the satellite mask is unchanged.
+	memcpy(output, message, (MSM_SATELLITE_MASK_BIT + 7) / 8);
+
+	uint64_t newSatelliteMask = 0;
+	uint32_t newSignalMask = 0;
+	for (int s = 0; s < satellites; s++) {
+		newSatelliteMask |= keepSatellite[s] ? satelliteBit[s] : 0;
+	}
+	for (int g = 0; g < signals; g++) {
+		newSignalMask |= keepSignal[g] ? signalBit[g] : 0;
+	}
+	int out = MSM_SATELLITE_MASK_BIT;
+	setbitu(output, out, 32, (uint32_t) (newSatelliteMask >> 32));
+	setbitu(output, out + 32, 32, (uint32_t) newSatelliteMask);
+	setbitu(output, out + 64, 32, newSignalMask);
+	out += 96;
+	for (int s = 0; s < satellites; s++) {
+		if (keepSatellite[s]) {
+			for (int g = 0; g < signals; g++) {
+				if (keepSignal[g]) {
+					setbitu(output, out++, 1, getbitu(message, MSM_CELL_MASK_BIT + s * signals + g, 1));
+				}
+			}
+		}
+	}
+
+	// The data, field by field.
+	int in = headerEnd;
+	for (const int * field = satelliteFieldsOfLevel[level]; *field > 0; field++) {
+		for (int s = 0; s < satellites; s++, in += *field) {
+			if (keepSatellite[s]) {
+				setbitu(output, out, *field, getbitu(message, in, *field));
+				out += *field;
+			}
+		}
+	}
+	for (const int * field = signalFieldsOfLevel[level]; *field > 0; field++) {
+		for (int c = 0; c < cells; c++, in += *field) {
+			if (keepCell[c]) {
+				setbitu(output, out, *field, getbitu(message, in, *field));
+				out += *field;
+			}
+		}
+	}
+
+	return finishMsmMessage(output, out);
+}
+
+// stripMsmSignals rewrites an MSM message without the given signals.  The
+// result is as for rewriteMsm().
+long stripMsmSignals(const unsigned char * message, size_t length, uint32_t signals,
+		unsigned char * output) {
+	return rewriteMsm(message, length, 0, signals, output);
+}
+
+// removeMsmSatellites rewrites an MSM message without the given satellites (a
+// mask in the same bit order as the satellite mask - the bit for satellite ID
+// 1 is the most significant).  The result is as for rewriteMsm().
+long removeMsmSatellites(const unsigned char * message, size_t length, uint64_t satellites,
+		unsigned char * output) {
+	return rewriteMsm(message, length, satellites, 0, output);
+}
+
+// stripMessage strips the configured signals from an MSM message.  It returns
+// FALSE if the message should be dropped.  Otherwise the length of the
+// rewritten message in the output buffer is set, or 0 if the original message
+// should be sent.
+int stripMessage(const unsigned char * message, size_t length, unsigned char * output,
+		size_t * outputLength) {
+	*outputLength = 0;
+	if (!stripping) {
+		return TRUE;
+	}
+	unsigned int type = getbitu(message, 24, 12);
+	if (!isMsmMessage(type) || type / 10 < 107 || type / 10 >= 107 + NUMBER_OF_MSM_SYSTEMS) {
+		return TRUE;
+	}
+	uint32_t signals = strippedSignals[type / 10 - 107];
+	if (signals == 0) {
+		return TRUE;
+	}
+
+	struct timespec start, finish;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	long result = stripMsmSignals(message, length, signals, output);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	if (result == 0) {
+		return TRUE;
+	}
+
+	MessageMetadata before;
+	getMessageMetadata(message, length, &before);
+	stripSecondsTotal += (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+	stripCellsInSoFar += before.cells;
+	strippedSoFar++;
+	strippedBytesInSoFar += length;
+	if (result < 0) {
+		strippedDroppedSoFar++;
+		return FALSE;
+	}
+	MessageMetadata after;
+	getMessageMetadata(output, result, &after);
+	stripCellsOutSoFar += after.cells;
+	strippedBytesOutSoFar += result;
+	*outputLength = result;
+	return TRUE;
+}
+
+void displayStripTotals() {
+	if (strippedSoFar == 0) {
+		return;
+	}
+	fprintf(stderr, "signal stripping: %ld messages rewritten (%ld dropped), %lld cells in, %lld cells out, %lld bytes saved, mean %.0f ns per cell\n",
+			strippedSoFar, strippedDroppedSoFar, stripCellsInSoFar, stripCellsOutSoFar,
+			strippedBytesInSoFar - strippedBytesOutSoFar,
+			stripCellsInSoFar > 0 ? stripSecondsTotal / stripCellsInSoFar * 1e9 : 0.0);
+}
+
+void displayTranscodeTotals() {
+	if (transcodedSoFar == 0) {
+		return;
+	}
+	fprintf(stderr, "transcoding: %ld messages to MSM4, %lld bytes in, %lld bytes out, %lld bytes saved, mean %.1f us max %.1f us\n",
+			transcodedSoFar, transcodedBytesInSoFar, transcodedBytesOutSoFar,
+			transcodedBytesInSoFar - transcodedBytesOutSoFar,
+			transcodeSecondsTotal / transcodedSoFar * 1e6, transcodeSecondsMax * 1e6);
+}
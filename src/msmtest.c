@@ -0,0 +1,335 @@
+/*
+ * msmtest.c
+ *
+ * Round trip tests of the MSM rewriting in msm.c - transcoding to MSM4 and
+ * stripping signals.
+ *
+ * For each of MSM5, MSM6 and MSM7, generates epochs of GPS observations with
+ * random ranges, signal strengths and lock times, encodes them with the RTKLIB
+ * encoder, transcodes the message to MSM4 and decodes both messages with the
+ * RTKLIB decoder.  The decoded observations must agree within the resolution
+ * of MSM4.  The decoded MSM4 is also compared with an MSM4 encoded directly
+ * from the same observations.  The time taken to transcode each message is
+ * measured.
+ *
+ * For each of MSM4 to MSM7, generates epochs of GPS observations on L1, L2
+ * and L5 and strips out the L5 signal.  The decoded L1 and L2 observations
+ * must be exactly the same as the original and the L5 observations must be
+ * gone.  The cost of the rewrite per cell of the original message is
+ * measured.
+ *
+ *     make msmtest && ./msmtest [epochs]
+ *
+ * The exit status is 0 if all of the observations are within tolerance.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtcmfilter.h"
+
+#define SATELLITES 12
+#define L5Q_SIGNAL_ID 23
+
+// The resolution of MSM4 is 2^-24 ms in pseudorange, 2^-29 ms in phase range
+// and 1 dB-Hz in CNR.  Rounding from the higher resolution loses up to half of
+// that, plus half of the original resolution.  An MSM4 encoded directly from
+// the observations is rounded once rather than twice, so it can differ from
+// the transcoded one by a whole step.
+#define PSEUDORANGE_STEP (CLIGHT * 1e-3 / (1 << 24))
+#define PHASE_RANGE_STEP (CLIGHT * 1e-3 / (1 << 29))
+#define SNR_STEP 1.0
+#define TOLERANCE_AGAINST_ORIGINAL 0.55		// steps
+#define TOLERANCE_AGAINST_DIRECT 1.05		// steps
+
+int verboseMode = 0;
+
+typedef struct differences {
+	double pseudorange;			// metres
+	double phase;				// metres
+	double snr;					// dB-Hz
+} Differences;
+
+static Differences worstAgainstOriginal;
+static Differences worstAgainstDirect;
+static long failures = 0;
+
+static double randomBetween(double low, double high) {
+	return low + (high - low) * rand() / (double) RAND_MAX;
+}
+
+// decode runs a message through a decoder and returns the decoded observations.
+static obs_t * decode(rtcm_t * rtcm, const unsigned char * message, size_t length, gtime_t time) {
+	rtcm->time = time;
+	for (size_t i = 0; i < length; i++) {
+		input_rtcm3(rtcm, message[i]);
+	}
+	return &rtcm->obs;
+}
+
+// compare checks one set of decoded observations against another, allowing
+// differences of the given number of MSM4 steps.
+static void compare(const obs_t * expected, const obs_t * actual, double tolerance,
+		Differences * worst, const char * what) {
+	if (expected->n != actual->n) {
+		fprintf(stderr, "%s: %d satellites, expected %d\n", what, actual->n, expected->n);
+		failures++;
+		return;
+	}
+	for (int s = 0; s < expected->n; s++) {
+		const obsd_t * e = expected->data + s;
+		const obsd_t * a = actual->data + s;
+		for (int f = 0; f < NFREQ; f++) {
+			double lambda = f == 0 ? CLIGHT / FREQ1 : CLIGHT / FREQ2;
+			double dp = fabs(e->P[f] - a->P[f]);
+			double dl = fabs(e->L[f] - a->L[f]) * lambda;
+			double ds = abs(e->SNR[f] - a->SNR[f]) * 0.25;
+			if (dp > worst->pseudorange) worst->pseudorange = dp;
+			if (dl > worst->phase) worst->phase = dl;
+			if (ds > worst->snr) worst->snr = ds;
+			if (dp > tolerance * PSEUDORANGE_STEP || dl > tolerance * PHASE_RANGE_STEP
+					|| ds > tolerance * SNR_STEP
+					|| (e->P[f] == 0.0) != (a->P[f] == 0.0) || (e->L[f] == 0.0) != (a->L[f] == 0.0)) {
+				if (failures++ < 10) {
+					fprintf(stderr, "%s: sat %d freq %d dP %.4f m dL %.5f m dSNR %.2f\n",
+							what, e->sat, f, dp, dl, ds);
+				}
+			}
+		}
+	}
+}
+
+// generateEpoch fills the encoder with observations of the satellites on L1
+// and L2, and optionally L5.
+static void generateEpoch(rtcm_t * encoder, double * ranges, gtime_t time, int withL5) {
+	encoder->time = time;
+	encoder->obs.n = 0;
+	for (int s = 0; s < SATELLITES; s++) {
+		obsd_t * d = encoder->obs.data + encoder->obs.n++;
+		memset(d, 0, sizeof(obsd_t));
+		d->time = encoder->time;
+		d->sat = satno(SYS_GPS, s * 2 + 1);
+		ranges[s] += randomBetween(-800.0, 800.0);
+		d->P[0] = ranges[s];
+		d->L[0] = (ranges[s] + randomBetween(-5.0, 5.0)) / (CLIGHT / FREQ1);
+		d->D[0] = randomBetween(-4000.0, 4000.0);
+		d->SNR[0] = (unsigned char) randomBetween(120.0, 220.0);
+		d->LLI[0] = rand() % 50 == 0;
+		d->code[0] = CODE_L1C;
+		d->P[1] = ranges[s] + randomBetween(-10.0, 10.0);
+		d->L[1] = (ranges[s] + randomBetween(-5.0, 5.0)) / (CLIGHT / FREQ2);
+		d->D[1] = randomBetween(-3000.0, 3000.0);
+		d->SNR[1] = (unsigned char) randomBetween(100.0, 200.0);
+		d->code[1] = CODE_L2W;
+		if (withL5) {
+			d->P[2] = ranges[s] + randomBetween(-10.0, 10.0);
+			d->L[2] = (ranges[s] + randomBetween(-5.0, 5.0)) / (CLIGHT / FREQ5);
+			d->D[2] = randomBetween(-3000.0, 3000.0);
+			d->SNR[2] = (unsigned char) randomBetween(100.0, 200.0);
+			d->code[2] = CODE_L5Q;
+		}
+	}
+}
+
+static int test(int level, int epochs) {
+	rtcm_t * encoder = calloc(1, sizeof(rtcm_t));
+	rtcm_t * highDecoder = calloc(1, sizeof(rtcm_t));
+	rtcm_t * transcodedDecoder = calloc(1, sizeof(rtcm_t));
+	rtcm_t * directDecoder = calloc(1, sizeof(rtcm_t));
+	init_rtcm(encoder);
+	init_rtcm(highDecoder);
+	init_rtcm(transcodedDecoder);
+	init_rtcm(directDecoder);
+
+	double ranges[SATELLITES];
+	for (int s = 0; s < SATELLITES; s++) {
+		ranges[s] = randomBetween(2.0e7, 2.6e7);
+	}
+
+	unsigned char high[MAX_RTCM_MESSAGE_LENGTH];
+	unsigned char transcoded[MAX_RTCM_MESSAGE_LENGTH];
+	size_t bytesIn = 0, bytesOut = 0;
+	double seconds = 0.0, worstSeconds = 0.0;
+	long failuresBefore = failures;
+
+	gtime_t start = epoch2time((double[]) {2019, 8, 21, 12, 0, 0});
+	for (int e = 0; e < epochs; e++) {
+		generateEpoch(encoder, ranges, timeadd(start, e), FALSE);
+
+		// The encoder keeps the lock times, so encode the high resolution
+		// message first and then the MSM4 for the same epoch.
+		if (!gen_rtcm3(encoder, 1070 + level, 0)) {
+			fprintf(stderr, "can't encode MSM%d\n", level);
+			return FALSE;
+		}
+		size_t highLength = encoder->nbyte;
+		memcpy(high, encoder->buff, highLength);
+
+		struct timespec before, after;
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		size_t transcodedLength = transcodeToMsm4(high, highLength, transcoded);
+		clock_gettime(CLOCK_MONOTONIC, &after);
+		double s = (after.tv_sec - before.tv_sec) + (after.tv_nsec - before.tv_nsec) / 1e9;
+		seconds += s;
+		if (s > worstSeconds) worstSeconds = s;
+
+		if (transcodedLength == 0) {
+			fprintf(stderr, "MSM%d epoch %d: can't transcode\n", level, e);
+			failures++;
+			continue;
+		}
+		if (getbitu(transcoded, 24, 12) != 1074
+				|| rtk_crc24q(transcoded, transcodedLength - 3) != getbitu(transcoded, (transcodedLength - 3) * 8, 24)) {
+			fprintf(stderr, "MSM%d epoch %d: bad type or CRC\n", level, e);
+			failures++;
+			continue;
+		}
+		bytesIn += highLength;
+		bytesOut += transcodedLength;
+
+		obs_t * highObs = decode(highDecoder, high, highLength, encoder->time);
+		obs_t * transcodedObs = decode(transcodedDecoder, transcoded, transcodedLength, encoder->time);
+		compare(highObs, transcodedObs, TOLERANCE_AGAINST_ORIGINAL, &worstAgainstOriginal,
+				"transcoded against original");
+
+		if (gen_rtcm3(encoder, 1074, 0)) {
+			obs_t * directObs = decode(directDecoder, encoder->buff, encoder->nbyte, encoder->time);
+			compare(directObs, transcodedObs, TOLERANCE_AGAINST_DIRECT, &worstAgainstDirect,
+					"transcoded against direct MSM4");
+		}
+	}
+
+	printf("MSM%d to MSM4: %d messages, %ld bytes in, %ld bytes out (%.0f%% saved), "
+			"transcode mean %.2f us max %.2f us: %s\n",
+			level, epochs, bytesIn, bytesOut, 100.0 * (bytesIn - bytesOut) / bytesIn,
+			seconds / epochs * 1e6, worstSeconds * 1e6,
+			failures == failuresBefore ? "PASS" : "FAIL");
+
+	free_rtcm(encoder);
+	free_rtcm(highDecoder);
+	free_rtcm(transcodedDecoder);
+	free_rtcm(directDecoder);
+	free(encoder);
+	free(highDecoder);
+	free(transcodedDecoder);
+	free(directDecoder);
+	return TRUE;
+}
+
+// testStripping strips L5 from MSMs of the given level.
+static int testStripping(int level, int epochs) {
+	rtcm_t * encoder = calloc(1, sizeof(rtcm_t));
+	rtcm_t * originalDecoder = calloc(1, sizeof(rtcm_t));
+	rtcm_t * strippedDecoder = calloc(1, sizeof(rtcm_t));
+	init_rtcm(encoder);
+	init_rtcm(originalDecoder);
+	init_rtcm(strippedDecoder);
+
+	double ranges[SATELLITES];
+	for (int s = 0; s < SATELLITES; s++) {
+		ranges[s] = randomBetween(2.0e7, 2.6e7);
+	}
+
+	unsigned char stripped[MAX_RTCM_MESSAGE_LENGTH];
+	uint32_t l5 = 1 << (32 - L5Q_SIGNAL_ID);
+	size_t bytesIn = 0, bytesOut = 0;
+	unsigned long cellsIn = 0, cellsOut = 0;
+	double seconds = 0.0;
+	long failuresBefore = failures;
+
+	gtime_t start = epoch2time((double[]) {2019, 8, 21, 12, 0, 0});
+	for (int e = 0; e < epochs; e++) {
+		generateEpoch(encoder, ranges, timeadd(start, e), TRUE);
+		if (!gen_rtcm3(encoder, 1070 + level, 0)) {
+			fprintf(stderr, "can't encode MSM%d\n", level);
+			return FALSE;
+		}
+
+		struct timespec before, after;
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		long strippedLength = stripMsmSignals(encoder->buff, encoder->nbyte, l5, stripped);
+		clock_gettime(CLOCK_MONOTONIC, &after);
+		seconds += (after.tv_sec - before.tv_sec) + (after.tv_nsec - before.tv_nsec) / 1e9;
+
+		MessageMetadata original, result;
+		if (strippedLength <= 0 || !getMessageMetadata(stripped, strippedLength, &result)
+				|| rtk_crc24q(stripped, strippedLength - 3) != getbitu(stripped, (strippedLength - 3) * 8, 24)) {
+			fprintf(stderr, "MSM%d epoch %d: can't strip L5\n", level, e);
+			failures++;
+			continue;
+		}
+		getMessageMetadata(encoder->buff, encoder->nbyte, &original);
+		bytesIn += encoder->nbyte;
+		bytesOut += strippedLength;
+		cellsIn += original.cells;
+		cellsOut += result.cells;
+
+		obs_t * originalObs = decode(originalDecoder, encoder->buff, encoder->nbyte, encoder->time);
+		obs_t * strippedObs = decode(strippedDecoder, stripped, strippedLength, encoder->time);
+		if (originalObs->n != strippedObs->n || result.signals != 2 || result.cells != 2 * original.satellites) {
+			fprintf(stderr, "MSM%d epoch %d: %d satellites %d signals %d cells, expected %d satellites 2 signals\n",
+					level, e, strippedObs->n, result.signals, result.cells, originalObs->n);
+			failures++;
+			continue;
+		}
+		for (int s = 0; s < originalObs->n; s++) {
+			const obsd_t * o = originalObs->data + s;
+			const obsd_t * d = strippedObs->data + s;
+			if (o->P[0] != d->P[0] || o->L[0] != d->L[0] || o->SNR[0] != d->SNR[0]
+					|| o->P[1] != d->P[1] || o->L[1] != d->L[1] || o->SNR[1] != d->SNR[1]
+					|| d->P[2] != 0.0 || d->L[2] != 0.0) {
+				if (failures++ < 10) {
+					fprintf(stderr, "MSM%d epoch %d: sat %d observations changed\n", level, e, o->sat);
+				}
+			}
+		}
+	}
+
+	// Stripping every signal drops the message, unless it ends the epoch.
+	unsigned char empty[MAX_RTCM_MESSAGE_LENGTH];
+	MessageMetadata metadata;
+	if (gen_rtcm3(encoder, 1070 + level, 1) && stripMsmSignals(encoder->buff, encoder->nbyte, 0xffffffff, empty) != -1) {
+		fprintf(stderr, "MSM%d: message with no signals left not dropped\n", level);
+		failures++;
+	}
+	long emptyLength;
+	if (!gen_rtcm3(encoder, 1070 + level, 0)
+			|| (emptyLength = stripMsmSignals(encoder->buff, encoder->nbyte, 0xffffffff, empty)) <= 0
+			|| !getMessageMetadata(empty, emptyLength, &metadata) || metadata.satellites != 0 || metadata.sync) {
+		fprintf(stderr, "MSM%d: last message of the epoch with no signals left not kept\n", level);
+		failures++;
+	}
+
+	printf("MSM%d strip L5: %d messages, %ld cells in, %ld cells out, %ld bytes in, %ld bytes out, "
+			"rewrite mean %.0f ns per cell: %s\n",
+			level, epochs, cellsIn, cellsOut, bytesIn, bytesOut, cellsIn > 0 ? seconds / cellsIn * 1e9 : 0.0,
+			failures == failuresBefore ? "PASS" : "FAIL");
+
+	free_rtcm(encoder);
+	free_rtcm(originalDecoder);
+	free_rtcm(strippedDecoder);
+	free(encoder);
+	free(originalDecoder);
+	free(strippedDecoder);
+	return TRUE;
+}
+
+int main(int argc, char ** argv) {
+	int epochs = argc > 1 ? atoi(argv[1]) : 1000;
+
+	srand(1);
+	for (int level = 5; level <= 7; level++) {
+		test(level, epochs);
+	}
+	for (int level = 4; level <= 7; level++) {
+		testStripping(level, epochs);
+	}
+	printf("worst differences from the original: pseudorange %.4f m, phase range %.5f m, SNR %.2f dB-Hz\n",
+			worstAgainstOriginal.pseudorange, worstAgainstOriginal.phase, worstAgainstOriginal.snr);
+	printf("worst differences from direct MSM4: pseudorange %.4f m, phase range %.5f m, SNR %.2f dB-Hz\n",
+			worstAgainstDirect.pseudorange, worstAgainstDirect.phase, worstAgainstDirect.snr);
+	return failures == 0 ? 0 : 1;
+}
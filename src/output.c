@@ -0,0 +1,420 @@
+/*
+ * output.c
+ *
+ * Writes the RTCM messages that the filter passes to stdout.
+ *
+ * By default the messages that getRtcmFrames() finds in each buffer are
+ * written as they come, with a single writev() of the list, straight from
+ * the buffer they were read into.
+ *
+ * In epoch batching mode the messages are held until an epoch is complete and
+ * then the whole epoch is sent with one write.  A receiver sends the MSM
+ * messages of an epoch one constellation after another and the multiple
+ * message bit (sync) is clear in the last of them, so the batch is flushed
+ * when an observation message (MSM or legacy) with the sync bit clear
+ * arrives.  Any other messages (station information, ephemerides) that arrive
+ * in the meantime go out with the epoch.  In case the last message of an
+ * epoch is lost, the batch is also flushed when an observation message of a
+ * different epoch arrives, or when it has been held for longer than a short
+ * deadline.
+ *
+ * Sending each epoch as one burst reduces the per-packet overhead on the
+ * uplink, and the rover gets the complete epoch sooner.  The time from the
+ * arrival of the first message of an epoch to the write is recorded as the
+ * epoch assembly latency.
+ *
+ * If the output is rate limited (see shaper.c), the messages pass through
+ * the token bucket on their way out, which may hold some of them back.  The
+ * caller must call serviceOutput() when getOutputTimeout() runs out, so that
+ * they are sent when the tokens allow.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rtcmfilter.h"
+#include "probes.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+
+// Why a batch is flushed.
+#define FLUSH_ON_SYNC 0
+#define FLUSH_ON_NEW_EPOCH 1
+#define FLUSH_ON_DEADLINE 2
+
+static int outputFile = STDOUT_FILENO;
+static int batching = FALSE;
+static long deadlineMilliseconds = DEFAULT_EPOCH_DEADLINE;
+
+// The batch of messages waiting to be sent, with the read time of each one if
+// latency is being measured.
+static Buffer * batch = NULL;
+static size_t batchLength = 0;
+static struct timespec batchStarted;
+static int batchHasEpoch = FALSE;		// TRUE once it holds observations.
+static uint32_t batchEpoch;
+static struct timespec * batchReadTimes = NULL;
+static int batchCount = 0;
+static int batchReadTimesCapacity = 0;
+
+// Messages released by the rate limiter, waiting to be written.
+static unsigned char * shaped = NULL;
+static size_t shapedLength = 0;
+static struct timespec * shapedReadTimes = NULL;
+static int shapedCount = 0;
+
+// Statistics.
+static unsigned long int outputWritesSoFar = 0;
+static unsigned long long outputBytesSoFar = 0;
+static unsigned long int epochsFlushedOnSync = 0;
+static unsigned long int epochsFlushedOnNewEpoch = 0;
+static unsigned long int epochsFlushedOnDeadline = 0;
+static double epochLatencyTotal = 0.0;
+static double epochLatencyMax = 0.0;
+
+static double millisecondsSince(const struct timespec * start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// writeAll writes the whole of a buffer, retrying after short writes.  The
+// read times of the messages in it may be NULL.
+static void writeAll(const unsigned char * data, size_t length, const struct timespec * readTimes) {
+	const unsigned char * messages = data;
+	size_t messagesLength = length;
+	ENTER_STAGE(STAGE_OUTPUT);
+	if (stageCosting) {
+		countStage(STAGE_OUTPUT, countFramesWritten(data, length), length);
+	}
+	outputWritesSoFar++;
+	outputBytesSoFar += length;
+	while (length > 0) {
+		ssize_t n = write(outputFile, data, length);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("WARNING: writing output");
+			ENTER_STAGE(STAGE_NONE);
+			return;
+		}
+		data += n;
+		length -= n;
+	}
+	ENTER_STAGE(STAGE_NONE);
+	PROBE_OUTPUT_WRITTEN(messagesLength);
+	recordWrite(messagesLength);
+	latencyWritten(messages, messagesLength, readTimes);
+}
+
+// writeAllFrames writes the whole of a frame list with writev(), retrying
+// after short writes.
+static void writeAllFrames(FrameList * list) {
+	struct iovec * frames = list->frames;
+	int count = list->count;
+	size_t length = list->length;
+	ENTER_STAGE(STAGE_OUTPUT);
+	if (stageCosting) {
+		unsigned long written = 0;
+		for (int f = 0; f < count; f++) {
+			written += countFramesWritten(frames[f].iov_base, frames[f].iov_len);
+		}
+		countStage(STAGE_OUTPUT, written, length);
+	}
+	outputWritesSoFar++;
+	outputBytesSoFar += length;
+	int first = 0;
+	size_t offset = 0;		// Bytes of the first entry already written.
+	while (first < count) {
+		struct iovec whole = frames[first];
+		frames[first].iov_base = (unsigned char *) whole.iov_base + offset;
+		frames[first].iov_len = whole.iov_len - offset;
+		ssize_t n = writev(outputFile, frames + first, count - first < IOV_MAX ? count - first : IOV_MAX);
+		frames[first] = whole;
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("WARNING: writing output");
+			ENTER_STAGE(STAGE_NONE);
+			return;
+		}
+		offset += n;
+		while (first < count && offset >= frames[first].iov_len) {
+			offset -= frames[first].iov_len;
+			first++;
+		}
+	}
+	ENTER_STAGE(STAGE_NONE);
+	PROBE_OUTPUT_WRITTEN(length);
+	recordWrite(length);
+	if (measuringLatency()) {
+		int message = 0;
+		for (int f = 0; f < count; f++) {
+			message += latencyWritten(frames[f].iov_base, frames[f].iov_len, list->readTimes + message);
+		}
+	}
+}
+
+// sendMessages writes a run of complete messages, through the rate limiter if
+// there is one.  The read times of the messages may be NULL.
+static void sendMessages(const unsigned char * messages, size_t length, const struct timespec * readTimes) {
+	if (!shapingOutput()) {
+		writeAll(messages, length, readTimes);
+		return;
+	}
+
+	if (shaped == NULL) {
+		// Each take is at most a burst, so after a write there is always room.
+		shaped = malloc(2 * getShaperBurst());
+		if (measuringLatency()) {
+			shapedReadTimes = malloc(2 * getShaperBurst() / (LENGTH_OF_HEADER + LENGTH_OF_CRC)
+					* sizeof(struct timespec));
+		}
+	}
+	int count = 0;
+	size_t i = 0;
+	while (i + LENGTH_OF_HEADER <= length) {
+		size_t messageLength = getRtcmLength((unsigned char *) messages + i, length - i)
+				+ LENGTH_OF_HEADER + LENGTH_OF_CRC;
+		if (i + messageLength > length) {
+			break;
+		}
+		shapeMessage(messages + i, messageLength, getbitu(messages + i, 24, 12),
+				readTimes == NULL ? NULL : readTimes + count);
+		shapedLength += takeShapedMessages(shaped + shapedLength, shapedReadTimes, &shapedCount);
+		if (shapedLength >= getShaperBurst()) {
+			writeAll(shaped, shapedLength, shapedReadTimes);
+			shapedLength = 0;
+			shapedCount = 0;
+		}
+		count++;
+		i += messageLength;
+	}
+	if (shapedLength > 0) {
+		writeAll(shaped, shapedLength, shapedReadTimes);
+		shapedLength = 0;
+		shapedCount = 0;
+	}
+}
+
+// flushBatch sends the messages in the batch, for the given reason.
+static void flushBatch(int reason) {
+	if (batchLength == 0) {
+		return;
+	}
+
+	sendMessages(batch->content, batchLength, measuringLatency() ? batchReadTimes : NULL);
+
+	double latency = millisecondsSince(&batchStarted);
+	epochLatencyTotal += latency;
+	if (latency > epochLatencyMax) {
+		epochLatencyMax = latency;
+	}
+	switch (reason) {
+	case FLUSH_ON_SYNC:
+		epochsFlushedOnSync++;
+		break;
+	case FLUSH_ON_NEW_EPOCH:
+		epochsFlushedOnNewEpoch++;
+		break;
+	default:
+		epochsFlushedOnDeadline++;
+		break;
+	}
+	if (displayingBuffers()) {
+		fprintf(stderr, "epoch batch of %ld bytes sent after %.3f ms%s\n", batchLength, latency,
+				reason == FLUSH_ON_NEW_EPOCH ? " (new epoch)" : reason == FLUSH_ON_DEADLINE ? " (deadline)" : "");
+	}
+	batchLength = 0;
+	batchCount = 0;
+	batchHasEpoch = FALSE;
+}
+
+// addToBatch adds a message to the batch with its read time, which may be
+// NULL.
+static void addToBatch(const unsigned char * message, size_t length, const struct timespec * readTime) {
+	if (batchLength == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &batchStarted);
+	}
+	if (batch == NULL || batchLength + length > batch->length) {
+		size_t newLength = batch == NULL ? 16 * 1024 : batch->length * 2;
+		while (newLength < batchLength + length) {
+			newLength *= 2;
+		}
+		Buffer * newBatch = createBuffer(newLength);
+		if (batch != NULL) {
+			memcpy(newBatch->content, batch->content, batchLength);
+			freeBuffer(batch);
+		}
+		batch = newBatch;
+	}
+	memcpy(batch->content + batchLength, message, length);
+	batchLength += length;
+
+	if (measuringLatency()) {
+		if (batchCount == batchReadTimesCapacity) {
+			batchReadTimesCapacity = batchReadTimesCapacity > 0 ? batchReadTimesCapacity * 2 : 64;
+			batchReadTimes = realloc(batchReadTimes, batchReadTimesCapacity * sizeof(struct timespec));
+		}
+		if (readTime != NULL) {
+			batchReadTimes[batchCount] = *readTime;
+		} else {
+			batchReadTimes[batchCount].tv_sec = 0;
+			batchReadTimes[batchCount].tv_nsec = 0;
+		}
+		batchCount++;
+	}
+}
+
+// setEpochBatching turns epoch batching on, with the given deadline in
+// milliseconds.
+void setEpochBatching(long deadline) {
+	batching = TRUE;
+	if (deadline > 0) {
+		deadlineMilliseconds = deadline;
+	}
+}
+
+// batchMessages adds a run of complete messages to the batch, sending it at
+// the end of each epoch.  The read times of the messages may be NULL.
+static void batchMessages(unsigned char * messages, size_t messagesLength, const struct timespec * readTimes) {
+	int count = 0;
+	size_t i = 0;
+	while (i + LENGTH_OF_HEADER <= messagesLength) {
+		unsigned char * message = messages + i;
+		size_t length = getRtcmLength(message, messagesLength - i) + LENGTH_OF_HEADER + LENGTH_OF_CRC;
+		if (i + length > messagesLength) {
+			// Shouldn't happen - the run only contains complete messages.
+			break;
+		}
+		MessageMetadata metadata;
+		getMessageMetadata(message, length, &metadata);
+		if (metadata.hasEpoch) {
+			if (batchHasEpoch && !sameEpoch(metadata.epoch, batchEpoch)) {
+				// The end of the last epoch was lost.
+				flushBatch(FLUSH_ON_NEW_EPOCH);
+			}
+			batchHasEpoch = TRUE;
+			batchEpoch = metadata.epoch;
+		}
+		addToBatch(message, length, readTimes == NULL ? NULL : readTimes + count);
+		if (metadata.hasEpoch && !metadata.sync) {
+			flushBatch(FLUSH_ON_SYNC);
+		}
+		count++;
+		i += length;
+	}
+	if (i < messagesLength) {
+		addToBatch(messages + i, messagesLength - i, NULL);
+	}
+}
+
+// writeOutput sends a buffer of complete RTCM messages, as returned by
+// getRtcmDataBlocks().
+void writeOutput(Buffer * buffer) {
+	if (!batching) {
+		sendMessages(buffer->content, buffer->length, NULL);
+		return;
+	}
+
+	batchMessages(buffer->content, buffer->length, NULL);
+	if (batchLength > 0 && millisecondsSince(&batchStarted) >= deadlineMilliseconds) {
+		flushBatch(FLUSH_ON_DEADLINE);
+	}
+}
+
+// writeFrames sends the messages in a frame list, as returned by
+// getRtcmFrames().  Without batching or rate limiting they're written where
+// they are with one writev().
+void writeFrames(FrameList * list) {
+	if (list->count == 0) {
+		return;
+	}
+	if (!batching && !shapingOutput()) {
+		writeAllFrames(list);
+		return;
+	}
+
+	const struct timespec * readTimes = measuringLatency() ? list->readTimes : NULL;
+	for (int f = 0; f < list->count; f++) {
+		if (batching) {
+			batchMessages(list->frames[f].iov_base, list->frames[f].iov_len, readTimes);
+		} else {
+			sendMessages(list->frames[f].iov_base, list->frames[f].iov_len, readTimes);
+		}
+		if (readTimes != NULL) {
+			readTimes += countFramesWritten(list->frames[f].iov_base, list->frames[f].iov_len);
+		}
+	}
+	if (batching && batchLength > 0 && millisecondsSince(&batchStarted) >= deadlineMilliseconds) {
+		flushBatch(FLUSH_ON_DEADLINE);
+	}
+}
+
+// getOutputTimeout returns the number of milliseconds until the batch waiting
+// to be sent reaches its deadline or the rate limiter can send a message that
+// it's holding back, or -1 if nothing is waiting.
+long getOutputTimeout() {
+	long timeout = -1;
+	if (batchLength > 0) {
+		long remaining = deadlineMilliseconds - (long) millisecondsSince(&batchStarted);
+		timeout = remaining > 0 ? remaining : 0;
+	}
+	if (shapingOutput()) {
+		long shaperTimeout = getShaperTimeout();
+		if (shaperTimeout >= 0 && (timeout < 0 || shaperTimeout < timeout)) {
+			timeout = shaperTimeout;
+		}
+	}
+	return timeout;
+}
+
+// serviceOutput sends the batch if it has reached its deadline and any
+// messages that the rate limiter now allows.
+void serviceOutput() {
+	if (batchLength > 0 && millisecondsSince(&batchStarted) >= deadlineMilliseconds) {
+		flushBatch(FLUSH_ON_DEADLINE);
+	}
+	if (shapingOutput() && shaped != NULL) {
+		shapedLength = takeShapedMessages(shaped, shapedReadTimes, &shapedCount);
+		if (shapedLength > 0) {
+			writeAll(shaped, shapedLength, shapedReadTimes);
+			shapedLength = 0;
+		}
+		shapedCount = 0;
+	}
+}
+
+// closeOutput sends anything that's waiting, at the limited rate if need be.
+void closeOutput() {
+	flushBatch(FLUSH_ON_DEADLINE);
+	for (long timeout = getOutputTimeout(); timeout >= 0; timeout = getOutputTimeout()) {
+		struct timespec pause = {timeout / 1000, (timeout % 1000) * 1000000};
+		nanosleep(&pause, NULL);
+		serviceOutput();
+	}
+	freeBuffer(batch);
+	batch = NULL;
+	free(batchReadTimes);
+	batchReadTimes = NULL;
+	batchReadTimesCapacity = 0;
+}
+
+void displayOutputTotals() {
+	fprintf(stderr, "output: %ld writes, %lld bytes",
+			outputWritesSoFar, outputBytesSoFar);
+	if (batching) {
+		unsigned long int epochs = epochsFlushedOnSync + epochsFlushedOnNewEpoch + epochsFlushedOnDeadline;
+		fprintf(stderr, ", %ld epochs (%ld on a new epoch, %ld on deadline), assembly latency mean %.3f ms max %.3f ms",
+				epochs, epochsFlushedOnNewEpoch, epochsFlushedOnDeadline,
+				epochs > 0 ? epochLatencyTotal / epochs : 0.0, epochLatencyMax);
+	}
+	fprintf(stderr, "\n");
+}
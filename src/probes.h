@@ -0,0 +1,52 @@
+/*
+ * probes.h
+ *
+ * USDT static tracepoints in the framing, decoding and output paths.
+ *
+ * With systemtap's sys/sdt.h available, each probe compiles to a single nop
+ * and a note in the ELF file, so it costs next to nothing until a tracer such
+ * as bpftrace attaches to it on a running filter:
+ *
+ *     bpftrace -e 'usdt:/usr/local/bin/rtcmfilter:rtcmfilter:message_decoded { @[arg0] = count(); }'
+ *
+ * Without the header (install systemtap-sdt-dev or systemtap-sdt-devel), the
+ * probes compile to nothing.
+ *
+ * The probes and their arguments:
+ *
+ *     frame_found(position, length)           a complete frame, before its CRC check
+ *     crc_failure(position, length)           a frame that failed the CRC check
+ *     bytes_eaten(count)                      bytes of a buffer discarded as not RTCM
+ *     fragment_carried(length)                the start of a frame kept for the next buffer
+ *     message_decoded(type, length, status)   a frame that decoded, and the decoder's status
+ *     output_written(length)                  a write to the output
+ */
+
+#ifndef SRC_PROBES_H_
+#define SRC_PROBES_H_
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT_PROBES
+#endif
+#endif
+
+#ifdef HAVE_USDT_PROBES
+#define PROBE_FRAME_FOUND(position, length) DTRACE_PROBE2(rtcmfilter, frame_found, position, length)
+#define PROBE_CRC_FAILURE(position, length) DTRACE_PROBE2(rtcmfilter, crc_failure, position, length)
+#define PROBE_BYTES_EATEN(count) DTRACE_PROBE1(rtcmfilter, bytes_eaten, count)
+#define PROBE_FRAGMENT_CARRIED(length) DTRACE_PROBE1(rtcmfilter, fragment_carried, length)
+#define PROBE_MESSAGE_DECODED(type, length, status) \
+	DTRACE_PROBE3(rtcmfilter, message_decoded, type, length, status)
+#define PROBE_OUTPUT_WRITTEN(length) DTRACE_PROBE1(rtcmfilter, output_written, length)
+#else
+#define PROBE_FRAME_FOUND(position, length) do { } while (0)
+#define PROBE_CRC_FAILURE(position, length) do { } while (0)
+#define PROBE_BYTES_EATEN(count) do { } while (0)
+#define PROBE_FRAGMENT_CARRIED(length) do { } while (0)
+#define PROBE_MESSAGE_DECODED(type, length, status) do { } while (0)
+#define PROBE_OUTPUT_WRITTEN(length) do { } while (0)
+#endif
+
+#endif /* SRC_PROBES_H_ */
@@ -0,0 +1,334 @@
+/*
+ * rtcmarchive.c
+ *
+ * Reads the block-compressed archives written by the filter's --archive
+ * option.
+ *
+ *     rtcmarchive list <archive>
+ *         Display the block index.
+ *
+ *     rtcmarchive extract <archive> <start> <end>
+ *         Write the RTCM messages for the epochs between the start and end
+ *         times to stdout.  Times are GPS time "yyyy/mm/dd hh:mm:ss".  Only
+ *         the blocks that overlap the range are decompressed.  Station
+ *         messages and ephemerides are written if the epoch before or after
+ *         them is in the range.
+ *
+ *     rtcmarchive stats <archive>
+ *         Decompress every block and display the compression ratio and the
+ *         decompression throughput.
+ *
+ *     rtcmarchive dictionary <capture> <dictionary>
+ *         Build a compression dictionary from a capture of RTCM3 traffic, for
+ *         use with the filter's --archive-dictionary option.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rtcmfilter.h"
+
+#define MAX_DICTIONARY_LENGTH (32 * 1024)
+#define MAX_TYPES_IN_DICTIONARY 64
+
+static void usage(char * name) {
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "    %s list <archive>\n", name);
+	fprintf(stderr, "    %s extract <archive> <start> <end>\n", name);
+	fprintf(stderr, "    %s stats <archive>\n", name);
+	fprintf(stderr, "    %s dictionary <capture> <dictionary>\n", name);
+	fprintf(stderr, "times are GPS time, \"yyyy/mm/dd hh:mm:ss\"\n");
+	exit(1);
+}
+
+// Convert "yyyy/mm/dd hh:mm:ss" to milliseconds of GPS time.
+static int64_t parseTime(const char * str) {
+	char buffer[64];
+	gtime_t time;
+
+	snprintf(buffer, sizeof(buffer), "%s", str);
+	for (char * p = buffer; *p; p++) {
+		if (*p == '/' || *p == ':' || *p == '-' || *p == 'T') {
+			*p = ' ';
+		}
+	}
+	if (str2time(buffer, 0, sizeof(buffer), &time) != 0) {
+		fprintf(stderr, "ERROR: can't convert <%s> to a time\n", str);
+		exit(1);
+	}
+	return getEpochMilliseconds(time);
+}
+
+static char * formatTime(int64_t epoch) {
+	gtime_t time;
+	time.time = epoch / 1000;
+	time.sec = (epoch % 1000) / 1000.0;
+	return time_str(time, 3);
+}
+
+static void list(ArchiveReader * reader) {
+	for (size_t i = 0; i < reader->blocks; i++) {
+		ArchiveIndexEntry * e = reader->index + i;
+		printf("%6ld offset %10lld compressed %7d raw %7d messages %5d ",
+				i, (long long) e->offset, e->compressedLength, e->rawLength, e->messages);
+		printf("%s ", formatTime(e->firstEpoch));
+		printf("%s\n", formatTime(e->lastEpoch));
+	}
+}
+
+// The messages without an epoch since the last epoch, which is not in the
+// range.  They are written if the next epoch is.
+static unsigned char * pending = NULL;
+static size_t pendingLength = 0;
+static size_t pendingCapacity = 0;
+static unsigned long pendingMessages = 0;
+
+static void addPending(const unsigned char * message, size_t length) {
+	if (pendingLength + length > pendingCapacity) {
+		pendingCapacity = (pendingLength + length) * 2;
+		pending = realloc(pending, pendingCapacity);
+	}
+	memcpy(pending + pendingLength, message, length);
+	pendingLength += length;
+	pendingMessages++;
+}
+
+// extract writes the messages for the epochs in the range.  The blocks are
+// walked in order, one message at a time, so a block that overlaps the edge
+// of the range only contributes the messages inside it.
+static int extract(ArchiveReader * reader, int64_t start, int64_t end) {
+	unsigned int blocksRead = 0;
+	unsigned long messagesWritten = 0;
+	int64_t previousEpoch = 0;
+
+	for (size_t i = 0; i < reader->blocks; i++) {
+		ArchiveIndexEntry * e = reader->index + i;
+		if (e->lastEpoch < start || e->firstEpoch > end) {
+			// None of its epochs is in the range, so none of the messages
+			// waiting for the next epoch are wanted.
+			pendingLength = 0;
+			pendingMessages = 0;
+			previousEpoch = e->lastEpoch;
+			continue;
+		}
+		unsigned char * raw = readArchiveBlock(reader, e);
+		if (raw == NULL) {
+			return 1;
+		}
+		gtime_t reference;
+		reference.time = e->firstEpoch / 1000;
+		reference.sec = 0.0;
+		size_t length;
+		for (size_t position = 0; position + 6 <= e->rawLength; position += length) {
+			length = getbitu(raw + position, 14, 10) + 6;
+			MessageMetadata metadata;
+			if (raw[position] != 0xd3 || position + length > e->rawLength
+					|| !getMessageMetadata(raw + position, length, &metadata)) {
+				fprintf(stderr, "ERROR: archive block at offset %lld holds a bad message\n",
+						(long long) e->offset);
+				free(raw);
+				return 1;
+			}
+			if (metadata.hasEpoch) {
+				reference = getMessageTime(&metadata, reference);
+				previousEpoch = getEpochMilliseconds(reference);
+				if (previousEpoch >= start && previousEpoch <= end) {
+					fwrite(pending, 1, pendingLength, stdout);
+					fwrite(raw + position, 1, length, stdout);
+					messagesWritten += pendingMessages + 1;
+				}
+				pendingLength = 0;
+				pendingMessages = 0;
+			} else if (previousEpoch >= start && previousEpoch <= end) {
+				fwrite(raw + position, 1, length, stdout);
+				messagesWritten++;
+			} else {
+				addPending(raw + position, length);
+			}
+		}
+		free(raw);
+		blocksRead++;
+	}
+	free(pending);
+	fprintf(stderr, "%d of %ld blocks decompressed, %ld messages written\n",
+			blocksRead, reader->blocks, messagesWritten);
+	return 0;
+}
+
+static int stats(ArchiveReader * reader) {
+	unsigned long long rawBytes = 0;
+	unsigned long long compressedBytes = reader->dictionaryLength;
+	struct timespec start, finish;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < reader->blocks; i++) {
+		ArchiveIndexEntry * e = reader->index + i;
+		unsigned char * raw = readArchiveBlock(reader, e);
+		if (raw == NULL) {
+			return 1;
+		}
+		free(raw);
+		rawBytes += e->rawLength;
+		compressedBytes += e->compressedLength;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	double seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("blocks %ld\n", reader->blocks);
+	printf("dictionary bytes %ld\n", reader->dictionaryLength);
+	printf("raw bytes %lld\n", rawBytes);
+	printf("compressed bytes %lld (including dictionary)\n", compressedBytes);
+	if (compressedBytes > 0) {
+		printf("compression ratio %.2f\n", (double) rawBytes / compressedBytes);
+	}
+	if (seconds > 0.0) {
+		printf("decompression %.1f MB/s\n", rawBytes / seconds / 1e6);
+	}
+	return 0;
+}
+
+// makeDictionary builds a zlib preset dictionary from a capture.  zlib finds
+// matches most cheaply near the end of the dictionary, so the dictionary starts
+// with one example of each of the less common message types and is filled up
+// with the latest messages in the capture, which are mostly the common types.
+static int makeDictionary(const char * capturePath, const char * dictionaryPath) {
+	unsigned int types[MAX_TYPES_IN_DICTIONARY];
+	unsigned long counts[MAX_TYPES_IN_DICTIONARY];
+	unsigned char * examples[MAX_TYPES_IN_DICTIONARY];
+	size_t lengths[MAX_TYPES_IN_DICTIONARY];
+	int numberOfTypes = 0;
+
+	FILE * fh = fopen(capturePath, "r");
+	if (fh == NULL) {
+		fprintf(stderr, "ERROR: can't read capture <%s>\n", capturePath);
+		return 1;
+	}
+	fseek(fh, 0, SEEK_END);
+	long captureLength = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+	unsigned char * capture = malloc(captureLength);
+	if (fread(capture, 1, captureLength, fh) != (size_t) captureLength) {
+		fprintf(stderr, "ERROR: can't read capture <%s>\n", capturePath);
+		return 1;
+	}
+	fclose(fh);
+
+	// Find the valid messages.  Their positions are recorded in the capture
+	// buffer's own order so that the latest ones can be found afterwards.
+	long * positions = malloc(sizeof(long) * (captureLength / 6 + 1));
+	long numberOfMessages = 0;
+	for (long i = 0; i + 6 <= captureLength; ) {
+		if (capture[i] != 0xd3) {
+			i++;
+			continue;
+		}
+		size_t length = getbitu(capture + i, 14, 10) + 6;
+		if (i + (long) length > captureLength
+				|| rtk_crc24q(capture + i, length - 3) != getbitu(capture + i, (length - 3) * 8, 24)) {
+			i++;
+			continue;
+		}
+		positions[numberOfMessages++] = i;
+		unsigned int type = getbitu(capture + i, 24, 12);
+		int t;
+		for (t = 0; t < numberOfTypes && types[t] != type; t++)
+			;
+		if (t == numberOfTypes && numberOfTypes < MAX_TYPES_IN_DICTIONARY) {
+			types[t] = type;
+			counts[t] = 0;
+			numberOfTypes++;
+		}
+		if (t < numberOfTypes) {
+			counts[t]++;
+			examples[t] = capture + i;
+			lengths[t] = length;
+		}
+		i += length;
+	}
+
+	// Sort by ascending frequency.
+	for (int a = 1; a < numberOfTypes; a++) {
+		for (int b = a; b > 0 && counts[b - 1] > counts[b]; b--) {
+			unsigned long count = counts[b]; counts[b] = counts[b - 1]; counts[b - 1] = count;
+			unsigned int type = types[b]; types[b] = types[b - 1]; types[b - 1] = type;
+			unsigned char * example = examples[b]; examples[b] = examples[b - 1]; examples[b - 1] = example;
+			size_t length = lengths[b]; lengths[b] = lengths[b - 1]; lengths[b - 1] = length;
+		}
+	}
+
+	// One example of each type, using at most half of the dictionary.
+	unsigned char dictionary[MAX_DICTIONARY_LENGTH];
+	size_t dictionaryLength = 0;
+	for (int t = 0; t < numberOfTypes; t++) {
+		fprintf(stderr, "type %d: %ld messages in capture\n", types[t], counts[t]);
+		if (dictionaryLength + lengths[t] <= sizeof(dictionary) / 2) {
+			memcpy(dictionary + dictionaryLength, examples[t], lengths[t]);
+			dictionaryLength += lengths[t];
+		}
+	}
+
+	// Fill the rest with the latest messages, in their original order.
+	long first = numberOfMessages;
+	size_t fill = 0;
+	while (first > 0) {
+		size_t length = getbitu(capture + positions[first - 1], 14, 10) + 6;
+		if (dictionaryLength + fill + length > sizeof(dictionary)) {
+			break;
+		}
+		fill += length;
+		first--;
+	}
+	for (long m = first; m < numberOfMessages; m++) {
+		size_t length = getbitu(capture + positions[m], 14, 10) + 6;
+		memcpy(dictionary + dictionaryLength, capture + positions[m], length);
+		dictionaryLength += length;
+	}
+	free(positions);
+	free(capture);
+
+	fh = fopen(dictionaryPath, "w");
+	if (fh == NULL || fwrite(dictionary, 1, dictionaryLength, fh) != dictionaryLength) {
+		fprintf(stderr, "ERROR: can't write dictionary <%s>\n", dictionaryPath);
+		return 1;
+	}
+	fclose(fh);
+	fprintf(stderr, "dictionary of %ld bytes from %ld messages\n", dictionaryLength, numberOfMessages);
+	return 0;
+}
+
+int main(int argc, char ** argv) {
+	ArchiveReader reader;
+	int result;
+
+	if (argc < 3) {
+		usage(argv[0]);
+	}
+
+	if (strcmp(argv[1], "dictionary") == 0) {
+		if (argc != 4) {
+			usage(argv[0]);
+		}
+		return makeDictionary(argv[2], argv[3]);
+	}
+
+	if (!openArchiveReader(argv[2], &reader)) {
+		return 1;
+	}
+
+	if (strcmp(argv[1], "list") == 0 && argc == 3) {
+		list(&reader);
+		result = 0;
+	} else if (strcmp(argv[1], "extract") == 0 && argc == 5) {
+		result = extract(&reader, parseTime(argv[3]), parseTime(argv[4]));
+	} else if (strcmp(argv[1], "stats") == 0 && argc == 3) {
+		result = stats(&reader);
+	} else {
+		usage(argv[0]);
+	}
+
+	closeArchiveReader(&reader);
+	return result;
+}
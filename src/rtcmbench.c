@@ -0,0 +1,179 @@
+/*
+ * rtcmbench.c
+ *
+ * Measures the throughput of the filter on a stream such as one written by
+ * rtcmgen.
+ *
+ *     rtcmbench [-p passes] [-b readsize] <stream> [<filter>]
+ *
+ * The stream is read into memory and fed to getRtcmFrames() in reads of
+ * the given size (default 1024, the size of the filter's read buffer), as
+ * many times over as the number of passes (default 1).  If a filter program
+ * is given, it's run on the stream with "-M file -s <stream>" and its output
+ * sent to /dev/null.  Both are reported in MB/s, frames/s and allocations
+ * per frame.
+ *
+ * The benchmark must be linked with alloccount.o and the malloc wrappers to
+ * count the allocations.  The filter should be rtcmfilter-counted, which
+ * reports its own allocations.  Any other filter is timed only.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "rtcmfilter.h"
+
+#define DEFAULT_READ_SIZE 1024
+
+int verboseMode = 0;
+
+extern unsigned long allocationsSoFar;
+
+static void usage(char * name) {
+	fprintf(stderr, "usage: %s [-p passes] [-b readsize] <stream> [<filter>]\n", name);
+	exit(1);
+}
+
+static double secondsSince(const struct timespec * start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static unsigned char * readStream(const char * path, size_t * length) {
+	FILE * file = fopen(path, "rb");
+	if (file == NULL) {
+		perror(path);
+		exit(1);
+	}
+	struct stat status;
+	fstat(fileno(file), &status);
+	unsigned char * stream = malloc(status.st_size > 0 ? status.st_size : 1);
+	*length = fread(stream, 1, status.st_size, file);
+	fclose(file);
+	return stream;
+}
+
+static void report(const char * name, size_t bytes, unsigned long frames, double seconds,
+		long allocations) {
+	printf("%s: %zu bytes, %lu frames in %.3f s, %.1f MB/s, %.0f frames/s", name, bytes, frames,
+			seconds, bytes / seconds / 1e6, frames / seconds);
+	if (allocations >= 0) {
+		printf(", %.2f allocations per frame", frames > 0 ? (double) allocations / frames : 0.0);
+	}
+}
+
+// benchmarkFramer feeds the stream through getRtcmFrames() and returns
+// the number of frames that came out of one pass.
+static unsigned long benchmarkFramer(unsigned char * stream, size_t length, size_t readSize,
+		int passes) {
+	rtcm_t * rtcm = malloc(sizeof(rtcm_t));
+	init_rtcm(rtcm);
+
+	unsigned long frames = 0;
+	unsigned long allocationsBefore = allocationsSoFar;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int pass = 0; pass < passes; pass++) {
+		for (size_t i = 0; i < length; i += readSize) {
+			Buffer input;
+			input.content = stream + i;
+			input.length = length - i < readSize ? length - i : readSize;
+			FrameList * list = getRtcmFrames(input, rtcm);
+			for (int f = 0; f < list->count; f++) {
+				frames += countFramesWritten(list->frames[f].iov_base, list->frames[f].iov_len);
+			}
+		}
+	}
+	double seconds = secondsSince(&start);
+
+	report("getRtcmFrames", length * passes, frames, seconds,
+			allocationsSoFar - allocationsBefore);
+	printf(", read size %zu\n", readSize);
+	free_rtcm(rtcm);
+	free(rtcm);
+	return frames / passes;
+}
+
+// benchmarkFilter runs the filter program on the stream.
+static void benchmarkFilter(const char * filter, const char * path, size_t length,
+		unsigned long frames) {
+	char errors[] = "/tmp/rtcmbenchXXXXXX";
+	int errorFd = mkstemp(errors);
+	if (errorFd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid_t pid = fork();
+	if (pid == 0) {
+		int nullFd = open("/dev/null", O_WRONLY);
+		dup2(nullFd, 1);
+		dup2(errorFd, 2);
+		setenv("RTCM_COUNT_ALLOCATIONS", "1", 1);
+		execl(filter, filter, "-M", "file", "-s", path, (char *) NULL);
+		perror(filter);
+		_exit(127);
+	}
+	int status;
+	struct rusage usage;
+	wait4(pid, &status, 0, &usage);
+	double seconds = secondsSince(&start);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed - see %s\n", filter, errors);
+		exit(1);
+	}
+
+	long allocations = -1;
+	char line[256];
+	FILE * file = fdopen(errorFd, "r");
+	rewind(file);
+	while (fgets(line, sizeof(line), file) != NULL) {
+		sscanf(line, "allocations: %ld", &allocations);
+	}
+	fclose(file);
+	unlink(errors);
+
+	report(filter, length, frames, seconds, allocations);
+	printf(", %.3f s CPU, peak RSS %ld kB\n",
+			usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+			+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+			usage.ru_maxrss);
+}
+
+int main(int argc, char ** argv) {
+	int passes = 1;
+	size_t readSize = DEFAULT_READ_SIZE;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:b:")) != -1) {
+		switch (opt) {
+		case 'p': passes = atoi(optarg); break;
+		case 'b': readSize = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (passes < 1 || readSize < 1 || argc - optind < 1 || argc - optind > 2) {
+		usage(argv[0]);
+	}
+
+	size_t length;
+	unsigned char * stream = readStream(argv[optind], &length);
+	unsigned long frames = benchmarkFramer(stream, length, readSize, passes);
+	// Free the stream first, or it counts towards the peak RSS of the child
+	// until the filter program is exec'd.
+	free(stream);
+	if (argc - optind == 2) {
+		benchmarkFilter(argv[optind + 1], argv[optind], length, frames);
+	}
+	return 0;
+}
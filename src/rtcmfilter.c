@@ -118,6 +118,48 @@ CASTER = 6, LAST };
 
 enum OUTMODE { HTTP = 1, RTSP = 2, NTRIP1 = 3, UDP = 4, END };
 
+/* options that only have a long form */
+enum LONGOPTION { OPT_ARCHIVE = 256, OPT_ARCHIVE_DICTIONARY, OPT_ARCHIVE_BLOCK_SIZE,
+OPT_EPOCH_BATCH, OPT_EPOCH_DEADLINE, OPT_ALLOW_TYPES, OPT_DENY_TYPES, OPT_TYPE_PRESET, OPT_DECIMATE,
+OPT_RATE, OPT_BURST, OPT_TRANSCODE_MSM4, OPT_STRIP_SIGNALS,
+OPT_ELEVATION_MASK, OPT_LEGACY_OBSERVATIONS, OPT_DEDUP,
+OPT_DECODE_CACHE, OPT_METRICS_SOCKET, OPT_METRICS_FILE,
+OPT_REPORT_INTERVAL, OPT_LATENCY, OPT_STATS_FILE,
+OPT_STAGE_COSTS, OPT_FLIGHT_RECORDER, OPT_FLIGHT_RECORDER_RING,
+OPT_FLIGHT_RECORDER_SECONDS, OPT_FAST_PATH, OPT_FAST_PATH_RUN };
+
+static struct option longoptions[] = {
+  {"archive",            required_argument, 0, OPT_ARCHIVE},
+  {"archive-dictionary", required_argument, 0, OPT_ARCHIVE_DICTIONARY},
+  {"archive-block-size", required_argument, 0, OPT_ARCHIVE_BLOCK_SIZE},
+  {"epoch-batch",        no_argument,       0, OPT_EPOCH_BATCH},
+  {"epoch-deadline",     required_argument, 0, OPT_EPOCH_DEADLINE},
+  {"allow-types",        required_argument, 0, OPT_ALLOW_TYPES},
+  {"deny-types",         required_argument, 0, OPT_DENY_TYPES},
+  {"type-preset",        required_argument, 0, OPT_TYPE_PRESET},
+  {"decimate",           required_argument, 0, OPT_DECIMATE},
+  {"rate",               required_argument, 0, OPT_RATE},
+  {"burst",              required_argument, 0, OPT_BURST},
+  {"transcode-msm4",     no_argument,       0, OPT_TRANSCODE_MSM4},
+  {"strip-signals",      required_argument, 0, OPT_STRIP_SIGNALS},
+  {"elevation-mask",     required_argument, 0, OPT_ELEVATION_MASK},
+  {"legacy-observations", required_argument, 0, OPT_LEGACY_OBSERVATIONS},
+  {"dedup",              required_argument, 0, OPT_DEDUP},
+  {"decode-cache",       no_argument,       0, OPT_DECODE_CACHE},
+  {"metrics-socket",     required_argument, 0, OPT_METRICS_SOCKET},
+  {"metrics-file",       required_argument, 0, OPT_METRICS_FILE},
+  {"report-interval",    required_argument, 0, OPT_REPORT_INTERVAL},
+  {"latency",            no_argument,       0, OPT_LATENCY},
+  {"stats-file",         required_argument, 0, OPT_STATS_FILE},
+  {"stage-costs",        no_argument,       0, OPT_STAGE_COSTS},
+  {"flight-recorder",    required_argument, 0, OPT_FLIGHT_RECORDER},
+  {"flight-recorder-ring", required_argument, 0, OPT_FLIGHT_RECORDER_RING},
+  {"flight-recorder-seconds", required_argument, 0, OPT_FLIGHT_RECORDER_SECONDS},
+  {"fast-path",          no_argument,       0, OPT_FAST_PATH},
+  {"fast-path-run",      required_argument, 0, OPT_FAST_PATH_RUN},
+  {0, 0, 0, 0}
+};
+
 #define AGENTSTRING     "NTRIP NtripServerPOSIX"
 // BUFSZ must be at least 136.
 #define BUFSZ           1024
@@ -158,6 +200,8 @@ static sockettype socket_udp   = INVALID_SOCKET;
 #ifndef WINDOWSVERSION
 static int gps_serial          = INVALID_HANDLE_VALUE;
 static int sigpipe_received    = 0;
+static volatile sig_atomic_t sigusr1_received = 0;
+static volatile sig_atomic_t sigusr2_received = 0;
 #else
 HANDLE gps_serial              = INVALID_HANDLE_VALUE;
 #endif
@@ -181,6 +225,8 @@ static void setup_signal_handler(int sig, void (*handler)(int));
 #ifndef WINDOWSVERSION
 static int  openserial(const char * tty, int blocksz, int baud);
 static void handle_sigpipe(int sig);
+static void handle_sigusr1(int sig);
+static void handle_sigusr2(int sig);
 static void handle_alarm(int sig);
 #else
 static HANDLE openserial(const char * tty, int baud);
@@ -237,6 +283,30 @@ int main(int argc, char **argv)
 
   const char *       initfile = NULL;
 
+  const char *       archivefile = NULL;
+  const char *       archivedictionary = NULL;
+  long               archiveblocksize = 0;
+
+  int                epochbatch = FALSE;
+  long               epochdeadline = 0;
+
+  const char *       allowtypes[SZ];
+  int                nallowtypes = 0;
+  const char *       denytypes[SZ];
+  int                ndenytypes = 0;
+  const char *       typepreset = NULL;
+
+  long               outputrate = 0;
+  long               outputburst = 0;
+
+  const char *       flightrecorder = NULL;
+  const char *       flightrecorderring = NULL;
+  long               flightrecorderseconds = 0;
+
+  int                fastpath = FALSE;
+  long               fastpathrun = 0;
+  int                decodingneeded = FALSE;
+
   int                bindmode = 0;
   char               szSendBuffer[BUFSZ];
   int                nBufferBytes = 0;
@@ -270,6 +340,10 @@ int main(int argc, char **argv)
 #ifndef WINDOWSVERSION
   /* setup signal handler for boken pipe */
   setup_signal_handler(SIGPIPE, handle_sigpipe);
+  /* setup signal handler for dumping the statistics */
+  setup_signal_handler(SIGUSR1, handle_sigusr1);
+  /* setup signal handler for dumping the flight recorder */
+  setup_signal_handler(SIGUSR2, handle_sigusr2);
   /* setup signal handler for timeout */
   // setup_signal_handler(SIGALRM, handle_alarm);
   // alarm(ALARMTIME);
@@ -289,8 +363,8 @@ int main(int argc, char **argv)
     usage(2, argv[0]);
     exit(1);
   }
-  while((c = getopt(argc, argv,
-  		  "vnM:i:h:b:s:H:P:f:x:y:l:u:V:D:U:W:O:E:F:R:B")) != EOF)
+  while((c = getopt_long(argc, argv,
+  		  "vnM:i:h:b:s:H:P:f:x:y:l:u:V:D:U:W:O:E:F:R:B", longoptions, NULL)) != EOF)
     {
     switch (c)
     {
@@ -391,6 +465,147 @@ int main(int argc, char **argv)
     case 'R':  /* maximum delay between reconnect attempts in seconds */
        reconnect_sec_max = atoi(optarg);
        break;
+    case OPT_ARCHIVE: /* block-compressed archive of the output */
+      archivefile = optarg;
+      break;
+    case OPT_ARCHIVE_DICTIONARY: /* preset dictionary for the archive */
+      archivedictionary = optarg;
+      break;
+    case OPT_ARCHIVE_BLOCK_SIZE: /* uncompressed size of an archive block */
+      archiveblocksize = atol(optarg);
+      if(archiveblocksize < 1024)
+      {
+        fprintf(stderr, "ERROR: archive block size <%s> is too small\n", optarg);
+        usage(1, argv[0]);
+      }
+      break;
+    case OPT_EPOCH_BATCH: /* send each epoch with one write */
+      epochbatch = TRUE;
+      break;
+    case OPT_EPOCH_DEADLINE: /* longest time to hold an incomplete epoch */
+      epochbatch = TRUE;
+      epochdeadline = atol(optarg);
+      if(epochdeadline <= 0)
+      {
+        fprintf(stderr, "ERROR: can't convert <%s> to a valid epoch deadline\n", optarg);
+        usage(1, argv[0]);
+      }
+      break;
+    case OPT_ALLOW_TYPES: /* message types to pass */
+      if(nallowtypes < SZ) allowtypes[nallowtypes++] = optarg;
+      break;
+    case OPT_DENY_TYPES: /* message types to drop */
+      if(ndenytypes < SZ) denytypes[ndenytypes++] = optarg;
+      break;
+    case OPT_TYPE_PRESET: /* preset allow and deny lists */
+      typepreset = optarg;
+      break;
+    case OPT_DECIMATE: /* output interval for some message types */
+      if(!addDecimation(optarg))
+        usage(1, argv[0]);
+      break;
+    case OPT_RATE: /* output rate limit, bytes per second */
+      outputrate = atol(optarg);
+      if(outputrate <= 0)
+      {
+        fprintf(stderr, "ERROR: can't convert <%s> to a valid rate\n", optarg);
+        usage(1, argv[0]);
+      }
+      break;
+    case OPT_BURST: /* burst size of the rate limit */
+      outputburst = atol(optarg);
+      if(outputburst < MAX_RTCM_MESSAGE_LENGTH)
+      {
+        fprintf(stderr, "ERROR: burst <%s> must be at least %d bytes\n", optarg,
+          MAX_RTCM_MESSAGE_LENGTH);
+        usage(1, argv[0]);
+      }
+      break;
+    case OPT_TRANSCODE_MSM4: /* rewrite MSM5, MSM6 and MSM7 as MSM4 */
+      setMsmTranscoding();
+      break;
+    case OPT_STRIP_SIGNALS: /* signals to remove from the MSMs */
+      if(!addSignalStripping(optarg))
+        usage(1, argv[0]);
+      break;
+    case OPT_ELEVATION_MASK: /* remove satellites below this elevation */
+      {
+        char *end;
+        double elevation = strtod(optarg, &end);
+        if(end == optarg || *end != '\0' || !setElevationMask(elevation))
+        {
+          fprintf(stderr, "ERROR: can't convert <%s> to an elevation in degrees\n", optarg);
+          usage(1, argv[0]);
+        }
+      }
+      decodingneeded = TRUE;
+      break;
+    case OPT_LEGACY_OBSERVATIONS: /* make 1004/1012 from the MSMs */
+      if(!setLegacyObservations(optarg))
+      {
+        fprintf(stderr, "ERROR: legacy observations <%s> should be add or replace\n", optarg);
+        usage(1, argv[0]);
+      }
+      decodingneeded = TRUE;
+      break;
+    case OPT_DEDUP: /* suppress repeated ephemerides and station messages */
+      if(!setDeduplication(atof(optarg)))
+      {
+        fprintf(stderr, "ERROR: can't convert <%s> to a refresh interval in seconds\n", optarg);
+        usage(1, argv[0]);
+      }
+      break;
+    case OPT_DECODE_CACHE: /* don't decode repeated station messages and ephemerides */
+      setDecodeCaching();
+      break;
+    case OPT_METRICS_SOCKET: /* serve the metrics on a Unix socket */
+      setMetricsSocket(optarg);
+      break;
+    case OPT_METRICS_FILE: /* write the metrics to a file */
+      setMetricsFile(optarg);
+      break;
+    case OPT_REPORT_INTERVAL: /* seconds between reports of the totals */
+      if(!setReportInterval(atol(optarg)))
+      {
+        fprintf(stderr, "ERROR: can't convert <%s> to a valid report interval\n", optarg);
+        usage(1, argv[0]);
+      }
+      break;
+    case OPT_LATENCY: /* measure the time from read to write */
+      setLatencyMeasurement();
+      break;
+    case OPT_STATS_FILE: /* write the detailed statistics with each report */
+      setStatsFile(optarg);
+      break;
+    case OPT_STAGE_COSTS: /* measure the time spent in each stage */
+      setStageCosting();
+      break;
+    case OPT_FLIGHT_RECORDER: /* record the recent history, dumped to this file */
+      flightrecorder = optarg;
+      break;
+    case OPT_FLIGHT_RECORDER_RING: /* keep the flight recorder in a mapped file */
+      flightrecorderring = optarg;
+      break;
+    case OPT_FLIGHT_RECORDER_SECONDS: /* history to keep in a dump */
+      flightrecorderseconds = atol(optarg);
+      if(flightrecorderseconds <= 0)
+      {
+        fprintf(stderr, "ERROR: can't convert <%s> to a valid number of seconds\n", optarg);
+        usage(1, argv[0]);
+      }
+      break;
+    case OPT_FAST_PATH: /* skip the decoder while the stream is pure RTCM */
+      fastpath = TRUE;
+      break;
+    case OPT_FAST_PATH_RUN: /* good frames before the fast path starts */
+      fastpath = TRUE;
+      fastpathrun = atol(optarg);
+      if(fastpathrun <= 0)
+      {
+        fprintf(stderr, "ERROR: can't convert <%s> to a valid number of frames\n", optarg);
+        usage(1, argv[0]);
+      }
+      break;
     case 'h': /* print help screen */
     case '?':
       usage(0, argv[0]);
@@ -401,6 +616,22 @@ int main(int argc, char **argv)
     }
   }
 
+  /* the allow lists are applied before the deny lists */
+  for(c = 0; c < nallowtypes; c++)
+    if(!allowMessageTypes(allowtypes[c]))
+      usage(1, argv[0]);
+  for(c = 0; c < ndenytypes; c++)
+    if(!denyMessageTypes(denytypes[c]))
+      usage(1, argv[0]);
+  if(typepreset && !applyMessageTypePreset(typepreset))
+    usage(1, argv[0]);
+
+  /* the burst defaults to a second's worth */
+  if(outputrate > 0 && !setShaping(outputrate,
+    outputburst > 0 ? outputburst
+    : outputrate > MAX_RTCM_MESSAGE_LENGTH ? outputrate : MAX_RTCM_MESSAGE_LENGTH))
+    usage(1, argv[0]);
+
   argc -= optind;
   argv += optind;
 
@@ -416,6 +647,28 @@ int main(int argc, char **argv)
     usage(1, argv[0]);                   /* never returns */
   }
 
+  if(archivefile && !openArchive(archivefile, archivedictionary, archiveblocksize))
+    exit(1);
+
+  if(epochbatch)
+    setEpochBatching(epochdeadline);
+
+  /* the fast path doesn't decode the messages */
+  if(fastpath && decodingneeded)
+  {
+    fprintf(stderr, "ERROR: --fast-path can't be used with --elevation-mask or --legacy-observations\n");
+    usage(1, argv[0]);
+  }
+  if(fastpath)
+    setFastPath(fastpathrun);
+
+  if(!startMetricsExport())
+    exit(1);
+
+  if(flightrecorder && !setFlightRecorder(flightrecorder, flightrecorderring,
+    flightrecorderseconds))
+    exit(1);
+
   while(inputmode != LAST)
   {
     int input_init = 1;
@@ -798,6 +1051,10 @@ int main(int argc, char **argv)
 
     send_receive_loop(rtcm);
 
+    closeOutput();
+    writeStatsFile();
+    closeArchive();
+    closeMetrics();
     exit(0);
 
     while((input_init))
@@ -845,6 +1102,22 @@ static void send_receive_loop(rtcm_t * rtcm)
   while(TRUE)
   {
     if(send_recv_success < 3) send_recv_success++;
+
+    /* report the totals when they are due, however busy the input is */
+    serviceReports();
+#ifndef WINDOWSVERSION
+    if(sigusr1_received)
+    {
+      sigusr1_received = 0;
+      writeStats(stderr);
+      writeStatsFile();
+    }
+    if(sigusr2_received)
+    {
+      sigusr2_received = 0;
+      dumpFlightRecorder("signal");
+    }
+#endif
     /*
     if(!nodata)
     {
@@ -891,6 +1164,29 @@ static void send_receive_loop(rtcm_t * rtcm)
           return;
         }
       }
+#ifndef WINDOWSVERSION
+      /* don't wait for input past an epoch batch deadline, the time when
+         the rate limiter can send a message it's holding or the next report */
+      long timeout = getOutputTimeout();
+      long reportTimeout = getReportTimeout();
+      if(timeout < 0 || reportTimeout < timeout)
+        timeout = reportTimeout;
+      int fd = inputmode == INFILE ? gps_file
+        : inputmode == SERIAL ? gps_serial : gps_socket;
+      fd_set readfds;
+      struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+      FD_ZERO(&readfds);
+      FD_SET(fd, &readfds);
+      int ready = select(fd + 1, &readfds, 0, 0, &tv);
+      if(ready == 0)
+      {
+        serviceOutput();
+        serviceReports();
+        continue;
+      }
+      if(ready < 0 && errno == EINTR)
+        continue;
+#endif
       /*** receiving data ****/
       if(inputmode == INFILE) {
         nBufferBytes = read(gps_file, buffer, sizeof(buffer));
@@ -921,6 +1217,14 @@ static void send_receive_loop(rtcm_t * rtcm)
 #endif
       }
 
+#ifndef WINDOWSVERSION
+      if(nBufferBytes < 0 && errno == EINTR && !sigint_received)
+      {
+        /* interrupted by a signal such as SIGUSR1 - try again */
+        nBufferBytes = 0;
+        continue;
+      }
+#endif
       if(nBufferBytes == 0)
       {
         fprintf(stderr, "WARNING: no data received from input\n");
@@ -949,14 +1253,17 @@ static void send_receive_loop(rtcm_t * rtcm)
       // A read error of some sort.
       return;
     }
+    countRead(nBufferBytes);
+    noteRead();
+    recordRead(buffer, nBufferBytes);
 
     if(send_recv_success == 3) {
     	reconnect_sec = 1;
     }
 
     /*
-     * Ignore any messages in the input buffer that are not RTCM, send any RTCM message or
-     * fragments to stdout and free the output buffer.
+     * Ignore any messages in the input buffer that are not RTCM and send the RTCM messages
+     * to stdout, straight from the input buffer.
      */
     Buffer inputBuffer;
     inputBuffer.content = buffer;
@@ -965,21 +1272,12 @@ static void send_receive_loop(rtcm_t * rtcm)
     if (displayingBuffers) {
     	displayBuffer(&inputBuffer);
     }
-    Buffer * outputBuffer = getRtcmDataBlocks(inputBuffer, rtcm);
-
-    // If the input buffer contains any RTCM messages (complete or fragments) write it to stdout.
-    if (outputBuffer == NULL) {
-    	if (verboseMode > 0 && displayingBuffers()) {
-			fprintf(stderr, "\noutput buffer is null after processing\n");
-		}
-    	// Signal that the buffer is processed.
-    	nBufferBytes = 0;
-    	continue;
-    }
+    FrameList * frames = getRtcmFrames(inputBuffer, rtcm);
 
-    if (outputBuffer->length == 0) {
+    // If the input buffer contains any RTCM messages write them to stdout.
+    if (frames->count == 0) {
 		if (verboseMode > 0 && displayingBuffers()) {
-			fprintf(stderr, "\noutput buffer is empty after processing\n");
+			fprintf(stderr, "\nno messages after processing\n");
 		}
 		// Signal that the buffer is processed.
 		nBufferBytes = 0;
@@ -988,23 +1286,16 @@ static void send_receive_loop(rtcm_t * rtcm)
 
         if (log_rtcm) {
             // Log messages for post processing.
-            write(datafd, outputBuffer->content, outputBuffer->length);
+            for (int f = 0; f < frames->count; f += IOV_MAX) {
+                writev(datafd, frames->frames + f, frames->count - f < IOV_MAX ? frames->count - f : IOV_MAX);
+            }
         }
 
 	if (verboseMode > 0 && displayingBuffers()) {
-		fprintf(stderr, "\nwriting buffer - length %ld\n", outputBuffer->length);
-	}
-
-        /*
-        write(stdout, outputBuffer->content, outputBuffer->length);
-        */
-	for (int i = 0; i < outputBuffer->length; i++) {
-		putc(outputBuffer->content[i], stdout);
+		fprintf(stderr, "\nwriting %d frames - length %ld\n", frames->count, frames->length);
 	}
 
-	// Free the output buffer.
-	freeBuffer(outputBuffer);
-	outputBuffer = NULL;
+	writeFrames(frames);
 
     // Signal that the buffer is processed.
     nBufferBytes = 0;
@@ -1256,7 +1547,81 @@ void usage(int rc, char *name)
   fprintf(stderr, "                         for protected streams if <InputMode> = 6\n\n");
   fprintf(stderr, "       -N <STR-record>   Sourcetable STR-record\n");
   fprintf(stderr, "                         optional for NTRIP Version 2.0 in RTSP/RTP and TCP/IP mode\n\n");
-  fprintf(stderr, "       -v                verbose mode - displays the first 50 RTCM messages (if none arrive, it displays the first 1000 non-RTCM messages.)\n");
+  fprintf(stderr, "       -v                verbose mode - displays the first 50 RTCM messages (if none arrive, it displays the first 1000 non-RTCM messages.)\n\n");
+  fprintf(stderr, "    --archive <File>     Write the RTCM messages to a seekable block-compressed\n");
+  fprintf(stderr, "                         archive as well as to stdout, optional.  The block\n");
+  fprintf(stderr, "                         index is written to <File>.idx.  Use rtcmarchive to\n");
+  fprintf(stderr, "                         read it.\n");
+  fprintf(stderr, "    --archive-dictionary <File>\n");
+  fprintf(stderr, "                         Compression dictionary for the archive, made by\n");
+  fprintf(stderr, "                         \"rtcmarchive dictionary\", default: taken from the\n");
+  fprintf(stderr, "                         first block of the stream, optional\n");
+  fprintf(stderr, "    --archive-block-size <Bytes>\n");
+  fprintf(stderr, "                         Uncompressed size of an archive block, default: %d\n",
+    DEFAULT_ARCHIVE_BLOCK_SIZE);
+  fprintf(stderr, "    --epoch-batch        Hold the messages of each epoch and send them with one\n");
+  fprintf(stderr, "                         write when the last MSM of the epoch arrives, optional\n");
+  fprintf(stderr, "    --epoch-deadline <Milliseconds>\n");
+  fprintf(stderr, "                         Longest time to hold an incomplete epoch in batching\n");
+  fprintf(stderr, "                         mode, default: %d\n", DEFAULT_EPOCH_DEADLINE);
+  fprintf(stderr, "    --allow-types <List> Only pass these message types, optional, may be repeated.\n");
+  fprintf(stderr, "                         The list is comma-separated types (1005), ranges\n");
+  fprintf(stderr, "                         (1071-1077) and groups: msm, msm1 ... msm7, ssr,\n");
+  fprintf(stderr, "                         ephemeris, station\n");
+  fprintf(stderr, "    --deny-types <List>  Drop these message types, optional, may be repeated\n");
+  fprintf(stderr, "    --type-preset <Name> msm4-only (drop all other MSMs) or no-ssr, optional\n");
+  fprintf(stderr, "    --decimate <List>=<Milliseconds>\n");
+  fprintf(stderr, "                         Send messages of these types at most once per interval\n");
+  fprintf(stderr, "                         of GNSS time, whole epochs at a time, optional, may be\n");
+  fprintf(stderr, "                         repeated, for example --decimate msm=1000\n");
+  fprintf(stderr, "    --rate <BytesPerSecond>\n");
+  fprintf(stderr, "                         Limit the output rate, holding back or dropping the\n");
+  fprintf(stderr, "                         least important messages first, optional\n");
+  fprintf(stderr, "    --burst <Bytes>      Burst size for --rate, default: one second's worth\n");
+  fprintf(stderr, "    --transcode-msm4     Rewrite MSM5, MSM6 and MSM7 messages as MSM4, optional\n");
+  fprintf(stderr, "    --strip-signals <Constellation>:<Signals>\n");
+  fprintf(stderr, "                         Remove signals from the MSMs, optional and can be\n");
+  fprintf(stderr, "                         repeated, for example gps:L5 or galileo:7I,7Q,7X\n");
+  fprintf(stderr, "    --elevation-mask <Degrees>\n");
+  fprintf(stderr, "                         Remove satellites below this elevation from the MSMs,\n");
+  fprintf(stderr, "                         optional, needs 1005/1006 and ephemerides in the input\n");
+  fprintf(stderr, "    --legacy-observations <add|replace>\n");
+  fprintf(stderr, "                         Make 1004/1012 messages from the MSMs and send them as\n");
+  fprintf(stderr, "                         well as or instead of the MSMs, optional\n");
+  fprintf(stderr, "    --dedup <Seconds>    Only send ephemerides and station messages when they\n");
+  fprintf(stderr, "                         change or this refresh interval has passed, optional\n");
+  fprintf(stderr, "    --decode-cache       Reuse the decoding of repeated station messages and\n");
+  fprintf(stderr, "                         ephemerides, optional\n");
+  fprintf(stderr, "    --metrics-socket <Path>\n");
+  fprintf(stderr, "                         Serve Prometheus metrics over HTTP on this Unix\n");
+  fprintf(stderr, "                         socket, optional\n");
+  fprintf(stderr, "    --metrics-file <File>\n");
+  fprintf(stderr, "                         Write Prometheus metrics to this file every 10 seconds,\n");
+  fprintf(stderr, "                         optional\n");
+  fprintf(stderr, "    --report-interval <Seconds>\n");
+  fprintf(stderr, "                         Interval between reports of the totals, default\n");
+  fprintf(stderr, "                         3600, optional\n");
+  fprintf(stderr, "    --latency            Measure the time from the read of each message to\n");
+  fprintf(stderr, "                         its write, optional\n");
+  fprintf(stderr, "    --stats-file <File>  Write the detailed statistics to this file with each\n");
+  fprintf(stderr, "                         report and on SIGUSR1, optional\n");
+  fprintf(stderr, "    --stage-costs        Measure the time spent scanning, checking CRCs,\n");
+  fprintf(stderr, "                         decoding and writing, optional\n");
+  fprintf(stderr, "    --flight-recorder <File>\n");
+  fprintf(stderr, "                         Record the reads and the decisions about each message\n");
+  fprintf(stderr, "                         in memory and dump them to File.<time> on SIGUSR2 or a\n");
+  fprintf(stderr, "                         burst of CRC failures, optional\n");
+  fprintf(stderr, "    --flight-recorder-ring <File>\n");
+  fprintf(stderr, "                         Keep the flight recorder in this memory-mapped file,\n");
+  fprintf(stderr, "                         optional.  The last run's ring is kept in <File>.prev\n");
+  fprintf(stderr, "    --flight-recorder-seconds <Seconds>\n");
+  fprintf(stderr, "                         History in a dump, default 60, optional\n");
+  fprintf(stderr, "    --fast-path          Only check the CRC of each message, not decode it, while\n");
+  fprintf(stderr, "                         the input is pure RTCM, optional.  Can't be used with\n");
+  fprintf(stderr, "                         --elevation-mask or --legacy-observations\n");
+  fprintf(stderr, "    --fast-path-run <Frames>\n");
+  fprintf(stderr, "                         Back-to-back good messages before the fast path\n");
+  fprintf(stderr, "                         starts, default: %d\n", DEFAULT_FAST_PATH_RUN);
   exit(rc);
 } /* usage */
 
@@ -1296,6 +1661,26 @@ static void handle_sigpipe(int sig)
 }
 #endif /* WINDOWSVERSION */
 
+#ifndef WINDOWSVERSION
+#ifdef __GNUC__
+static void handle_sigusr1(int sig __attribute__((__unused__)))
+#else /* __GNUC__ */
+static void handle_sigusr1(int sig)
+#endif /* __GNUC__ */
+{
+  sigusr1_received = 1;
+}
+
+#ifdef __GNUC__
+static void handle_sigusr2(int sig __attribute__((__unused__)))
+#else /* __GNUC__ */
+static void handle_sigusr2(int sig)
+#endif /* __GNUC__ */
+{
+  sigusr2_received = 1;
+}
+#endif /* WINDOWSVERSION */
+
 static void setup_signal_handler(int sig, void (*handler)(int))
 {
 #if _POSIX_VERSION > 198800L
@@ -8,15 +8,31 @@
 #ifndef SRC_RTCMFILTER_H_
 #define SRC_RTCMFILTER_H_
 
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <time.h>
+
 #ifndef RTKLIB_H
 #include "rtklib.h"
 #endif
 
+#include "rtcmframer.h"
+
 #ifndef TRUE
 #define TRUE -1
 #define FALSE 0
 #endif
 
+// The longest RTCM3 message - header, 1023 bytes of embedded message, CRC.
+#define MAX_RTCM_MESSAGE_LENGTH (1023 + 6)
+
+// The most entries that one writev() takes.
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 typedef struct buffer {
 	unsigned char * content;	// Space for a list of RTCM messages and/or fragments.
 	size_t length;				// length of the malloc'ed content buffer.
@@ -33,6 +49,327 @@ extern void freeBuffer(Buffer * buffer);
 extern void displayBuffer(Buffer * buffer);
 extern void displayRtcmMessage(rtcm_t * rtcm);
 extern Buffer * addMessageFragmentToBuffer(Buffer * buffer, unsigned char * fragment, size_t fragmentLength);
+
+// The messages that getRtcmFrames() finds in a buffer, ready for writev().
+// Each entry points into the input buffer or into the list's own store, which
+// holds the messages that were completed from a fragment carried over from
+// the last buffer or rewritten by a filter.  Back-to-back messages in the
+// input share an entry.  When latency is being measured, the time of the read
+// that completed each message is kept as well, one per message in order.
+typedef struct frameList {
+	struct iovec * frames;
+	int count;
+	int capacity;
+	size_t length;				// Total length of the messages.
+	int messages;				// Number of messages.
+	struct timespec * readTimes;
+	int readTimesCapacity;
+	unsigned char * store;
+	size_t storeLength;
+	size_t storeCapacity;
+} FrameList;
+
+// The framer that getRtcmFrames() shares with librtcmfilter (framer.c).  The
+// frame handler returns FALSE if the frame is bad, and the scan goes on from
+// the next byte.  The others may be NULL.
+typedef struct framerHandlers {
+	int (*frame)(const unsigned char * frame, size_t length, size_t position, int inCarry, void * context);
+	void (*skipped)(size_t length, size_t position, void * context);
+	void (*carried)(size_t carried, size_t position, void * context);
+} FramerHandlers;
+
+extern RtcmFramer * createFramer(const FramerHandlers * handlers, void * context);
+
+extern FrameList * getRtcmFrames(Buffer inputBuffer, rtcm_t * rtcm);
 extern Buffer * getRtcmDataBlocks(Buffer inputBuffer, rtcm_t * rtcm);
+extern void resetFraming();
+
+#define DEFAULT_REPORT_INTERVAL 3600	// seconds
+
+extern void resetTotals();
+extern void displayTotals();
+extern int setReportInterval(long seconds);
+extern long getReportTimeout();
+extern void serviceReports();
+extern void setStatsFile(const char * path);
+extern void writeStats(FILE * out);
+extern void writeStatsFile();
+
+// Header-only message metadata (metadata.c).
+
+typedef struct messageMetadata {
+	unsigned int type;
+	unsigned int stationID;
+	int system;					// Constellation (SYS_GPS etc) of an MSM or ephemeris, else SYS_NONE.
+	int hasEpoch;				// TRUE for observation messages.
+	uint32_t epoch;				// GPS time of week, milliseconds - see sameEpoch().
+	unsigned int sync;			// Multiple message bit - 1 if more messages follow for this epoch.
+	unsigned int iods;			// MSM issue of data station.
+	unsigned int satellites;	// Number of satellites in an observation message.
+	unsigned int signals;		// Number of signals in an MSM.
+	unsigned int cells;			// Number of cells in an MSM.
+	unsigned int satellite;		// Satellite (PRN) of an ephemeris.
+	unsigned int iode;			// Issue of data of an ephemeris.
+} MessageMetadata;
+
+extern int isMsmMessage(unsigned int type);
+extern int getMsmSystem(unsigned int type);
+extern int sameEpoch(uint32_t epoch1, uint32_t epoch2);
+extern int getMessageMetadata(const unsigned char * message, size_t length, MessageMetadata * metadata);
+extern gtime_t getEpochTime(uint32_t epoch, gtime_t reference);
+extern gtime_t getMessageTime(const MessageMetadata * metadata, gtime_t reference);
+extern void displayMessageMetadata(const MessageMetadata * metadata);
+
+// The metrics registry and its Prometheus export (metrics.c).
+
+extern void countRead(size_t length);
+extern void countFrame(unsigned int type, size_t length);
+extern void countCrcFailure();
+extern void countDecodeFailure();
+extern void countBytesEaten(size_t length);
+extern void countShaperDeferred(int priority);
+extern void countShaperDropped(int priority, size_t length);
+extern void countShaperSent(size_t length);
+extern void setShaperLevels(double tokens, size_t waiting);
+extern unsigned long getFrameCount(unsigned int type);
+extern unsigned long getFailureCount();
+extern void writeMetrics(FILE * out);
+extern void setMetricsSocket(const char * path);
+extern void setMetricsFile(const char * path);
+extern int startMetricsExport();
+extern void closeMetrics();
+
+// Read-to-write latency histograms (latency.c).
+
+extern void setLatencyMeasurement();
+extern int measuringLatency();
+extern void noteRead();
+extern void getReadTime(struct timespec * readTime);
+extern int latencyWritten(const unsigned char * messages, size_t length, const struct timespec * readTimes);
+extern void writeLatencyStats(FILE * out);
+extern void resetLatencyTotals();
+extern void displayLatencyTotals();
+
+// The time spent in each stage of processing (stagecost.c).
+
+#define STAGE_NONE 0
+#define STAGE_SCAN 1			// Looking for the start of a frame.
+#define STAGE_CRC 2
+#define STAGE_DECODE 3
+#define STAGE_PROCESS 4			// Filtering and rewriting a frame.
+#define STAGE_OUTPUT 5
+#define NUMBER_OF_STAGES 6
+
+extern int stageCosting;
+#define ENTER_STAGE(stage) do { if (stageCosting) enterStage(stage); } while (0)
+
+extern void setStageCosting();
+extern void enterStage(int stage);
+extern void enterDecodeStage(unsigned int type, size_t length);
+extern void countStage(int stage, unsigned long frames, size_t bytes);
+extern unsigned long countFramesWritten(const unsigned char * messages, size_t length);
+extern void writeCostStats(FILE * out);
+extern void resetStageCostTotals();
+
+// The flight recorder (flightrecorder.c).
+
+#define FLIGHT_RECORDER_MAGIC "RTCMFR1"
+#define FLIGHT_RECORDER_SIZE (4 * 1024 * 1024)
+#define DEFAULT_FLIGHT_RECORDER_SECONDS 60
+
+// Kinds of record.
+#define FR_PADDING 0
+#define FR_READ 1				// value is the length, the payload is the data.
+#define FR_STATE 2				// detail is the new state, value the position.
+#define FR_FRAME 3				// detail is the decision, value the type, the payload a FlightFrame.
+#define FR_EATEN 4				// value is the number of bytes.
+#define FR_FRAGMENT 5			// value is the length carried over.
+#define FR_WRITE 6				// value is the length written.
+#define FR_DUMP 7				// the payload is the reason.
+
+// Decisions about frames.
+#define FR_PASSED 0
+#define FR_CRC_FAILURE 1
+#define FR_DECODE_FAILURE 2
+#define FR_FILTERED 3			// By type, decimation or deduplication.
+#define FR_REPLACED 4			// By legacy observations.
+#define FR_NO_SIGNALS 5			// All signals stripped.
+#define FR_BELOW_MASK 6			// All satellites below the elevation mask.
+
+typedef struct flightRecorderHeader {
+	char magic[8];
+	uint64_t size;				// Bytes of records following the header.
+	uint64_t head;				// Where the next record goes.
+	uint64_t tail;				// The oldest record.
+	int64_t empty;
+	int64_t wallClockOffset;	// Added to a monotonic time gives the UTC time, nanoseconds.
+} FlightRecorderHeader;
+
+typedef struct flightRecord {
+	uint64_t nanoseconds;		// CLOCK_MONOTONIC.
+	uint16_t length;			// Of the record, including this header, a multiple of 8.
+	uint8_t kind;
+	uint8_t detail;
+	uint32_t value;
+} FlightRecord;
+
+typedef struct flightFrame {
+	uint32_t position;			// In the buffer being processed.
+	uint16_t length;
+	int8_t status;				// From the decoder.
+	uint8_t unused;
+} FlightFrame;
+
+extern int setFlightRecorder(const char * path, const char * ringPath, long seconds);
+extern int flightRecording();
+extern void recordRead(const unsigned char * data, size_t length);
+extern void recordState(unsigned int state, size_t position);
+extern void recordFrame(int decision, unsigned int type, size_t position, size_t length, int status);
+extern void recordEaten(size_t length);
+extern void recordFragment(size_t length);
+extern void recordWrite(size_t length);
+extern void dumpFlightRecorder(const char * reason);
+extern int readFlightRecords(const char * path, void (* handle)(const FlightRecorderHeader * header,
+		const FlightRecord * record));
+extern void displayFlightRecorderTotals();
+
+// Caching the decoding of station messages and ephemerides (decodecache.c).
+
+extern void setDecodeCaching();
+extern int decodeRtcmFrame(rtcm_t * rtcm);
+extern int decode_rtcm3(rtcm_t * rtcm);
+extern void resetDecodeCacheTotals();
+extern void displayDecodeCacheTotals();
+
+// The fast path for streams that are already pure RTCM (fastpath.c).
+
+#define DEFAULT_FAST_PATH_RUN 32	// frames
+
+extern void setFastPath(unsigned long frames);
+extern int inFastPath();
+extern int fastPathCheck(const unsigned char * frame, size_t length);
+extern void fastPathFrame(size_t length);
+extern void fastPathLost();
+extern void resetFastPathTotals();
+extern void writeFastPathStats(FILE * out);
+extern void displayFastPathTotals();
+
+// Allow and deny lists of message types (typefilter.c).
+
+extern int parseMessageTypes(const char * list, uint64_t * bitmap);
+extern int allowMessageTypes(const char * list);
+extern int denyMessageTypes(const char * list);
+extern int applyMessageTypePreset(const char * name);
+extern int messageTypeAllowed(unsigned int type);
+extern void resetTypeFilterTotals();
+extern void displayTypeFilterTotals();
+
+// Decimation by epoch time (decimate.c).
+
+extern int addDecimation(const char * argument);
+extern int decimationAllows(const MessageMetadata * metadata);
+extern void resetDecimationTotals();
+extern void displayDecimationTotals();
+
+// Suppressing repeated ephemerides and station messages (dedup.c).
+
+extern int setDeduplication(double seconds);
+extern int deduplicationAllows(const unsigned char * message, size_t length, const MessageMetadata * metadata);
+extern void resetDeduplicationTotals();
+extern void displayDeduplicationTotals();
+
+// Rewriting MSM messages (msm.c).
+
+extern int getMsmLevel(unsigned int type);
+extern size_t finishMsmMessage(unsigned char * output, int position);
+extern size_t makeEpochTerminator(const unsigned char * message, size_t length, unsigned char * output);
+extern void setEpochSync(unsigned char * message, size_t length, int sync);
+extern size_t transcodeToMsm4(const unsigned char * message, size_t length, unsigned char * output);
+extern void setMsmTranscoding();
+extern size_t transcodeMessage(const unsigned char * message, size_t length, unsigned char * output);
+extern int addSignalStripping(const char * argument);
+extern long stripMsmSignals(const unsigned char * message, size_t length, uint32_t signals,
+		unsigned char * output);
+extern long removeMsmSatellites(const unsigned char * message, size_t length, uint64_t satellites,
+		unsigned char * output);
+extern int stripMessage(const unsigned char * message, size_t length, unsigned char * output,
+		size_t * outputLength);
+extern int signalStripped(int system, unsigned char code);
+extern void displayStripTotals();
+extern void displayTranscodeTotals();
+
+// Removing satellites below an elevation mask (elevation.c).
+
+extern int setElevationMask(double degrees);
+extern int pruneLowSatellites(const unsigned char * message, size_t length, const rtcm_t * rtcm,
+		unsigned char * output, size_t * outputLength);
+extern int belowElevationMask(const rtcm_t * rtcm, int sat, gtime_t time);
+extern void displayElevationTotals();
+extern void keplerPosition(gtime_t time, const eph_t * eph, int system, int prn, double * rs);
+extern void glonassPosition(gtime_t time, const geph_t * geph, double * rs);
+
+// Legacy observation messages made from MSM epochs (legacy.c).
+
+extern int setLegacyObservations(const char * mode);
+extern int legacyReplacesMsm(unsigned int type);
+extern size_t makeLegacyObservations(const rtcm_t * decoder, unsigned char * output);
+extern void countReplacedMsm();
+extern void displayLegacyTotals();
+
+// Token bucket rate limiting (shaper.c).
+
+extern int setShaping(long bytesPerSecond, long burstSize);
+#define SHAPER_PRIORITIES 4
+
+extern int shapingOutput();
+extern size_t getShaperBurst();
+extern const char * getShaperPriorityName(int priority);
+extern void shapeMessage(const unsigned char * message, size_t length, unsigned int type,
+		const struct timespec * readTime);
+extern size_t takeShapedMessages(unsigned char * output, struct timespec * readTimes, int * taken);
+extern long getShaperTimeout();
+extern void displayShaperTotals();
+
+// Output, with optional epoch batching (output.c).
+
+#define DEFAULT_EPOCH_DEADLINE 50	// milliseconds
+
+extern void setEpochBatching(long deadline);
+extern void writeOutput(Buffer * buffer);
+extern void writeFrames(FrameList * list);
+extern long getOutputTimeout();
+extern void serviceOutput();
+extern void closeOutput();
+extern void displayOutputTotals();
+
+// The block-compressed archive (archive.c).
+
+#define DEFAULT_ARCHIVE_BLOCK_SIZE (64 * 1024)
+
+typedef struct archiveIndexEntry {
+	uint64_t offset;			// Position of the compressed block in the archive file.
+	uint32_t compressedLength;
+	uint32_t rawLength;
+	uint32_t messages;			// Number of RTCM messages in the block.
+	int64_t firstEpoch;			// GPS time of the first epoch in the block, milliseconds.
+	int64_t lastEpoch;			// GPS time of the last epoch in the block, milliseconds.
+} ArchiveIndexEntry;
+
+typedef struct archiveReader {
+	int file;
+	unsigned char * dictionary;
+	size_t dictionaryLength;
+	ArchiveIndexEntry * index;
+	size_t blocks;				// Number of entries in the index.
+} ArchiveReader;
+
+extern int64_t getEpochMilliseconds(gtime_t time);
+extern int openArchive(const char * path, const char * dictionaryPath, size_t blockSize);
+extern void archiveMessage(const unsigned char * message, size_t length, const MessageMetadata * metadata);
+extern void closeArchive();
+extern void displayArchiveTotals();
+extern int openArchiveReader(const char * path, ArchiveReader * reader);
+extern void closeArchiveReader(ArchiveReader * reader);
+extern unsigned char * readArchiveBlock(ArchiveReader * reader, const ArchiveIndexEntry * entry);
 
 #endif /* SRC_RTCMFILTER_H_ */
@@ -0,0 +1,94 @@
+/*
+ * rtcmflight.c
+ *
+ * Prints the flight recorder dumps written by the filter's --flight-recorder
+ * option, or the ring file written by --flight-recorder-ring.
+ *
+ *     rtcmflight [-x] <file>
+ *
+ * Each record is printed on a line with its UTC time to the microsecond.
+ * With -x, the data of each read is printed in hex as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtcmfilter.h"
+
+static const char * decisionNames[] = {
+	"passed", "crc failure", "decode failure", "filtered", "replaced by legacy",
+	"no signals left", "below elevation mask"
+};
+
+static int showData = FALSE;
+
+static void usage(char * name) {
+	fprintf(stderr, "usage: %s [-x] <file>\n", name);
+	exit(1);
+}
+
+static void printRecord(const FlightRecorderHeader * header, const FlightRecord * record) {
+	int64_t nanoseconds = (int64_t) record->nanoseconds + header->wallClockOffset;
+	time_t seconds = nanoseconds / 1000000000;
+	struct tm * tm = gmtime(&seconds);
+	printf("%04d/%02d/%02d %02d:%02d:%02d.%06ld ",
+			tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec,
+			(long) (nanoseconds % 1000000000 / 1000));
+
+	const unsigned char * payload = (const unsigned char *) (record + 1);
+	switch (record->kind) {
+	case FR_READ:
+		printf("read %u bytes\n", record->value);
+		if (showData) {
+			for (uint32_t i = 0; i < record->value; i++) {
+				printf(i % 32 == 0 ? "    %02x" : i % 32 == 31 ? " %02x\n" : " %02x", payload[i]);
+			}
+			if (record->value % 32 != 0) {
+				putchar('\n');
+			}
+		}
+		break;
+	case FR_STATE:
+		printf("state %s at %u\n", record->detail == 0 ? "eating" : "processing RTCM message",
+				record->value);
+		break;
+	case FR_FRAME: {
+		FlightFrame frame;
+		memcpy(&frame, payload, sizeof(frame));
+		const char * decision = record->detail < sizeof(decisionNames) / sizeof(decisionNames[0])
+				? decisionNames[record->detail] : "unknown decision";
+		printf("frame type %u length %u at %u status %d - %s\n",
+				record->value, frame.length, frame.position, frame.status, decision);
+		break;
+	}
+	case FR_EATEN:
+		printf("%u bytes eaten\n", record->value);
+		break;
+	case FR_FRAGMENT:
+		printf("fragment of %u bytes carried over\n", record->value);
+		break;
+	case FR_WRITE:
+		printf("wrote %u bytes\n", record->value);
+		break;
+	case FR_DUMP:
+		printf("dump (%.*s)\n", (int) (record->length - sizeof(FlightRecord)), (const char *) payload);
+		break;
+	default:
+		printf("unknown record kind %d\n", record->kind);
+		break;
+	}
+}
+
+int main(int argc, char ** argv) {
+	int arg = 1;
+	if (arg < argc && strcmp(argv[arg], "-x") == 0) {
+		showData = TRUE;
+		arg++;
+	}
+	if (arg != argc - 1) {
+		usage(argv[0]);
+	}
+	return readFlightRecords(argv[arg], printRecord) ? 0 : 1;
+}
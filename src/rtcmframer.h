@@ -0,0 +1,78 @@
+/*
+ * rtcmframer.h
+ *
+ * The C API of librtcmfilter, which finds the RTCM3 frames in a stream of
+ * bytes for programs that want to do the filtering in-process rather than
+ * pipe the data through the rtcmfilter program.
+ *
+ * The caller pushes the bytes as they arrive, in spans of any size.  Each
+ * frame that passes the CRC check is handed to a callback with its message
+ * type, station ID and epoch.  Anything else - NMEA, UBX, noise, frames that
+ * fail the CRC check - is discarded.
+ *
+ *     static void onFrame(const unsigned char * frame, size_t length, unsigned int type,
+ *             unsigned int stationID, int64_t epoch, void * context) {
+ *         fwrite(frame, 1, length, (FILE *) context);
+ *     }
+ *
+ *     RtcmFramer * framer = rtcmFramerCreate(onFrame, stdout);
+ *     while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+ *         rtcmFramerPush(framer, buffer, n);
+ *     }
+ *     rtcmFramerDestroy(framer);
+ *
+ * Nothing is copied unless a frame is split across pushes.  The frame given
+ * to the callback points into the span being pushed, or into the framer's
+ * own buffer if the frame started in an earlier push, so it's only valid
+ * until the callback returns.  The callback must not push to or destroy the
+ * framer that called it.
+ *
+ * Each framer is independent, so a program can run one per stream, but a
+ * framer must only be used by one thread at a time.
+ *
+ * Link with -lrtcmfilter -lm.  The C++ wrapper is in rtcmframer.hpp.
+ */
+
+#ifndef SRC_RTCMFRAMER_H_
+#define SRC_RTCMFRAMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rtcmFramer RtcmFramer;
+
+// The callback for each frame, including the three-byte header and the CRC.
+// The epoch is the time of an observation message in milliseconds of the
+// GPS week, whatever the constellation, or -1 for other messages.
+typedef void (*RtcmFrameCallback)(const unsigned char * frame, size_t length, unsigned int type,
+		unsigned int stationID, int64_t epoch, void * context);
+
+typedef struct rtcmFramerCounts {
+	unsigned long frames;				// Frames handed to the callback.
+	unsigned long crcFailures;			// Frames that failed the CRC check.
+	unsigned long long bytesDiscarded;	// Bytes that were not part of a good frame.
+} RtcmFramerCounts;
+
+// rtcmFramerCreate returns a new framer, or NULL if there's no memory.
+extern RtcmFramer * rtcmFramerCreate(RtcmFrameCallback callback, void * context);
+
+// rtcmFramerPush scans the next span of the stream and calls the callback
+// for each frame that's completed.
+extern void rtcmFramerPush(RtcmFramer * framer, const unsigned char * data, size_t length);
+
+// rtcmFramerReset discards a partial frame, for example after reconnecting.
+extern void rtcmFramerReset(RtcmFramer * framer);
+
+extern void rtcmFramerGetCounts(const RtcmFramer * framer, RtcmFramerCounts * counts);
+
+extern void rtcmFramerDestroy(RtcmFramer * framer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_RTCMFRAMER_H_ */
@@ -0,0 +1,94 @@
+/*
+ * rtcmframer.hpp
+ *
+ * A C++ wrapper for the librtcmfilter framer in rtcmframer.h.
+ *
+ *     rtcmfilter::Framer framer([&](const unsigned char * frame, size_t length,
+ *             unsigned int type, unsigned int stationID, int64_t epoch) {
+ *         caster.send(frame, length);
+ *     });
+ *     framer.push(buffer, n);
+ *
+ * The frame is only valid during the callback, as in the C API.  If the
+ * callback throws, the rest of the span is scanned without calling it again
+ * and the exception is rethrown from push().
+ */
+
+#ifndef SRC_RTCMFRAMER_HPP_
+#define SRC_RTCMFRAMER_HPP_
+
+#include <exception>
+#include <functional>
+#include <new>
+#include <vector>
+
+#include "rtcmframer.h"
+
+namespace rtcmfilter {
+
+class Framer {
+public:
+	typedef std::function<void(const unsigned char * frame, size_t length, unsigned int type,
+			unsigned int stationID, int64_t epoch)> Callback;
+
+	explicit Framer(Callback callback)
+			: callback_(callback), framer_(rtcmFramerCreate(&Framer::onFrame, this)) {
+		if (framer_ == NULL) {
+			throw std::bad_alloc();
+		}
+	}
+
+	~Framer() {
+		rtcmFramerDestroy(framer_);
+	}
+
+	Framer(const Framer &) = delete;
+	Framer & operator=(const Framer &) = delete;
+
+	void push(const unsigned char * data, size_t length) {
+		rtcmFramerPush(framer_, data, length);
+		if (error_) {
+			std::exception_ptr error = error_;
+			error_ = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+
+	void push(const std::vector<unsigned char> & data) {
+		push(data.data(), data.size());
+	}
+
+	void reset() {
+		rtcmFramerReset(framer_);
+	}
+
+	RtcmFramerCounts counts() const {
+		RtcmFramerCounts counts;
+		rtcmFramerGetCounts(framer_, &counts);
+		return counts;
+	}
+
+private:
+	// Exceptions mustn't unwind through the C code, so they're caught here
+	// and rethrown by push().
+	static void onFrame(const unsigned char * frame, size_t length, unsigned int type,
+			unsigned int stationID, int64_t epoch, void * context) {
+		Framer * self = static_cast<Framer *>(context);
+		if (self->error_) {
+			return;
+		}
+		try {
+			self->callback_(frame, length, type, stationID, epoch);
+		} catch (...) {
+			self->error_ = std::current_exception();
+		}
+	}
+
+	Callback callback_;
+	RtcmFramer * framer_;
+	std::exception_ptr error_;
+};
+
+}
+
+#endif /* SRC_RTCMFRAMER_HPP_ */
@@ -0,0 +1,44 @@
+/*
+ * rtcmframes.cpp
+ *
+ * Lists the RTCM3 frames in a stream, using the C++ wrapper of
+ * librtcmfilter - an example of embedding the framer.
+ *
+ *     rtcmframes [<file>]
+ *
+ * Reads the file, or stdin if there isn't one, and prints the type, station
+ * ID, epoch (milliseconds of the GPS week, or -1) and length of each frame,
+ * then the totals.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "rtcmframer.hpp"
+
+int main(int argc, char ** argv) {
+	if (argc > 2) {
+		std::fprintf(stderr, "usage: %s [<file>]\n", argv[0]);
+		return 1;
+	}
+	std::FILE * in = argc == 2 ? std::fopen(argv[1], "rb") : stdin;
+	if (in == NULL) {
+		std::perror(argv[1]);
+		return 1;
+	}
+
+	rtcmfilter::Framer framer([](const unsigned char *, size_t length, unsigned int type,
+			unsigned int stationID, int64_t epoch) {
+		std::printf("%4u %4u %10lld %4zu\n", type, stationID, (long long) epoch, length);
+	});
+
+	unsigned char buffer[4096];
+	size_t n;
+	while ((n = std::fread(buffer, 1, sizeof(buffer), in)) > 0) {
+		framer.push(buffer, n);
+	}
+	RtcmFramerCounts counts = framer.counts();
+	std::printf("%lu frames, %lu CRC failures, %llu bytes discarded\n",
+			counts.frames, counts.crcFailures, counts.bytesDiscarded);
+	return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * rtcmgen.c
+ *
+ * Generates a synthetic receiver stream for testing and benchmarking the
+ * filter, and writes it to stdout.
+ *
+ *     rtcmgen [-e epochs] [-r rate] [-m 4|7] [-c constellations] [-n nmea]
+ *             [-u ubx] [-z noise] [-f fakes] [-s seed]
+ *
+ *     -e  the number of epochs, default 600
+ *     -r  epochs per second, default 1
+ *     -m  the MSM level, 4 or 7, default 7
+ *     -c  the constellations, any of G (GPS), E (Galileo) and C (BeiDou),
+ *         default GEC
+ *     -n  NMEA sentences per epoch, default 0
+ *     -u  UBX frames per epoch, default 0
+ *     -z  bytes of random noise per epoch, default 0
+ *     -f  fake RTCM3 preambles (0xd3 followed by garbage) per epoch, default 0
+ *     -s  the seed for the random numbers, default 1
+ *
+ * Each epoch has an MSM for each constellation, with the multiple message
+ * bit set on all but the last.  Once a second there's a 1005 and the GPS
+ * ephemeris (1019) of the next satellite in turn, and every ten seconds a
+ * 1033.  The NMEA sentences, UBX frames, noise and fake preambles are
+ * scattered between the RTCM messages of each epoch.  The same seed always
+ * produces the same stream.
+ *
+ * The RTKLIB in this tree is built for GPS only, so the Galileo and BeiDou
+ * MSMs are made from the GPS one by changing the message type and, for
+ * BeiDou, the epoch time.  They carry the GPS satellites and signals, which
+ * is good enough to exercise the filter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rtcmfilter.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+#define NUMBER_OF_SATELLITES 12
+#define MILLISECONDS_IN_WEEK 604800000
+#define BEIDOU_LEAP_MILLISECONDS 14000
+#define MAX_RTCM_PIECES 6		// An MSM for each constellation, 1005, 1019 and 1033.
+
+typedef struct constellation {
+	char letter;
+	int firstMsmType;		// The type of MSM1.
+	int epochOffset;		// Milliseconds to add to the GPS epoch time.
+} Constellation;
+
+static const Constellation constellations[] = {
+	{'G', 1071, 0},
+	{'E', 1091, 0},
+	{'C', 1121, -BEIDOU_LEAP_MILLISECONDS},
+};
+
+static void usage(char * name) {
+	fprintf(stderr, "usage: %s [-e epochs] [-r rate] [-m 4|7] [-c constellations] [-n nmea]\n", name);
+	fprintf(stderr, "        [-u ubx] [-z noise] [-f fakes] [-s seed]\n");
+	exit(1);
+}
+
+static unsigned int randomByte() {
+	return rand() & 0xff;
+}
+
+// finishFrame sets the CRC of the RTCM3 frame in the buffer.
+static void finishFrame(unsigned char * frame, size_t length) {
+	unsigned int crc = rtk_crc24q(frame, length - LENGTH_OF_CRC);
+	setbitu(frame, (length - LENGTH_OF_CRC) * 8, 24, crc);
+}
+
+// The generated content of one epoch, a list of RTCM messages and junk.
+typedef struct piece {
+	unsigned char * data;
+	size_t length;
+} Piece;
+
+// The list is sized from the options to hold the RTCM messages and junk of an
+// epoch.
+static Piece * pieces = NULL;
+static int piecesCapacity = 0;
+static int numberOfPieces = 0;
+
+static void addPiece(const unsigned char * data, size_t length) {
+	if (numberOfPieces >= piecesCapacity) {
+		fprintf(stderr, "ERROR: more than %d pieces in an epoch\n", piecesCapacity);
+		exit(1);
+	}
+	pieces[numberOfPieces].data = malloc(length);
+	memcpy(pieces[numberOfPieces].data, data, length);
+	pieces[numberOfPieces].length = length;
+	numberOfPieces++;
+}
+
+static void addRtcm(rtcm_t * rtcm, int type, int sync) {
+	if (gen_rtcm3(rtcm, type, sync)) {
+		addPiece(rtcm->buff, rtcm->nbyte);
+	}
+}
+
+// addRetypedMsm adds a copy of the MSM in the rtcm buffer as another
+// constellation's MSM.
+static void addRetypedMsm(rtcm_t * rtcm, int type, int epochOffset, int sync) {
+	unsigned char frame[MAX_RTCM_MESSAGE_LENGTH];
+	size_t length = rtcm->nbyte;
+	memcpy(frame, rtcm->buff, length);
+	setbitu(frame, 24, 12, type);
+	if (epochOffset != 0) {
+		long epoch = (long) getbitu(frame, 48, 30) + epochOffset;
+		setbitu(frame, 48, 30, (epoch + MILLISECONDS_IN_WEEK) % MILLISECONDS_IN_WEEK);
+	}
+	setbitu(frame, 78, 1, sync);
+	finishFrame(frame, length);
+	addPiece(frame, length);
+}
+
+static void addNmea(gtime_t time, int count) {
+	double ep[6];
+	char sentence[128];
+	char body[112];
+	time2epoch(time, ep);
+	if (count % 2 == 0) {
+		snprintf(body, sizeof(body),
+				"GNGGA,%02d%02d%05.2f,5130.%04d,N,00010.%04d,W,4,12,0.8,45.0,M,47.0,M,1.0,0000",
+				(int) ep[3], (int) ep[4], ep[5], rand() % 10000, rand() % 10000);
+	} else {
+		snprintf(body, sizeof(body), "GNRMC,%02d%02d%05.2f,A,5130.%04d,N,00010.%04d,W,0.01,,%02d%02d%02d,,,R",
+				(int) ep[3], (int) ep[4], ep[5], rand() % 10000, rand() % 10000,
+				(int) ep[2], (int) ep[1], (int) ep[0] % 100);
+	}
+	unsigned char checksum = 0;
+	for (char * p = body; *p; p++) {
+		checksum ^= *p;
+	}
+	int length = snprintf(sentence, sizeof(sentence), "$%s*%02X\r\n", body, checksum);
+	addPiece((unsigned char *) sentence, length);
+}
+
+// addUbx adds a UBX frame - a NAV-PVT or a NAV-SAT with random content.
+static void addUbx(int count) {
+	unsigned char frame[8 + 8 + 12 * NUMBER_OF_SATELLITES];
+	int payloadLength = count % 2 == 0 ? 92 : 8 + 12 * NUMBER_OF_SATELLITES;
+	frame[0] = 0xb5;
+	frame[1] = 0x62;
+	frame[2] = 0x01;
+	frame[3] = count % 2 == 0 ? 0x07 : 0x35;
+	frame[4] = payloadLength & 0xff;
+	frame[5] = payloadLength >> 8;
+	for (int i = 0; i < payloadLength; i++) {
+		frame[6 + i] = randomByte();
+	}
+	unsigned char a = 0;
+	unsigned char b = 0;
+	for (int i = 2; i < 6 + payloadLength; i++) {
+		a += frame[i];
+		b += a;
+	}
+	frame[6 + payloadLength] = a;
+	frame[7 + payloadLength] = b;
+	addPiece(frame, 8 + payloadLength);
+}
+
+static void addNoise(int length) {
+	unsigned char noise[length];
+	for (int i = 0; i < length; i++) {
+		noise[i] = randomByte();
+	}
+	addPiece(noise, length);
+}
+
+// addFakePreamble adds a 0xd3 followed by a plausible header and a few bytes
+// of garbage, which the filter has to reject and rescan.
+static void addFakePreamble() {
+	unsigned char fake[16];
+	int length = 4 + rand() % (sizeof(fake) - 4);
+	fake[0] = 0xd3;
+	fake[1] = 0;
+	fake[2] = randomByte();
+	for (int i = 3; i < length; i++) {
+		fake[i] = randomByte();
+	}
+	addPiece(fake, length);
+}
+
+// setObservations fills the observations of an epoch.
+static void setObservations(rtcm_t * rtcm, gtime_t time, double seconds) {
+	rtcm->time = time;
+	rtcm->obs.n = 0;
+	for (int s = 1; s <= NUMBER_OF_SATELLITES; s++) {
+		obsd_t * obs = rtcm->obs.data + rtcm->obs.n++;
+		memset(obs, 0, sizeof(*obs));
+		obs->time = time;
+		obs->sat = satno(SYS_GPS, s * 2);
+		double rate = -800.0 + 130.0 * s;
+		double range = 2.0e7 + s * 1.0e5 + rate * seconds;
+		obs->P[0] = range;
+		obs->L[0] = range / (CLIGHT / FREQ1);
+		obs->D[0] = -rate / (CLIGHT / FREQ1);
+		obs->SNR[0] = (30 + s) * 4;
+		obs->code[0] = CODE_L1C;
+		obs->P[1] = range + 3.0;
+		obs->L[1] = range / (CLIGHT / FREQ2);
+		obs->D[1] = -rate / (CLIGHT / FREQ2);
+		obs->SNR[1] = (25 + s) * 4;
+		obs->code[1] = CODE_L2W;
+	}
+}
+
+// setEphemeris fills a plausible GPS ephemeris for a satellite.
+static void setEphemeris(rtcm_t * rtcm, int sat, gtime_t time) {
+	eph_t * eph = rtcm->nav.eph + sat - 1;
+	int week;
+	double tow = time2gpst(time, &week);
+	memset(eph, 0, sizeof(*eph));
+	eph->sat = sat;
+	eph->iode = eph->iodc = (int) (tow / 7200) % 256;
+	eph->week = week;
+	eph->toes = (int) (tow / 7200) * 7200;
+	eph->toe = eph->toc = gpst2time(week, eph->toes);
+	eph->A = 26560.0e3 * 26560.0e3;
+	eph->e = 0.001 * (sat % 10 + 1);
+	eph->i0 = 0.96;
+	eph->OMG0 = 0.1 * sat;
+	eph->omg = 0.5;
+	eph->M0 = 0.2 * sat;
+	eph->deln = 4.5e-9;
+	eph->OMGd = -8.0e-9;
+	eph->f0 = 1.0e-5;
+	eph->tgd[0] = -1.0e-8;
+}
+
+int main(int argc, char ** argv) {
+	int epochs = 600;
+	int rate = 1;
+	int msmLevel = 7;
+	const char * wanted = "GEC";
+	int nmea = 0;
+	int ubx = 0;
+	int noise = 0;
+	int fakes = 0;
+	unsigned int seed = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "e:r:m:c:n:u:z:f:s:")) != -1) {
+		switch (opt) {
+		case 'e': epochs = atoi(optarg); break;
+		case 'r': rate = atoi(optarg); break;
+		case 'm': msmLevel = atoi(optarg); break;
+		case 'c': wanted = optarg; break;
+		case 'n': nmea = atoi(optarg); break;
+		case 'u': ubx = atoi(optarg); break;
+		case 'z': noise = atoi(optarg); break;
+		case 'f': fakes = atoi(optarg); break;
+		case 's': seed = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || epochs < 0 || rate < 1 || (msmLevel != 4 && msmLevel != 7)
+			|| nmea < 0 || ubx < 0 || noise < 0 || fakes < 0) {
+		usage(argv[0]);
+	}
+
+	const Constellation * chosen[sizeof(constellations) / sizeof(constellations[0])];
+	int numberChosen = 0;
+	for (size_t i = 0; i < sizeof(constellations) / sizeof(constellations[0]); i++) {
+		if (strchr(wanted, constellations[i].letter) != NULL) {
+			chosen[numberChosen++] = constellations + i;
+		}
+	}
+	if (numberChosen == 0) {
+		usage(argv[0]);
+	}
+
+	// The junk of an epoch is scattered between its messages.
+	long junkPieces = (long) nmea + ubx + (noise > 0) + fakes;
+	if (junkPieces > 1000000) {
+		fprintf(stderr, "ERROR: too much junk per epoch - at most 1000000 pieces\n");
+		usage(argv[0]);
+	}
+	piecesCapacity = MAX_RTCM_PIECES + junkPieces;
+	pieces = malloc(piecesCapacity * sizeof(Piece));
+	int * before = malloc((junkPieces > 0 ? junkPieces : 1) * sizeof(int));
+
+	srand(seed);
+	rtcm_t * rtcm = malloc(sizeof(rtcm_t));
+	init_rtcm(rtcm);
+	rtcm->staid = 42;
+	rtcm->sta.pos[0] = 3978000.0;
+	rtcm->sta.pos[1] = -1300.0;
+	rtcm->sta.pos[2] = 4968000.0;
+	strcpy(rtcm->sta.antdes, "TRM59800.00");
+	strcpy(rtcm->sta.rectype, "SEPT POLARX5");
+	strcpy(rtcm->sta.recver, "5.4.0");
+	strcpy(rtcm->sta.recsno, "3001234");
+
+	double startTime[] = {2026, 10, 18, 12, 0, 0};
+	gtime_t start = epoch2time(startTime);
+	int nextEphemeris = 0;
+
+	for (int epoch = 0; epoch < epochs; epoch++) {
+		double seconds = (double) epoch / rate;
+		gtime_t time = timeadd(start, seconds);
+
+		setObservations(rtcm, time, seconds);
+		numberOfPieces = 0;
+
+		// Make the GPS MSM, then copy it for the other constellations.
+		gen_rtcm3(rtcm, 1070 + msmLevel, 0);
+		for (int i = 0; i < numberChosen; i++) {
+			addRetypedMsm(rtcm, chosen[i]->firstMsmType - 1 + msmLevel, chosen[i]->epochOffset,
+					i < numberChosen - 1);
+		}
+
+		if (epoch % rate == 0) {
+			addRtcm(rtcm, 1005, 0);
+			int sat = rtcm->obs.data[nextEphemeris].sat;
+			setEphemeris(rtcm, sat, time);
+			rtcm->ephsat = sat;
+			addRtcm(rtcm, 1019, 0);
+			nextEphemeris = (nextEphemeris + 1) % NUMBER_OF_SATELLITES;
+			if (epoch % (10 * rate) == 0) {
+				addRtcm(rtcm, 1033, 0);
+			}
+		}
+
+		// Scatter the junk between the messages.
+		int rtcmPieces = numberOfPieces;
+		int junk = junkPieces;
+		for (int i = 0; i < nmea; i++) {
+			addNmea(time, i);
+		}
+		for (int i = 0; i < ubx; i++) {
+			addUbx(i);
+		}
+		if (noise > 0) {
+			addNoise(noise);
+		}
+		for (int i = 0; i < fakes; i++) {
+			addFakePreamble();
+		}
+		for (int i = 0; i < junk; i++) {
+			before[i] = rand() % (rtcmPieces + 1);
+		}
+		for (int position = 0; position <= rtcmPieces; position++) {
+			for (int i = 0; i < junk && rtcmPieces + i < numberOfPieces; i++) {
+				if (before[i] == position) {
+					Piece * piece = pieces + rtcmPieces + i;
+					fwrite(piece->data, 1, piece->length, stdout);
+				}
+			}
+			if (position < rtcmPieces) {
+				fwrite(pieces[position].data, 1, pieces[position].length, stdout);
+			}
+		}
+		for (int i = 0; i < numberOfPieces; i++) {
+			free(pieces[i].data);
+		}
+	}
+
+	free(before);
+	free(pieces);
+	free_rtcm(rtcm);
+	free(rtcm);
+	return 0;
+}
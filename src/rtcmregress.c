@@ -0,0 +1,343 @@
+/*
+ * rtcmregress.c
+ *
+ * Runs the filter and the decoder over a corpus of captures, writes the
+ * results to a file and compares them with a baseline.
+ *
+ *     rtcmregress [-n runs] [-t threshold] [-b baseline] [-o results] <filter> <capture> ...
+ *
+ * For each capture it measures:
+ *
+ *     framer_mb_per_s     getRtcmDataBlocks() in 1024-byte reads, in-process
+ *     decoder_mb_per_s    decode_rtcm3() over the frames that the framer found
+ *     filter_mb_per_s     the filter program run with "-M file -s <capture>"
+ *     latency_p50_ms      the filter's read-to-write latency percentiles,
+ *     latency_p99_ms          from its --latency statistics
+ *     latency_p999_ms
+ *     peak_rss_kb         the filter's peak resident set size
+ *
+ * Each is the best of the given number of runs (default 3).  The results go
+ * to the results file (default stdout), one "<capture>.<metric> <value>" per
+ * line, where <capture> is the name of the file without its directory and
+ * extension.
+ *
+ * If a baseline file (an earlier results file) is given, each metric is
+ * compared with it, and the exit status is 1 if any is worse by more than
+ * the threshold (default 10 percent).  Small absolute changes in the latency
+ * and the RSS are ignored, as they're mostly noise.
+ */
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "rtcmfilter.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+#define READ_SIZE 1024
+#define MAX_METRICS 256
+#define MAX_NAME_LENGTH 128
+
+int verboseMode = 0;
+
+// How to judge a metric - whether higher is better, and the least change
+// that counts as a regression whatever the threshold.
+typedef struct metricKind {
+	const char * name;
+	int higherIsBetter;
+	double slack;
+} MetricKind;
+
+static const MetricKind metricKinds[] = {
+	{"framer_mb_per_s", TRUE, 0.0},
+	{"decoder_mb_per_s", TRUE, 0.0},
+	{"filter_mb_per_s", TRUE, 0.0},
+	{"latency_p50_ms", FALSE, 0.05},
+	{"latency_p99_ms", FALSE, 0.1},
+	{"latency_p999_ms", FALSE, 0.5},
+	{"peak_rss_kb", FALSE, 512.0},
+};
+
+#define NUMBER_OF_KINDS (sizeof(metricKinds) / sizeof(metricKinds[0]))
+
+typedef struct metric {
+	char name[MAX_NAME_LENGTH];
+	double value;
+} Metric;
+
+static Metric results[MAX_METRICS];
+static int numberOfResults = 0;
+
+static void usage(char * name) {
+	fprintf(stderr, "usage: %s [-n runs] [-t threshold] [-b baseline] [-o results] <filter> <capture> ...\n",
+			name);
+	exit(1);
+}
+
+static double secondsSince(const struct timespec * start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static unsigned char * readStream(const char * path, size_t * length) {
+	FILE * file = fopen(path, "rb");
+	if (file == NULL) {
+		perror(path);
+		exit(1);
+	}
+	struct stat status;
+	fstat(fileno(file), &status);
+	unsigned char * stream = malloc(status.st_size > 0 ? status.st_size : 1);
+	*length = fread(stream, 1, status.st_size, file);
+	fclose(file);
+	return stream;
+}
+
+static const MetricKind * kindOf(const char * name) {
+	const char * dot = strrchr(name, '.');
+	for (size_t i = 0; i < NUMBER_OF_KINDS; i++) {
+		if (dot != NULL && strcmp(dot + 1, metricKinds[i].name) == 0) {
+			return metricKinds + i;
+		}
+	}
+	return NULL;
+}
+
+// record keeps the best value of a metric over the runs.
+static void record(const char * capture, const char * metric, double value) {
+	char name[MAX_NAME_LENGTH];
+	snprintf(name, sizeof(name), "%s.%s", capture, metric);
+	const MetricKind * kind = kindOf(name);
+	for (int i = 0; i < numberOfResults; i++) {
+		if (strcmp(results[i].name, name) == 0) {
+			if (kind->higherIsBetter ? value > results[i].value : value < results[i].value) {
+				results[i].value = value;
+			}
+			return;
+		}
+	}
+	if (numberOfResults < MAX_METRICS) {
+		strcpy(results[numberOfResults].name, name);
+		results[numberOfResults].value = value;
+		numberOfResults++;
+	}
+}
+
+// measureFramer times getRtcmDataBlocks() and then decode_rtcm3() on the
+// frames that it found.
+static void measureFramer(const char * capture, unsigned char * stream, size_t length) {
+	rtcm_t * rtcm = malloc(sizeof(rtcm_t));
+	init_rtcm(rtcm);
+
+	Buffer * frames = createBuffer(0);
+	resetFraming();
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < length; i += READ_SIZE) {
+		Buffer input;
+		input.content = stream + i;
+		input.length = length - i < READ_SIZE ? length - i : READ_SIZE;
+		Buffer * output = getRtcmDataBlocks(input, rtcm);
+		if (output != NULL) {
+			if (output->length > 0) {
+				frames = addMessageFragmentToBuffer(frames, output->content, output->length);
+			}
+			freeBuffer(output);
+		}
+	}
+	record(capture, "framer_mb_per_s", length / secondsSince(&start) / 1e6);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t i = 0;
+	while (i + LENGTH_OF_HEADER <= frames->length) {
+		size_t frameLength = getbitu(frames->content + i, 14, 10) + LENGTH_OF_HEADER + LENGTH_OF_CRC;
+		if (i + frameLength > frames->length) {
+			break;
+		}
+		memcpy(rtcm->buff, frames->content + i, frameLength);
+		rtcm->len = frameLength - LENGTH_OF_CRC;
+		rtcm->nbyte = 0;
+		decode_rtcm3(rtcm);
+		i += frameLength;
+	}
+	record(capture, "decoder_mb_per_s", i / secondsSince(&start) / 1e6);
+
+	freeBuffer(frames);
+	free_rtcm(rtcm);
+	free(rtcm);
+}
+
+// measureFilter runs the filter program on the capture and reads the
+// latency percentiles from its stats file.
+static void measureFilter(const char * capture, const char * filter, const char * path, size_t length) {
+	char statsFile[] = "/tmp/rtcmregressXXXXXX";
+	int statsFd = mkstemp(statsFile);
+	if (statsFd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(statsFd);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid_t pid = fork();
+	if (pid == 0) {
+		int nullFd = open("/dev/null", O_WRONLY);
+		dup2(nullFd, 1);
+		dup2(nullFd, 2);
+		execl(filter, filter, "-M", "file", "-s", path, "--latency", "--stats-file", statsFile,
+				(char *) NULL);
+		_exit(127);
+	}
+	int status;
+	struct rusage usage;
+	wait4(pid, &status, 0, &usage);
+	double seconds = secondsSince(&start);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "ERROR: %s failed on %s\n", filter, path);
+		exit(1);
+	}
+	record(capture, "filter_mb_per_s", length / seconds / 1e6);
+	record(capture, "peak_rss_kb", usage.ru_maxrss);
+
+	FILE * file = fopen(statsFile, "r");
+	if (file != NULL) {
+		char line[256];
+		unsigned long frames;
+		double p50, p99, p999, max;
+		while (fgets(line, sizeof(line), file) != NULL) {
+			if (sscanf(line, "latency all: %lu frames, p50 %lf ms, p99 %lf ms, p999 %lf ms, max %lf ms",
+					&frames, &p50, &p99, &p999, &max) == 5) {
+				record(capture, "latency_p50_ms", p50);
+				record(capture, "latency_p99_ms", p99);
+				record(capture, "latency_p999_ms", p999);
+			}
+		}
+		fclose(file);
+	}
+	unlink(statsFile);
+}
+
+// compare checks the results against the baseline and returns the number
+// of regressions.
+static int compare(const char * baselineFile, double threshold) {
+	FILE * file = fopen(baselineFile, "r");
+	if (file == NULL) {
+		perror(baselineFile);
+		exit(1);
+	}
+	int regressions = 0;
+	char name[MAX_NAME_LENGTH];
+	double baseline;
+	while (fscanf(file, "%127s %lf", name, &baseline) == 2) {
+		const MetricKind * kind = kindOf(name);
+		Metric * result = NULL;
+		for (int i = 0; i < numberOfResults; i++) {
+			if (strcmp(results[i].name, name) == 0) {
+				result = results + i;
+			}
+		}
+		if (kind == NULL) {
+			continue;
+		}
+		if (result == NULL) {
+			fprintf(stderr, "%-40s baseline %12.3f now missing  REGRESSION\n", name, baseline);
+			regressions++;
+			continue;
+		}
+		double worse = kind->higherIsBetter ? baseline - result->value : result->value - baseline;
+		double percent = baseline != 0.0 ? 100.0 * worse / baseline : 0.0;
+		int regressed = worse > kind->slack && percent > threshold;
+		fprintf(stderr, "%-40s baseline %12.3f now %12.3f  %+6.1f%%%s\n", name, baseline, result->value,
+				kind->higherIsBetter ? -percent : percent, regressed ? "  REGRESSION" : "");
+		if (regressed) {
+			regressions++;
+		}
+	}
+	fclose(file);
+	return regressions;
+}
+
+int main(int argc, char ** argv) {
+	int runs = 3;
+	double threshold = 10.0;
+	const char * baselineFile = NULL;
+	const char * resultsFile = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:t:b:o:")) != -1) {
+		switch (opt) {
+		case 'n': runs = atoi(optarg); break;
+		case 't': threshold = atof(optarg); break;
+		case 'b': baselineFile = optarg; break;
+		case 'o': resultsFile = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (runs < 1 || threshold < 0 || argc - optind < 2) {
+		usage(argv[0]);
+	}
+	const char * filter = argv[optind];
+
+	// Run the filter program before the heap grows, as the memory of this
+	// process counts towards the child's peak RSS until the exec.
+	for (int pass = 0; pass < 2; pass++) {
+		for (int arg = optind + 1; arg < argc; arg++) {
+			char path[strlen(argv[arg]) + 1];
+			strcpy(path, argv[arg]);
+			char * capture = basename(path);
+			char * extension = strrchr(capture, '.');
+			if (extension != NULL) {
+				*extension = '\0';
+			}
+			struct stat status;
+			if (stat(argv[arg], &status) < 0) {
+				perror(argv[arg]);
+				exit(1);
+			}
+			if (pass == 0) {
+				for (int run = 0; run < runs; run++) {
+					measureFilter(capture, filter, argv[arg], status.st_size);
+				}
+			} else {
+				size_t length;
+				unsigned char * stream = readStream(argv[arg], &length);
+				for (int run = 0; run < runs; run++) {
+					measureFramer(capture, stream, length);
+				}
+				free(stream);
+			}
+		}
+	}
+
+	FILE * out = stdout;
+	if (resultsFile != NULL && (out = fopen(resultsFile, "w")) == NULL) {
+		perror(resultsFile);
+		exit(1);
+	}
+	for (int i = 0; i < numberOfResults; i++) {
+		fprintf(out, "%s %.3f\n", results[i].name, results[i].value);
+	}
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	if (baselineFile != NULL) {
+		int regressions = compare(baselineFile, threshold);
+		if (regressions > 0) {
+			fprintf(stderr, "%d metrics worse than the baseline by more than %.1f%%\n",
+					regressions, threshold);
+			return 1;
+		}
+	}
+	return 0;
+}
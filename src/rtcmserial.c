@@ -0,0 +1,359 @@
+/*
+ * rtcmserial.c
+ *
+ * Runs the filter on a pseudo-terminal, as if a receiver were attached to a
+ * serial port, so the SERIAL input path can be measured without a GPS.
+ *
+ *     rtcmserial [-b baud] [-g tick] [-t seconds] <stream> <filter> [<filter option> ...]
+ *
+ * The harness creates a pseudo-terminal pair and runs the filter with
+ * "-M serial -i /dev/pts/N -b <baud>", plus any options given after the
+ * filter's name.  Once the filter has put the port into raw mode, the
+ * stream (for example one written by rtcmgen) is written to the master side
+ * at the line rate of the given baud rate (default 115200, ten bits to the
+ * byte), in whatever bytes are due every tick (default 1000 microseconds,
+ * the latency timer of a typical USB serial adapter).  Writing stops at the
+ * end of the stream or after the given time (default 10 seconds).
+ *
+ * The filter's output is read from a pipe.  Each frame that comes out is
+ * found in the input, and its latency is the time from writing its last
+ * byte to the master to reading it from the filter.  The read sizes come
+ * from the filter's metrics file, and the wakeups are its voluntary context
+ * switches.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "rtcmfilter.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+#define BITS_PER_BYTE 10		// With a start bit and a stop bit.
+#define MAX_FILTER_ARGUMENTS 64
+#define RAW_MODE_TIMEOUT 5.0	// Seconds to wait for the filter to open the port.
+#define DRAIN_TIME 0.5			// Seconds to wait for the last output.
+
+// A write to the master side, to find when each input byte was sent.
+typedef struct chunk {
+	size_t end;				// The offset just past the last byte written.
+	double time;
+} Chunk;
+
+static void usage(char * name) {
+	fprintf(stderr, "usage: %s [-b baud] [-g tick] [-t seconds] <stream> <filter> [<filter option> ...]\n",
+			name);
+	exit(1);
+}
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static unsigned char * readStream(const char * path, size_t * length) {
+	FILE * file = fopen(path, "rb");
+	if (file == NULL) {
+		perror(path);
+		exit(1);
+	}
+	struct stat status;
+	fstat(fileno(file), &status);
+	unsigned char * stream = malloc(status.st_size > 0 ? status.st_size : 1);
+	*length = fread(stream, 1, status.st_size, file);
+	fclose(file);
+	return stream;
+}
+
+// timeWritten returns the time when the byte at the given offset was written.
+static double timeWritten(const Chunk * chunks, size_t numberOfChunks, size_t offset) {
+	size_t low = 0;
+	size_t high = numberOfChunks;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (chunks[middle].end <= offset) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low < numberOfChunks ? chunks[low].time : 0.0;
+}
+
+static int compareDoubles(const void * a, const void * b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const double * sorted, size_t count, double fraction) {
+	if (count == 0) {
+		return 0.0;
+	}
+	size_t index = (size_t) (fraction * count);
+	return sorted[index < count ? index : count - 1];
+}
+
+// readMetric returns the value of a metric in the filter's metrics file.
+static unsigned long readMetric(const char * path, const char * name) {
+	FILE * file = fopen(path, "r");
+	if (file == NULL) {
+		return 0;
+	}
+	char line[256];
+	unsigned long value = 0;
+	size_t length = strlen(name);
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strncmp(line, name, length) == 0 && line[length] == ' ') {
+			value = strtoul(line + length + 1, NULL, 10);
+		}
+	}
+	fclose(file);
+	return value;
+}
+
+// printReadSizes prints the buckets of the read size histogram that have
+// reads in them.
+static void printReadSizes(const char * path) {
+	FILE * file = fopen(path, "r");
+	if (file == NULL) {
+		return;
+	}
+	char line[256];
+	unsigned long previous = 0;
+	printf("read sizes:");
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char bound[32];
+		unsigned long cumulative;
+		if (sscanf(line, "rtcmfilter_read_size_bytes_bucket{le=\"%31[^\"]\"} %lu", bound, &cumulative) == 2) {
+			if (cumulative > previous) {
+				printf(" <=%s: %lu", bound, cumulative - previous);
+			}
+			previous = cumulative;
+		}
+	}
+	printf("\n");
+	fclose(file);
+}
+
+int main(int argc, char ** argv) {
+	int baud = 115200;
+	long tick = 1000;
+	double duration = 10.0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "+b:g:t:")) != -1) {
+		switch (opt) {
+		case 'b': baud = atoi(optarg); break;
+		case 'g': tick = atol(optarg); break;
+		case 't': duration = atof(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2 || baud <= 0 || tick <= 0 || duration <= 0
+			|| argc - optind - 2 > MAX_FILTER_ARGUMENTS - 10) {
+		usage(argv[0]);
+	}
+	size_t length;
+	unsigned char * stream = readStream(argv[optind], &length);
+	const char * filter = argv[optind + 1];
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		perror("ERROR: can't create a pseudo-terminal");
+		exit(1);
+	}
+	char * slaveName = strdup(ptsname(master));
+	// Hold the slave open to watch its settings and so that the master
+	// doesn't see a hangup between the filter's open and close.
+	int slave = open(slaveName, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror(slaveName);
+		exit(1);
+	}
+
+	char metricsFile[] = "/tmp/rtcmserialXXXXXX";
+	int metricsFd = mkstemp(metricsFile);
+	if (metricsFd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(metricsFd);
+
+	int output[2];
+	if (pipe(output) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	char baudString[16];
+	snprintf(baudString, sizeof(baudString), "%d", baud);
+	char * arguments[MAX_FILTER_ARGUMENTS];
+	int n = 0;
+	arguments[n++] = (char *) filter;
+	arguments[n++] = "-M";
+	arguments[n++] = "serial";
+	arguments[n++] = "-i";
+	arguments[n++] = slaveName;
+	arguments[n++] = "-b";
+	arguments[n++] = baudString;
+	arguments[n++] = "--metrics-file";
+	arguments[n++] = metricsFile;
+	for (int i = optind + 2; i < argc; i++) {
+		arguments[n++] = argv[i];
+	}
+	arguments[n] = NULL;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(master);
+		close(slave);
+		close(output[0]);
+		dup2(output[1], 1);
+		execv(filter, arguments);
+		perror(filter);
+		_exit(127);
+	}
+	close(output[1]);
+
+	// Wait until the filter has opened the port and made it raw.  Until then
+	// the line discipline would echo and mangle what's written.
+	double start = now();
+	struct termios termios;
+	while (tcgetattr(slave, &termios) == 0 && (termios.c_lflag & ICANON)) {
+		if (now() - start > RAW_MODE_TIMEOUT || waitpid(pid, NULL, WNOHANG) != 0) {
+			fprintf(stderr, "ERROR: the filter didn't open %s\n", slaveName);
+			kill(pid, SIGKILL);
+			exit(1);
+		}
+		usleep(10000);
+	}
+	fcntl(master, F_SETFL, O_NONBLOCK);
+
+	size_t maxChunks = 1024;
+	size_t numberOfChunks = 0;
+	Chunk * chunks = malloc(maxChunks * sizeof(Chunk));
+	size_t outputSize = 64 * 1024;
+	size_t outputLength = 0;
+	unsigned char * out = malloc(outputSize);
+	size_t parsed = 0;			// Output up to here has been matched with the input.
+	size_t searchFrom = 0;		// Input up to here has been matched with the output.
+	size_t maxLatencies = 1024;
+	size_t numberOfLatencies = 0;
+	double * latencies = malloc(maxLatencies * sizeof(double));
+	unsigned long unmatched = 0;
+
+	start = now();
+	size_t written = 0;
+	double finished = 0.0;
+	int outputOpen = TRUE;
+	while (outputOpen) {
+		double time = now();
+		if (finished == 0.0) {
+			size_t due = (size_t) ((time - start) * baud / BITS_PER_BYTE);
+			if (due > length) {
+				due = length;
+			}
+			if (due > written) {
+				ssize_t result = write(master, stream + written, due - written);
+				if (result > 0) {
+					written += result;
+					if (numberOfChunks == maxChunks) {
+						maxChunks *= 2;
+						chunks = realloc(chunks, maxChunks * sizeof(Chunk));
+					}
+					chunks[numberOfChunks].end = written;
+					chunks[numberOfChunks].time = now();
+					numberOfChunks++;
+				}
+			}
+			if (written == length || time - start >= duration) {
+				finished = time;
+			}
+		} else if (time - finished > DRAIN_TIME) {
+			break;
+		}
+
+		struct pollfd pollfd = {output[0], POLLIN, 0};
+		struct timespec timeout = {0, tick * 1000};
+		if (ppoll(&pollfd, 1, &timeout, NULL) <= 0) {
+			continue;
+		}
+		if (outputLength == outputSize) {
+			outputSize *= 2;
+			out = realloc(out, outputSize);
+		}
+		ssize_t result = read(output[0], out + outputLength, outputSize - outputLength);
+		double arrived = now();
+		if (result <= 0) {
+			outputOpen = result < 0 && errno == EINTR;
+			continue;
+		}
+		outputLength += result;
+
+		// Match each complete frame that has arrived with the input.
+		while (parsed + LENGTH_OF_HEADER <= outputLength) {
+			size_t frameLength = (((out[parsed + 1] & 0x3) << 8) | out[parsed + 2])
+					+ LENGTH_OF_HEADER + LENGTH_OF_CRC;
+			if (parsed + frameLength > outputLength) {
+				break;
+			}
+			unsigned char * found = memmem(stream + searchFrom, written - searchFrom,
+					out + parsed, frameLength);
+			if (found == NULL) {
+				unmatched++;
+			} else {
+				size_t end = found - stream + frameLength;
+				if (numberOfLatencies == maxLatencies) {
+					maxLatencies *= 2;
+					latencies = realloc(latencies, maxLatencies * sizeof(double));
+				}
+				latencies[numberOfLatencies++] = arrived - timeWritten(chunks, numberOfChunks, end - 1);
+				searchFrom = end;
+			}
+			parsed += frameLength;
+		}
+	}
+	double elapsed = (finished > 0.0 ? finished : now()) - start;
+
+	kill(pid, SIGINT);
+	int status;
+	struct rusage usage;
+	wait4(pid, &status, 0, &usage);
+
+	unsigned long reads = readMetric(metricsFile, "rtcmfilter_reads_total");
+	unsigned long readBytes = readMetric(metricsFile, "rtcmfilter_read_size_bytes_sum");
+	printf("%d baud, %zu bytes in %.3f s, %lu reads (%.0f per second), %.1f bytes per read\n",
+			baud, written, elapsed, reads, reads / elapsed, reads > 0 ? (double) readBytes / reads : 0.0);
+	printReadSizes(metricsFile);
+	printf("wakeups: %ld voluntary context switches (%.0f per second), %.3f s CPU\n",
+			usage.ru_nvcsw, usage.ru_nvcsw / elapsed,
+			usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+			+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+	qsort(latencies, numberOfLatencies, sizeof(double), compareDoubles);
+	printf("latency: %zu frames, p50 %.3f ms, p99 %.3f ms, max %.3f ms",
+			numberOfLatencies, percentile(latencies, numberOfLatencies, 0.5) * 1000,
+			percentile(latencies, numberOfLatencies, 0.99) * 1000,
+			numberOfLatencies > 0 ? latencies[numberOfLatencies - 1] * 1000 : 0.0);
+	if (unmatched > 0) {
+		printf(", %lu frames not found in the input", unmatched);
+	}
+	printf("\n");
+
+	unlink(metricsFile);
+	close(slave);
+	close(master);
+	return unmatched > 0 ? 1 : 0;
+}
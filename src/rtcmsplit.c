@@ -0,0 +1,220 @@
+/*
+ * rtcmsplit.c
+ *
+ * Checks that the framer's output doesn't depend on how the input is split
+ * into reads, and measures what small reads cost.
+ *
+ *     rtcmsplit [-f] [-l length] [-s seed] <stream>
+ *
+ * The stream (for example one written by rtcmgen) is first fed to
+ * getRtcmDataBlocks() in one piece, which gives the reference output.  Then
+ * the first <length> bytes (default 4096) are split at every possible
+ * offset, into two reads and into three reads with a short middle one of
+ * one, two or three bytes, which covers a header that arrives in pieces and
+ * a frame spread over three reads.  Then the whole stream is fed in reads of
+ * a fixed size and of random sizes up to that, for each power of two from 1
+ * to 4096.  The output of each must be byte-identical to the reference.  The
+ * throughput at each fixed read size is reported.
+ *
+ * With -f, the reads are fed to the framer of librtcmfilter instead, and the
+ * frames that it hands over are checked against the same reference.
+ *
+ * The exit status is 1 if any output differs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rtcmfilter.h"
+#include "rtcmframer.h"
+
+#define DEFAULT_SPLIT_LENGTH 4096
+#define MAX_READ_SIZE 4096
+
+int verboseMode = 0;
+
+static RtcmFramer * framer = NULL;	// Set if testing the library's framer.
+static Buffer * framed = NULL;		// Where the library's framer puts its frames.
+
+static void usage(char * name) {
+	fprintf(stderr, "usage: %s [-f] [-l length] [-s seed] <stream>\n", name);
+	exit(1);
+}
+
+static unsigned char * readStream(const char * path, size_t * length) {
+	FILE * file = fopen(path, "rb");
+	if (file == NULL) {
+		perror(path);
+		exit(1);
+	}
+	struct stat status;
+	fstat(fileno(file), &status);
+	unsigned char * stream = malloc(status.st_size > 0 ? status.st_size : 1);
+	*length = fread(stream, 1, status.st_size, file);
+	fclose(file);
+	return stream;
+}
+
+// collect appends a frame from the library's framer to the output.
+static void collect(const unsigned char * frame, size_t length, unsigned int type __attribute__((__unused__)),
+		unsigned int stationID __attribute__((__unused__)), int64_t epoch __attribute__((__unused__)),
+		void * context __attribute__((__unused__))) {
+	framed = addMessageFragmentToBuffer(framed, (unsigned char *) frame, length);
+}
+
+// feed passes one read to the framer and appends what comes out to the output.
+static Buffer * feed(Buffer * output, unsigned char * data, size_t length, rtcm_t * rtcm) {
+	if (framer != NULL) {
+		framed = output;
+		rtcmFramerPush(framer, data, length);
+		return framed;
+	}
+	Buffer input;
+	input.content = data;
+	input.length = length;
+	Buffer * result = getRtcmDataBlocks(input, rtcm);
+	if (result != NULL) {
+		if (result->length > 0) {
+			output = addMessageFragmentToBuffer(output, result->content, result->length);
+		}
+		freeBuffer(result);
+	}
+	return output;
+}
+
+// process feeds the stream in reads of the given sizes and returns the output.
+// With no sizes, the whole stream is one read.  If a read size is given but
+// no list, the reads are all that size or, if random is set, of random sizes
+// up to it.
+static Buffer * process(unsigned char * stream, size_t length, const size_t * splits, int numberOfSplits,
+		size_t readSize, int random, rtcm_t * rtcm) {
+	Buffer * output = createBuffer(0);
+	resetFraming();
+	if (framer != NULL) {
+		rtcmFramerReset(framer);
+	}
+	if (numberOfSplits > 0) {
+		size_t start = 0;
+		for (int i = 0; i < numberOfSplits; i++) {
+			output = feed(output, stream + start, splits[i] - start, rtcm);
+			start = splits[i];
+		}
+		output = feed(output, stream + start, length - start, rtcm);
+	} else if (readSize > 0) {
+		size_t i = 0;
+		while (i < length) {
+			size_t size = random ? 1 + (size_t) rand() % readSize : readSize;
+			if (size > length - i) {
+				size = length - i;
+			}
+			output = feed(output, stream + i, size, rtcm);
+			i += size;
+		}
+	} else {
+		output = feed(output, stream, length, rtcm);
+	}
+	return output;
+}
+
+static int sameOutput(const Buffer * reference, const Buffer * output) {
+	return reference->length == output->length
+			&& memcmp(reference->content, output->content, output->length) == 0;
+}
+
+int main(int argc, char ** argv) {
+	size_t splitLength = DEFAULT_SPLIT_LENGTH;
+	unsigned int seed = 1;
+	int useLibrary = FALSE;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "fl:s:")) != -1) {
+		switch (opt) {
+		case 'f': useLibrary = TRUE; break;
+		case 'l': splitLength = strtoul(optarg, NULL, 10); break;
+		case 's': seed = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+	srand(seed);
+
+	size_t length;
+	unsigned char * stream = readStream(argv[optind], &length);
+	rtcm_t * rtcm = malloc(sizeof(rtcm_t));
+	init_rtcm(rtcm);
+	int failures = 0;
+
+	// The reference always comes from getRtcmDataBlocks().
+	Buffer * fullReference = process(stream, length, NULL, 0, 0, FALSE, rtcm);
+	if (splitLength > length) {
+		splitLength = length;
+	}
+	Buffer * reference = process(stream, splitLength, NULL, 0, 0, FALSE, rtcm);
+	if (useLibrary) {
+		framer = rtcmFramerCreate(collect, NULL);
+	}
+
+	// Split a prefix of the stream at every offset.
+	unsigned long splitsTried = 0;
+	for (size_t offset = 1; offset < splitLength; offset++) {
+		size_t splits[2] = {offset, 0};
+		Buffer * output = process(stream, splitLength, splits, 1, 0, FALSE, rtcm);
+		splitsTried++;
+		if (!sameOutput(reference, output)) {
+			fprintf(stderr, "output differs when split at %zu\n", offset);
+			failures++;
+		}
+		freeBuffer(output);
+		for (size_t middle = 1; middle <= 3 && offset + middle < splitLength; middle++) {
+			splits[1] = offset + middle;
+			output = process(stream, splitLength, splits, 2, 0, FALSE, rtcm);
+			splitsTried++;
+			if (!sameOutput(reference, output)) {
+				fprintf(stderr, "output differs when split at %zu and %zu\n", offset, splits[1]);
+				failures++;
+			}
+			freeBuffer(output);
+		}
+	}
+	printf("%lu splits of the first %zu bytes, %zu bytes of output each, %d differ\n",
+			splitsTried, splitLength, reference->length, failures);
+	freeBuffer(reference);
+
+	// Feed the whole stream in reads of each size.
+	reference = fullReference;
+	for (size_t readSize = 1; readSize <= MAX_READ_SIZE; readSize *= 2) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		Buffer * output = process(stream, length, NULL, 0, readSize, FALSE, rtcm);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		int same = sameOutput(reference, output);
+		freeBuffer(output);
+
+		output = process(stream, length, NULL, 0, readSize, TRUE, rtcm);
+		int sameRandom = sameOutput(reference, output);
+		freeBuffer(output);
+
+		printf("read size %4zu: %8.2f MB/s, %10.0f reads/s, output %s, random sizes up to %zu %s\n",
+				readSize, length / seconds / 1e6, (length + readSize - 1) / readSize / seconds,
+				same ? "same" : "DIFFERS", readSize, sameRandom ? "same" : "DIFFER");
+		if (!same || !sameRandom) {
+			failures++;
+		}
+	}
+	freeBuffer(reference);
+
+	if (framer != NULL) {
+		rtcmFramerDestroy(framer);
+	}
+	free_rtcm(rtcm);
+	free(rtcm);
+	free(stream);
+	return failures > 0 ? 1 : 0;
+}
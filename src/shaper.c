@@ -0,0 +1,270 @@
+/*
+ * shaper.c
+ *
+ * A token bucket that limits the rate of the output.
+ *
+ * The bucket fills with tokens at the configured rate in bytes per second, up
+ * to the burst size.  Sending a message costs a token per byte.  Messages are
+ * never split - a message is only sent when there are enough tokens for the
+ * whole of it - so the burst size must be at least the size of the largest
+ * RTCM message.
+ *
+ * When there are not enough tokens, messages are deferred in a queue for
+ * each priority.  The observations (MSM and the legacy observation messages)
+ * have the highest priority, then the ephemerides, then the station
+ * information and finally anything else.  The queues are emptied highest
+ * priority first and in order of arrival within a priority.  The space for
+ * deferred messages is limited to the burst size.  When it's full, the oldest
+ * message of the lowest priority below that of the new message is dropped to
+ * make room, or if there is none, the new message is dropped.  Observations
+ * are no use to a rover once they are stale, so any that have been deferred
+ * for more than a second are dropped.
+ *
+ * So a receiver that sends more than the configured rate loses its least
+ * important messages first and can't saturate a shared uplink.
+ *
+ * The deferrals, drops and bytes sent are counted in the metrics registry
+ * (see metrics.c) as well as in the totals, along with the tokens in the
+ * bucket and the bytes waiting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtcmfilter.h"
+
+#define PRIORITY_OBSERVATIONS 0
+#define PRIORITY_EPHEMERIS 1
+#define PRIORITY_STATION 2
+#define PRIORITY_OTHER 3
+#define NUMBER_OF_PRIORITIES SHAPER_PRIORITIES
+
+#define MAX_OBSERVATION_DEFERRAL 1.0	// seconds
+
+static const char * priorityNames[NUMBER_OF_PRIORITIES] = {
+	"observations", "ephemeris", "station", "other"
+};
+
+typedef struct deferredMessage {
+	struct deferredMessage * next;
+	struct timespec arrived;
+	struct timespec readTime;	// For the latency, zero if there is none.
+	int deferred;				// TRUE once it has been counted as deferred.
+	size_t length;
+	unsigned char content[];
+} DeferredMessage;
+
+typedef struct messageQueue {
+	DeferredMessage * head;
+	DeferredMessage * tail;
+} MessageQueue;
+
+static int shaping = FALSE;
+static double rate = 0.0;				// Bytes per second.
+static double burst = 0.0;				// Bytes.
+static double tokens = 0.0;
+static struct timespec lastRefill;
+
+static MessageQueue queues[NUMBER_OF_PRIORITIES];
+static size_t deferredBytes = 0;
+
+// Statistics.
+static unsigned long int shaperDeferredSoFar[NUMBER_OF_PRIORITIES];
+static unsigned long int shaperDroppedSoFar[NUMBER_OF_PRIORITIES];
+static unsigned long long shaperBytesDroppedSoFar = 0;
+static unsigned long long shaperBytesSentSoFar = 0;
+
+static double secondsBetween(const struct timespec * start, const struct timespec * finish) {
+	return (finish->tv_sec - start->tv_sec) + (finish->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int getPriority(unsigned int type) {
+	switch (type) {
+	case 1001: case 1002: case 1003: case 1004:
+	case 1009: case 1010: case 1011: case 1012:
+		return PRIORITY_OBSERVATIONS;
+	case 63: case 1019: case 1020: case 1041: case 1042:
+	case 1043: case 1044: case 1045: case 1046:
+		return PRIORITY_EPHEMERIS;
+	case 1005: case 1006: case 1007: case 1008: case 1033: case 1230:
+		return PRIORITY_STATION;
+	default:
+		return isMsmMessage(type) ? PRIORITY_OBSERVATIONS : PRIORITY_OTHER;
+	}
+}
+
+static void refill(const struct timespec * now) {
+	tokens += secondsBetween(&lastRefill, now) * rate;
+	if (tokens > burst) {
+		tokens = burst;
+	}
+	lastRefill = *now;
+}
+
+static void dropHead(int priority) {
+	DeferredMessage * message = queues[priority].head;
+	queues[priority].head = message->next;
+	if (queues[priority].head == NULL) {
+		queues[priority].tail = NULL;
+	}
+	deferredBytes -= message->length;
+	shaperDroppedSoFar[priority]++;
+	shaperBytesDroppedSoFar += message->length;
+	countShaperDropped(priority, message->length);
+	free(message);
+}
+
+// setShaping limits the output to the rate in bytes per second with the given
+// burst size.  Returns FALSE if the burst can't hold the largest message.
+int setShaping(long bytesPerSecond, long burstSize) {
+	if (bytesPerSecond <= 0 || burstSize < MAX_RTCM_MESSAGE_LENGTH) {
+		return FALSE;
+	}
+	rate = bytesPerSecond;
+	burst = burstSize;
+	tokens = burst;
+	clock_gettime(CLOCK_MONOTONIC, &lastRefill);
+	shaping = TRUE;
+	setShaperLevels(tokens, 0);
+	return TRUE;
+}
+
+int shapingOutput() {
+	return shaping;
+}
+
+size_t getShaperBurst() {
+	return (size_t) burst;
+}
+
+const char * getShaperPriorityName(int priority) {
+	return priorityNames[priority];
+}
+
+// shapeMessage queues a complete RTCM message to be sent when the tokens
+// allow, with the time of the read that completed it, which may be NULL.
+void shapeMessage(const unsigned char * message, size_t length, unsigned int type,
+		const struct timespec * readTime) {
+	int priority = getPriority(type);
+
+	// Make room if necessary, dropping lower priority messages first.
+	while (deferredBytes + length > burst) {
+		int victim = NUMBER_OF_PRIORITIES - 1;
+		while (victim > priority && queues[victim].head == NULL) {
+			victim--;
+		}
+		if (victim <= priority) {
+			shaperDroppedSoFar[priority]++;
+			shaperBytesDroppedSoFar += length;
+			countShaperDropped(priority, length);
+			return;
+		}
+		dropHead(victim);
+	}
+
+	DeferredMessage * deferred = malloc(sizeof(DeferredMessage) + length);
+	deferred->next = NULL;
+	deferred->deferred = FALSE;
+	deferred->length = length;
+	clock_gettime(CLOCK_MONOTONIC, &deferred->arrived);
+	if (readTime != NULL) {
+		deferred->readTime = *readTime;
+	} else {
+		deferred->readTime.tv_sec = 0;
+		deferred->readTime.tv_nsec = 0;
+	}
+	memcpy(deferred->content, message, length);
+	if (queues[priority].tail == NULL) {
+		queues[priority].head = deferred;
+	} else {
+		queues[priority].tail->next = deferred;
+	}
+	queues[priority].tail = deferred;
+	deferredBytes += length;
+}
+
+// takeShapedMessages copies the queued messages that can be sent now into the
+// output buffer and returns their total length.  The buffer must be at least
+// the burst size.  If readTimes isn't NULL, the read time of each message is
+// copied into it as well, starting at the entry given by taken.  The number
+// of messages is added to taken.
+// Messages that stay in the queue are counted as deferred.
+size_t takeShapedMessages(unsigned char * output, struct timespec * readTimes, int * taken) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	refill(&now);
+
+	// Drop stale observations.
+	while (queues[PRIORITY_OBSERVATIONS].head != NULL
+			&& secondsBetween(&queues[PRIORITY_OBSERVATIONS].head->arrived, &now) > MAX_OBSERVATION_DEFERRAL) {
+		dropHead(PRIORITY_OBSERVATIONS);
+	}
+
+	size_t length = 0;
+	for (int priority = 0; priority < NUMBER_OF_PRIORITIES; priority++) {
+		while (queues[priority].head != NULL) {
+			DeferredMessage * message = queues[priority].head;
+			if (message->length > tokens) {
+				// Later messages must wait behind this one.
+				for (int p = priority; p < NUMBER_OF_PRIORITIES; p++) {
+					for (DeferredMessage * m = queues[p].head; m != NULL; m = m->next) {
+						if (!m->deferred) {
+							m->deferred = TRUE;
+							shaperDeferredSoFar[p]++;
+							countShaperDeferred(p);
+						}
+					}
+				}
+				setShaperLevels(tokens, deferredBytes);
+				return length;
+			}
+			memcpy(output + length, message->content, message->length);
+			if (readTimes != NULL) {
+				readTimes[*taken] = message->readTime;
+			}
+			(*taken)++;
+			length += message->length;
+			tokens -= message->length;
+			shaperBytesSentSoFar += message->length;
+			countShaperSent(message->length);
+			deferredBytes -= message->length;
+			queues[priority].head = message->next;
+			if (queues[priority].head == NULL) {
+				queues[priority].tail = NULL;
+			}
+			free(message);
+		}
+	}
+	setShaperLevels(tokens, deferredBytes);
+	return length;
+}
+
+// getShaperTimeout returns the number of milliseconds until the next queued
+// message can be sent, or -1 if nothing is queued.
+long getShaperTimeout() {
+	for (int priority = 0; priority < NUMBER_OF_PRIORITIES; priority++) {
+		if (queues[priority].head != NULL) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			refill(&now);
+			double needed = queues[priority].head->length - tokens;
+			return needed <= 0.0 ? 0 : (long) (needed * 1000.0 / rate) + 1;
+		}
+	}
+	return -1;
+}
+
+void displayShaperTotals() {
+	if (!shaping) {
+		return;
+	}
+	fprintf(stderr, "shaper: %.0f bytes/s, burst %.0f, %.0f tokens, %lld bytes sent, %ld bytes waiting, %lld bytes dropped",
+			rate, burst, tokens, shaperBytesSentSoFar, deferredBytes, shaperBytesDroppedSoFar);
+	for (int priority = 0; priority < NUMBER_OF_PRIORITIES; priority++) {
+		fprintf(stderr, ", %s %ld deferred %ld dropped", priorityNames[priority],
+				shaperDeferredSoFar[priority], shaperDroppedSoFar[priority]);
+	}
+	fprintf(stderr, ".\n");
+}
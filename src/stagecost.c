@@ -0,0 +1,137 @@
+/*
+ * stagecost.c
+ *
+ * Accounts for the time that the filter spends in each stage of processing.
+ *
+ * When the CPU is busy it's useful to know which part of the filter is
+ * responsible.  The work is split into stages - the scan for the start of
+ * each frame (including gathering fragments), the CRC check, the decoding of
+ * each message type, the rest of the processing of a frame (the filters and
+ * the rewriting of MSMs) and the output write.  The filter announces each
+ * change of stage with ENTER_STAGE(), which reads the monotonic clock and
+ * charges the time since the last change to the stage that's ending.  Time
+ * spent waiting for input is not charged to anything.
+ *
+ * The accounting is turned on at run time.  When it's off, ENTER_STAGE() is a
+ * test of a flag, so it can be left in the hot paths.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtcmfilter.h"
+
+#define LENGTH_OF_HEADER 3
+#define LENGTH_OF_CRC 3
+#define NUMBER_OF_MESSAGE_TYPES 4096
+
+typedef struct stageCost {
+	uint64_t nanoseconds;
+	unsigned long frames;
+	unsigned long long bytes;
+} StageCost;
+
+static const char * stageNames[NUMBER_OF_STAGES] = {
+	"none", "scan", "crc", "decode", "process", "output"
+};
+
+int stageCosting = FALSE;
+
+static StageCost stages[NUMBER_OF_STAGES];
+static StageCost decodeByType[NUMBER_OF_MESSAGE_TYPES];
+static int currentStage = STAGE_NONE;
+static unsigned int currentType = 0;
+static uint64_t stageStarted = 0;
+
+void setStageCosting() {
+	stageCosting = TRUE;
+}
+
+static uint64_t nanosecondsNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// enterStage charges the time since the last change to the current stage and
+// starts the given one.  Use ENTER_STAGE(), which does nothing if the costs
+// are not being measured.
+void enterStage(int stage) {
+	if (stage == currentStage) {
+		return;
+	}
+	uint64_t now = nanosecondsNow();
+	if (currentStage != STAGE_NONE) {
+		uint64_t elapsed = now - stageStarted;
+		stages[currentStage].nanoseconds += elapsed;
+		if (currentStage == STAGE_DECODE) {
+			decodeByType[currentType].nanoseconds += elapsed;
+		}
+	}
+	currentStage = stage;
+	stageStarted = now;
+}
+
+// enterDecodeStage starts decoding a frame of the given type.
+void enterDecodeStage(unsigned int type, size_t length) {
+	enterStage(STAGE_DECODE);
+	currentType = type % NUMBER_OF_MESSAGE_TYPES;
+	decodeByType[currentType].frames++;
+	decodeByType[currentType].bytes += length;
+	stages[STAGE_DECODE].frames++;
+	stages[STAGE_DECODE].bytes += length;
+}
+
+// countStage counts frames and bytes handled by a stage.
+void countStage(int stage, unsigned long frames, size_t bytes) {
+	stages[stage].frames += frames;
+	stages[stage].bytes += bytes;
+}
+
+// countFramesWritten counts the complete messages in a run that's written.
+unsigned long countFramesWritten(const unsigned char * messages, size_t length) {
+	unsigned long frames = 0;
+	size_t i = 0;
+	while (i + LENGTH_OF_HEADER <= length) {
+		i += getbitu(messages + i, 14, 10) + LENGTH_OF_HEADER + LENGTH_OF_CRC;
+		frames++;
+	}
+	return frames;
+}
+
+static void writeCost(FILE * out, const char * name, const StageCost * cost, uint64_t total) {
+	fprintf(out, "cost %s: %.3f ms (%.1f%%), %ld frames, %lld bytes, %.0f ns per frame, %.1f ns per byte\n",
+			name, cost->nanoseconds / 1e6,
+			total > 0 ? 100.0 * cost->nanoseconds / total : 0.0,
+			cost->frames, cost->bytes,
+			cost->frames > 0 ? (double) cost->nanoseconds / cost->frames : 0.0,
+			cost->bytes > 0 ? (double) cost->nanoseconds / cost->bytes : 0.0);
+}
+
+// writeCostStats writes the time spent in each stage and in decoding each
+// message type.
+void writeCostStats(FILE * out) {
+	if (!stageCosting) {
+		return;
+	}
+	uint64_t total = 0;
+	for (int stage = STAGE_NONE + 1; stage < NUMBER_OF_STAGES; stage++) {
+		total += stages[stage].nanoseconds;
+	}
+	for (int stage = STAGE_NONE + 1; stage < NUMBER_OF_STAGES; stage++) {
+		writeCost(out, stageNames[stage], stages + stage, total);
+	}
+	for (int type = 0; type < NUMBER_OF_MESSAGE_TYPES; type++) {
+		if (decodeByType[type].frames > 0) {
+			char name[24];
+			sprintf(name, "decode %d", type);
+			writeCost(out, name, decodeByType + type, total);
+		}
+	}
+}
+
+void resetStageCostTotals() {
+	memset(stages, 0, sizeof(stages));
+	memset(decodeByType, 0, sizeof(decodeByType));
+}
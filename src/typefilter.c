@@ -0,0 +1,230 @@
+/*
+ * typefilter.c
+ *
+ * Allow and deny lists of RTCM message types.
+ *
+ * The message type is a 12-bit number, so the set of types that may pass is
+ * held as a bitmap of 4096 bits and checking a message costs one bit test.
+ * Initially every type is allowed.  If an allow list is given, only the types
+ * in it are allowed.  The types in a deny list are then removed.
+ *
+ * A list is a comma-separated mixture of types (1005), ranges of types
+ * (1071-1077) and the names of groups of types:
+ *
+ *     msm        all Multiple Signal Messages, 1071-1127
+ *     msm1 ... msm7
+ *                the MSMs of that level for every constellation,
+ *                for example msm4 is 1074, 1084, 1094, 1104, 1114 and 1124
+ *     ssr        State Space Representation corrections, 1057-1068, 1240-1270
+ *                and the IGS SSR messages 4076
+ *     ephemeris  broadcast ephemerides, 1019, 1020, 1041-1046 and 63
+ *     station    station and antenna information, 1005-1008, 1033 and 1230
+ *
+ * There are also presets that set up the lists for common cases:
+ *
+ *     msm4-only  deny every MSM except MSM4
+ *     no-ssr     deny the SSR messages
+ *
+ * The number of messages of each type that are dropped is counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtcmfilter.h"
+
+#define NUMBER_OF_TYPES 4096
+#define BITS_PER_WORD 64
+
+static uint64_t allowed[NUMBER_OF_TYPES / BITS_PER_WORD];
+static int filterInitialised = FALSE;
+static int allowListGiven = FALSE;
+
+static unsigned long int droppedByType[NUMBER_OF_TYPES];
+static unsigned long int droppedSoFar = 0;
+
+static void setType(uint64_t * bitmap, unsigned int type) {
+	bitmap[type / BITS_PER_WORD] |= (uint64_t) 1 << (type % BITS_PER_WORD);
+}
+
+static void clearType(uint64_t * bitmap, unsigned int type) {
+	bitmap[type / BITS_PER_WORD] &= ~((uint64_t) 1 << (type % BITS_PER_WORD));
+}
+
+static void initialiseFilter() {
+	if (!filterInitialised) {
+		memset(allowed, 0xff, sizeof(allowed));
+		filterInitialised = TRUE;
+	}
+}
+
+// addGroup sets the bits for a named group of types.  Returns FALSE if the
+// name is not known.
+static int addGroup(uint64_t * bitmap, const char * name) {
+	unsigned int type;
+
+	if (strcmp(name, "msm") == 0) {
+		for (type = 1071; type <= 1127; type++) {
+			if (isMsmMessage(type)) {
+				setType(bitmap, type);
+			}
+		}
+	} else if (strncmp(name, "msm", 3) == 0 && name[3] >= '1' && name[3] <= '7' && name[4] == '\0') {
+		for (type = 1070 + name[3] - '0'; type <= 1127; type += 10) {
+			setType(bitmap, type);
+		}
+	} else if (strcmp(name, "ssr") == 0) {
+		for (type = 1057; type <= 1068; type++) {
+			setType(bitmap, type);
+		}
+		for (type = 1240; type <= 1270; type++) {
+			setType(bitmap, type);
+		}
+		setType(bitmap, 4076);
+	} else if (strcmp(name, "ephemeris") == 0) {
+		setType(bitmap, 63);
+		setType(bitmap, 1019);
+		setType(bitmap, 1020);
+		for (type = 1041; type <= 1046; type++) {
+			setType(bitmap, type);
+		}
+	} else if (strcmp(name, "station") == 0) {
+		for (type = 1005; type <= 1008; type++) {
+			setType(bitmap, type);
+		}
+		setType(bitmap, 1033);
+		setType(bitmap, 1230);
+	} else {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// parseMessageTypes sets the bits in a 4096-bit bitmap for the types in the
+// list.  Returns FALSE if the list is not valid.
+int parseMessageTypes(const char * list, uint64_t * bitmap) {
+	char * copy = strdup(list);
+	char * saveptr = NULL;
+	int result = TRUE;
+
+	for (char * item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		char * end;
+		long first = strtol(item, &end, 10);
+		if (end == item) {
+			if (!addGroup(bitmap, item)) {
+				fprintf(stderr, "ERROR: unknown message type group <%s>\n", item);
+				result = FALSE;
+			}
+			continue;
+		}
+		long last = first;
+		if (*end == '-') {
+			char * start = end + 1;
+			last = strtol(start, &end, 10);
+			if (end == start) {
+				last = -1;
+			}
+		}
+		if (*end != '\0' || first < 0 || last < first || last >= NUMBER_OF_TYPES) {
+			fprintf(stderr, "ERROR: can't convert <%s> to a message type or range\n", item);
+			result = FALSE;
+			continue;
+		}
+		for (long type = first; type <= last; type++) {
+			setType(bitmap, type);
+		}
+	}
+
+	free(copy);
+	return result;
+}
+
+// allowMessageTypes allows the types in the list.  The first call disallows
+// every other type.  Returns FALSE if the list is not valid.
+int allowMessageTypes(const char * list) {
+	uint64_t types[NUMBER_OF_TYPES / BITS_PER_WORD] = {0};
+	if (!parseMessageTypes(list, types)) {
+		return FALSE;
+	}
+	if (!allowListGiven) {
+		memset(allowed, 0, sizeof(allowed));
+		filterInitialised = TRUE;
+		allowListGiven = TRUE;
+	}
+	for (int w = 0; w < NUMBER_OF_TYPES / BITS_PER_WORD; w++) {
+		allowed[w] |= types[w];
+	}
+	return TRUE;
+}
+
+// denyMessageTypes disallows the types in the list.  Returns FALSE if the list
+// is not valid.
+int denyMessageTypes(const char * list) {
+	uint64_t types[NUMBER_OF_TYPES / BITS_PER_WORD] = {0};
+	if (!parseMessageTypes(list, types)) {
+		return FALSE;
+	}
+	initialiseFilter();
+	for (int w = 0; w < NUMBER_OF_TYPES / BITS_PER_WORD; w++) {
+		allowed[w] &= ~types[w];
+	}
+	return TRUE;
+}
+
+// applyMessageTypePreset applies one of the presets.  Returns FALSE if the
+// name is not known.
+int applyMessageTypePreset(const char * name) {
+	if (strcmp(name, "msm4-only") == 0) {
+		uint64_t types[NUMBER_OF_TYPES / BITS_PER_WORD] = {0};
+		addGroup(types, "msm");
+		for (unsigned int type = 1074; type <= 1124; type += 10) {
+			clearType(types, type);
+		}
+		initialiseFilter();
+		for (int w = 0; w < NUMBER_OF_TYPES / BITS_PER_WORD; w++) {
+			allowed[w] &= ~types[w];
+		}
+		return TRUE;
+	}
+	if (strcmp(name, "no-ssr") == 0) {
+		return denyMessageTypes("ssr");
+	}
+	fprintf(stderr, "ERROR: unknown message type preset <%s>\n", name);
+	return FALSE;
+}
+
+// messageTypeAllowed returns true if messages of the type may pass.  If not,
+// the message is counted as dropped.
+int messageTypeAllowed(unsigned int type) {
+	if (!filterInitialised) {
+		return TRUE;
+	}
+	type &= NUMBER_OF_TYPES - 1;
+	if (allowed[type / BITS_PER_WORD] & ((uint64_t) 1 << (type % BITS_PER_WORD))) {
+		return TRUE;
+	}
+	droppedByType[type]++;
+	droppedSoFar++;
+	return FALSE;
+}
+
+void resetTypeFilterTotals() {
+	memset(droppedByType, 0, sizeof(droppedByType));
+	droppedSoFar = 0;
+}
+
+void displayTypeFilterTotals() {
+	if (droppedSoFar == 0) {
+		return;
+	}
+	fprintf(stderr, "type filter: %ld dropped", droppedSoFar);
+	const char * separator = ": ";
+	for (int type = 0; type < NUMBER_OF_TYPES; type++) {
+		if (droppedByType[type] > 0) {
+			fprintf(stderr, "%s%ld %d", separator, droppedByType[type], type);
+			separator = ", ";
+		}
+	}
+	fprintf(stderr, ".\n");
+}